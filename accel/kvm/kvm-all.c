@@ -28,6 +28,7 @@
 #include "hw/s390x/adapter.h"
 #include "exec/gdbstub.h"
 #include "sysemu/kvm_int.h"
+#include "sysemu/kvm_dirty_ring.h"
 #include "sysemu/runstate.h"
 #include "sysemu/cpus.h"
 #include "sysemu/sysemu.h"
@@ -37,6 +38,8 @@
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "hw/irq.h"
 #include "sysemu/sev.h"
@@ -69,6 +72,8 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    /* The kernel keeps the dirty ring of a parked vCPU going */
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -94,6 +99,10 @@ struct KVMState
     int intx_set_mask;
     bool sync_mmu;
     bool manual_dirty_log_protect;
+    /* Entries in the dirty ring of each vCPU, 0 if the rings are unused */
+    uint32_t kvm_dirty_ring_size;
+    uint32_t kvm_dirty_ring_bytes;
+    QemuThread kvm_dirty_ring_reaper;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -307,6 +316,183 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, boo
     return ret;
 }
 
+/*
+ * Dirty ring
+ *
+ * The pages harvested from the rings of the vCPUs are set directly in
+ * the dirty bitmaps of ram_list, so that a sync of the dirty log only
+ * costs as much as what was dirtied since the previous one.
+ * Harvesting is serialized by the BQL.
+ */
+
+typedef struct KVMDirtyRingReap {
+    KVMState *s;
+    /* Run of contiguous dirty pages not yet pushed to ram_list */
+    ram_addr_t start;
+    ram_addr_t length;
+} KVMDirtyRingReap;
+
+static KVMSlot *kvm_dirty_ring_find_slot(KVMState *s, uint32_t slot_id)
+{
+    int as_id = slot_id >> 16;
+    int id = slot_id & 0xffff;
+    int i;
+
+    for (i = 0; i < s->nr_as; i++) {
+        KVMMemoryListener *kml = s->as[i].ml;
+
+        if (kml && kml->as_id == as_id) {
+            return id < s->nr_slots ? &kml->slots[id] : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static void kvm_dirty_ring_push_run(KVMDirtyRingReap *r)
+{
+    uint8_t clients = DIRTY_CLIENTS_NOCODE;
+
+    if (!r->length) {
+        return;
+    }
+    if (!global_dirty_log) {
+        clients &= ~(1 << DIRTY_MEMORY_MIGRATION);
+    }
+    cpu_physical_memory_set_dirty_range(r->start, r->length, clients);
+    r->length = 0;
+}
+
+static void kvm_dirty_ring_mark_page(void *opaque, uint32_t slot_id,
+                                     uint64_t offset)
+{
+    KVMDirtyRingReap *r = opaque;
+    KVMSlot *mem = kvm_dirty_ring_find_slot(r->s, slot_id);
+    ram_addr_t addr;
+
+    /* The slot may have gone away since the page was dirtied */
+    if (!mem || offset >= mem->memory_size / qemu_real_host_page_size) {
+        return;
+    }
+
+    addr = mem->ram_start_offset + offset * qemu_real_host_page_size;
+    if (r->length && r->start + r->length == addr) {
+        r->length += qemu_real_host_page_size;
+        return;
+    }
+    kvm_dirty_ring_push_run(r);
+    r->start = addr;
+    r->length = qemu_real_host_page_size;
+}
+
+/* Called with the BQL held */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    KVMDirtyRingReap r = { .s = s };
+    int64_t stamp = get_clock();
+    uint64_t total = 0;
+    CPUState *cpu;
+    int ret;
+
+    assert(qemu_mutex_iothread_locked());
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_collect(cpu->kvm_dirty_gfns,
+                                            s->kvm_dirty_ring_size,
+                                            &cpu->kvm_fetch_index,
+                                            kvm_dirty_ring_mark_page, &r);
+        }
+    }
+    kvm_dirty_ring_push_run(&r);
+
+    /*
+     * Only now can the kernel recycle the entries and write-protect the
+     * pages again: from here on a new write is logged anew.
+     */
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        assert(ret == total);
+    }
+
+    trace_kvm_dirty_ring_reap(total, (get_clock() - stamp) / 1000);
+    return total;
+}
+
+static void do_kvm_dirty_ring_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+}
+
+/* Called with the BQL held */
+static void kvm_dirty_ring_flush(KVMState *s)
+{
+    CPUState *cpu;
+
+    /*
+     * The processor may log dirty pages into a per-vCPU buffer (e.g.
+     * Intel PML) that the kernel only moves to the ring when the vCPU
+     * leaves KVM_RUN, so kick every vCPU out first.
+     */
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_dirty_ring_kick, RUN_ON_CPU_NULL);
+    }
+    kvm_dirty_ring_reap(s);
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    /*
+     * Harvest the rings in the background, so that the next sync finds
+     * little left to do and the vCPUs rarely exit with a full ring.
+     */
+    while (true) {
+        g_usleep(G_USEC_PER_SEC);
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint64_t ring_size)
+{
+    uint64_t ring_bytes = ring_size * sizeof(struct kvm_dirty_gfn);
+    int ret;
+
+    if (!is_power_of_2(ring_size) || ring_bytes > UINT32_MAX) {
+        error_report("KVM dirty ring size %" PRIu64 " must be a power of two",
+                     ring_size);
+        return -EINVAL;
+    }
+
+    /* The capability returns the maximum size of the ring in bytes */
+    ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (ret <= 0) {
+        error_report("KVM dirty ring is not supported by the host kernel");
+        return -EINVAL;
+    }
+    if (ring_bytes > ret) {
+        error_report("KVM dirty ring size %" PRIu64 " too big (maximum is %zu)",
+                     ring_size, ret / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret) {
+        error_report("Enabling KVM dirty ring failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    s->kvm_dirty_ring_size = ring_size;
+    s->kvm_dirty_ring_bytes = ring_bytes;
+    return 0;
+}
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -333,15 +519,27 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Harvest what is left, the ring resumes from here if replugged */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -351,11 +549,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -367,7 +567,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -397,6 +597,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            cpu->kvm_dirty_gfns = NULL;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -961,6 +1174,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     MemoryRegion *mr = section->mr;
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr, size;
+    ram_addr_t ram_start_offset;
     void *ram;
 
     if (!memory_region_is_ram(mr)) {
@@ -981,6 +1195,18 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* use aligned delta to align the ram address */
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region +
+                       (start_addr - section->offset_within_address_space);
+
+    if (!add && kvm_state->kvm_dirty_ring_size) {
+        /*
+         * Harvest the pages the rings hold for the slot before it goes
+         * away.  As with KVM_GET_DIRTY_LOG, pages dirtied between this
+         * and the removal of the slot are not caught.
+         */
+        kvm_dirty_ring_reap(kvm_state);
+    }
 
     kvm_slots_lock(kml);
 
@@ -989,7 +1215,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         if (!mem) {
             goto out;
         }
-        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES &&
+            !kvm_state->kvm_dirty_ring_size) {
             kvm_physical_sync_dirty_bitmap(kml, section);
         }
 
@@ -1012,6 +1239,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = ram_start_offset;
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem, true);
@@ -1057,6 +1285,11 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_flush(kvm_state);
+}
+
 static void kvm_log_clear(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
@@ -1163,7 +1396,11 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (s->kvm_dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+    }
     kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
@@ -1778,6 +2015,7 @@ static int kvm_init(MachineState *ms)
     int ret;
     int type = 0;
     const char *kvm_type;
+    uint64_t ring_size;
 
     s = KVM_STATE(ms->accelerator);
 
@@ -1903,7 +2141,18 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
-    s->manual_dirty_log_protect =
+    ring_size = qemu_opt_get_number(qemu_opts_find(qemu_find_opts("accel"),
+                                                   NULL),
+                                    "dirty-ring-size", 0);
+    if (ring_size) {
+        ret = kvm_dirty_ring_init(s, ring_size);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    /* KVM_CLEAR_DIRTY_LOG is only useful with KVM_GET_DIRTY_LOG */
+    s->manual_dirty_log_protect = !s->kvm_dirty_ring_size &&
         kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
     if (s->manual_dirty_log_protect) {
         ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1);
@@ -2002,6 +2251,12 @@ static int kvm_init(MachineState *ms)
         qemu_balloon_inhibit(true);
     }
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->kvm_dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     return 0;
 
 err:
@@ -2301,6 +2556,17 @@ int kvm_cpu_exec(CPUState *cpu)
             qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * The vCPU cannot run until its ring has room again; harvest
+             * the rings of all vCPUs while at it.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_UNKNOWN:
             fprintf(stderr, "KVM: unknown exit, hardware reason %" PRIx64 "\n",
                     (uint64_t)run->hw.hardware_exit_reason);
@@ -321,10 +321,50 @@ static bool tb_lookup_cmp(const void *p, const void *d)
     return false;
 }
 
+/* Next way to replace in a full set of the L2 cache */
+static __thread unsigned int tb_l2_cache_victim;
+
+static TranslationBlock *tb_l2_cache_lookup(const struct tb_desc *desc,
+                                            uint32_t h)
+{
+    TBL2CacheSet *set = &tb_ctx.l2_cache[h & (TB_L2_CACHE_SETS - 1)];
+    int i;
+
+    for (i = 0; i < TB_L2_CACHE_WAYS; i++) {
+        TranslationBlock *tb = atomic_rcu_read(&set->tbs[i]);
+
+        if (tb && tb_lookup_cmp(tb, desc)) {
+            return tb;
+        }
+    }
+    return NULL;
+}
+
+static void tb_l2_cache_insert(TranslationBlock *tb, uint32_t h)
+{
+    TBL2CacheSet *set = &tb_ctx.l2_cache[h & (TB_L2_CACHE_SETS - 1)];
+    int i;
+
+    /*
+     * Two vCPUs may race to fill the same way, or insert the same TB
+     * twice; either way we only lose a bit of cache capacity.
+     */
+    for (i = 0; i < TB_L2_CACHE_WAYS; i++) {
+        if (atomic_read(&set->tbs[i]) == NULL) {
+            break;
+        }
+    }
+    if (i == TB_L2_CACHE_WAYS) {
+        i = tb_l2_cache_victim++ % TB_L2_CACHE_WAYS;
+    }
+    atomic_set(&set->tbs[i], tb);
+}
+
 TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
                                    target_ulong cs_base, uint32_t flags,
                                    uint32_t cf_mask)
 {
+    TranslationBlock *tb;
     tb_page_addr_t phys_pc;
     struct tb_desc desc;
     uint32_t h;
@@ -341,7 +381,19 @@ TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
     }
     desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
     h = tb_hash_func(phys_pc, pc, flags, cf_mask, *cpu->trace_dstate);
-    return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
+
+    tb = tb_l2_cache_lookup(&desc, h);
+    if (tb) {
+        atomic_set(&tcg_ctx->tb_l2_cache_hits, tcg_ctx->tb_l2_cache_hits + 1);
+        return tb;
+    }
+    atomic_set(&tcg_ctx->tb_l2_cache_misses, tcg_ctx->tb_l2_cache_misses + 1);
+
+    tb = qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
+    if (tb) {
+        tb_l2_cache_insert(tb, h);
+    }
+    return tb;
 }
 
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr)
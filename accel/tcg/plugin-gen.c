@@ -0,0 +1,195 @@
+/*
+ * plugin-gen.c - TCG-related bits of plugin infrastructure
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * We support instrumentation at an instruction granularity. That is,
+ * if a plugin wants to instrument the memory accesses performed by a
+ * particular instruction, it can just do that instead of instrumenting
+ * all memory accesses. Thus, in order to do this we first have to
+ * translate a TB, so that plugins can decide what/where to instrument.
+ *
+ * Injecting the desired instrumentation could be done with a second
+ * translation pass that combined the instrumentation requests, but that
+ * would be ugly and inefficient since we would decode the guest code twice.
+ * Instead, during TB translation we emit a call to a helper at every
+ * point that can be instrumented: the start of the TB, the start of each
+ * instruction and after each memory access.  Each call takes as argument
+ * the descriptor of the TB or instruction it belongs to.
+ *
+ * Once the TB is translated and the plugins have registered their
+ * callbacks on those descriptors, the calls that nobody is interested in
+ * are removed from the op stream.  The temporaries that fed them become
+ * dead and are dropped by the liveness pass, so uninstrumented code is
+ * generated exactly as if no plugin was loaded.
+ *
+ * Inline operations are not expanded into TCG ops; they are run by the
+ * same helpers, before or after the regular callbacks depending on the
+ * order in which they were registered.
+ */
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "tcg/tcg.h"
+#include "tcg/tcg-op.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
+#include "exec/helper-gen.h"
+#include "exec/translator.h"
+#include "exec/plugin-gen.h"
+
+/*
+ * Upper bound on the bytes we report for one instruction.  Targets
+ * sometimes advance pc_next past an instruction that faults because it
+ * is too long; there is no point in reading further than this.
+ */
+#define PLUGIN_MAX_INSN_SIZE 64
+
+void HELPER(plugin_tb_exec)(CPUArchState *env, void *opaque)
+{
+    struct qemu_plugin_tb *tb = opaque;
+
+    qemu_plugin_run_udata_cbs(env_cpu(env)->cpu_index, tb->exec_cbs);
+}
+
+void HELPER(plugin_insn_exec)(CPUArchState *env, void *opaque)
+{
+    struct qemu_plugin_insn *insn = opaque;
+
+    qemu_plugin_run_udata_cbs(env_cpu(env)->cpu_index, insn->exec_cbs);
+}
+
+void HELPER(plugin_mem_exec)(CPUArchState *env, target_ulong vaddr,
+                             uint32_t info, void *opaque)
+{
+    struct qemu_plugin_insn *insn = opaque;
+
+    qemu_plugin_run_mem_cbs(env_cpu(env)->cpu_index, insn->mem_cbs,
+                            vaddr, info);
+}
+
+static bool plugin_cbs_empty(GArray *cbs)
+{
+    return cbs == NULL || cbs->len == 0;
+}
+
+bool plugin_gen_tb_start(CPUState *cpu, const TranslationBlock *tb)
+{
+    struct qemu_plugin_tb *ptb;
+    TCGv_ptr arg;
+
+    if (!qemu_plugin_tb_trans_enabled()) {
+        return false;
+    }
+
+    ptb = qemu_plugin_tb_new(tb->pc);
+    tcg_ctx->plugin_tb = ptb;
+    tcg_ctx->plugin_insn = NULL;
+
+    arg = tcg_const_ptr(ptb);
+    gen_helper_plugin_tb_exec(cpu_env, arg);
+    ptb->exec_op = tcg_last_op();
+    tcg_temp_free_ptr(arg);
+
+    return true;
+}
+
+void plugin_gen_insn_start(CPUState *cpu, const DisasContextBase *db)
+{
+    struct qemu_plugin_insn *insn;
+    TCGv_ptr arg;
+
+    insn = qemu_plugin_insn_new(tcg_ctx->plugin_tb, db->pc_next);
+    tcg_ctx->plugin_insn = insn;
+
+    arg = tcg_const_ptr(insn);
+    gen_helper_plugin_insn_exec(cpu_env, arg);
+    insn->exec_op = tcg_last_op();
+    tcg_temp_free_ptr(arg);
+}
+
+void plugin_gen_insn_end(void)
+{
+    tcg_ctx->plugin_insn = NULL;
+}
+
+/*
+ * Called by the tcg_gen_qemu_{ld,st}* functions after the access, with
+ * a copy of the address taken before it (a load may overwrite it).
+ */
+void plugin_gen_empty_mem_callback(TCGv addr, uint32_t info)
+{
+    struct qemu_plugin_insn *insn = tcg_ctx->plugin_insn;
+    TCGv_i32 meminfo = tcg_const_i32(info);
+    TCGv_ptr arg = tcg_const_ptr(insn);
+
+    gen_helper_plugin_mem_exec(cpu_env, addr, meminfo, arg);
+    g_ptr_array_add(insn->mem_ops, tcg_last_op());
+    tcg_temp_free_ptr(arg);
+    tcg_temp_free_i32(meminfo);
+}
+
+/*
+ * Record the bytes of each instruction, so that the plugins can look
+ * at them from their translation callback.  The code has just been
+ * read by the translator, so these loads cannot fault.
+ */
+static void plugin_gen_insn_data(CPUState *cpu, const DisasContextBase *db,
+                                 struct qemu_plugin_tb *ptb)
+{
+    CPUArchState *env = cpu->env_ptr;
+    size_t i, n = ptb->insns->len;
+
+    for (i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = g_ptr_array_index(ptb->insns, i);
+        uint64_t end, size, j;
+
+        if (i + 1 < n) {
+            struct qemu_plugin_insn *next = g_ptr_array_index(ptb->insns,
+                                                              i + 1);
+            end = next->vaddr;
+        } else {
+            end = db->pc_next;
+        }
+        size = end > insn->vaddr ? end - insn->vaddr : 0;
+        size = MIN(size, PLUGIN_MAX_INSN_SIZE);
+
+        for (j = 0; j < size; j++) {
+            uint8_t byte = cpu_ldub_code(env, insn->vaddr + j);
+
+            g_byte_array_append(insn->data, &byte, 1);
+        }
+    }
+}
+
+void plugin_gen_tb_end(CPUState *cpu, const DisasContextBase *db)
+{
+    struct qemu_plugin_tb *ptb = tcg_ctx->plugin_tb;
+    size_t i, j;
+
+    tcg_ctx->plugin_insn = NULL;
+    plugin_gen_insn_data(cpu, db, ptb);
+
+    /* let the plugins register their callbacks for this block */
+    qemu_plugin_tb_trans_cb(ptb);
+
+    /* and drop the calls that turned out to be unneeded */
+    if (plugin_cbs_empty(ptb->exec_cbs)) {
+        tcg_op_remove(tcg_ctx, ptb->exec_op);
+    }
+    for (i = 0; i < ptb->insns->len; i++) {
+        struct qemu_plugin_insn *insn = g_ptr_array_index(ptb->insns, i);
+
+        if (plugin_cbs_empty(insn->exec_cbs)) {
+            tcg_op_remove(tcg_ctx, insn->exec_op);
+        }
+        if (plugin_cbs_empty(insn->mem_cbs)) {
+            for (j = 0; j < insn->mem_ops->len; j++) {
+                tcg_op_remove(tcg_ctx, g_ptr_array_index(insn->mem_ops, j));
+            }
+        }
+    }
+
+    tcg_ctx->plugin_tb = NULL;
+}
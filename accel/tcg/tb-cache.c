@@ -0,0 +1,574 @@
+/*
+ * Persistent translation cache for user-mode emulation
+ *
+ * Short-lived guest programs (compilers, build tools run through
+ * binfmt_misc...) spend most of their time translating code that the
+ * previous invocation already translated.  This file saves the host
+ * code generated for a guest binary and loads it back on the next run.
+ *
+ * Generated code is not relocatable: it calls helpers and returns to the
+ * prologue through absolute or pc-relative addresses, and exit_tb embeds
+ * the address of its TranslationBlock.  Rather than relocating it, each
+ * translation is restored at the same offset in code_gen_buffer that it
+ * was generated at.  The cache file records the layout it is valid for
+ * (QEMU binary, host CPU features, code_gen_buffer and prologue placement,
+ * guest_base) and is discarded if anything differs.  On load, the part of
+ * code_gen_buffer used by the cached translations is reserved; new
+ * translations are generated after it and appended to the file at exit.
+ *
+ * On x86-64 hosts, a code_gen_buffer above 4GB is only ever reached
+ * through pc-relative operands: helpers and the epilogue with rel32
+ * branches, TranslationBlocks with rip-relative lea.  The static buffer
+ * of user mode moves together with the text of a position-independent
+ * QEMU, so there the layout is keyed on the distances between them and
+ * the cache survives address space randomization.  Other hosts may encode
+ * such addresses as immediates and need the exact same addresses.
+ *
+ * Translations are restored lazily, when tb_gen_code() is asked for one,
+ * and only if the guest code they were generated from is unchanged: the
+ * guest bytes are saved with each of them and compared on restore.
+ * Translations that embed other host pointers (see tcg_const_ptr) are
+ * never saved.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "exec/tb-cache.h"
+#include "exec/tb-hash.h"
+#include "tcg.h"
+#include "elf.h"
+#include "trace.h"
+#ifdef CONFIG_CPUID_H
+#include "qemu/cpuid.h"
+#endif
+#ifdef CONFIG_PLUGIN
+#include "qemu/plugin.h"
+#endif
+#include <zlib.h>
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    2
+
+/* Everything the saved host code depends on besides the guest code */
+typedef struct TBCacheLayout {
+    uint64_t exe_ino;
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t host_features[4];
+    /* absolute, or relative to the text and prologue if slide-invariant */
+    uint64_t text_anchor;
+    uint64_t prologue;
+    uint64_t region_start;
+    uint64_t region_size;
+    uint64_t guest_base;
+    uint32_t tb_struct_size;
+    uint32_t icache_linesize;
+} TBCacheLayout;
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    /* bytes of the region, from its start, used by the entries */
+    uint64_t reserved;
+    TBCacheLayout layout;
+} TBCacheHeader;
+
+/*
+ * Each entry is followed by @size bytes of guest code, then by the host
+ * code and search data, and padded to a multiple of 8 bytes.
+ */
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint16_t size;
+    uint16_t icount;
+    /* offsets from the start of the region */
+    uint32_t tb_offset;
+    uint32_t code_offset;
+    uint32_t code_size;
+    uint32_t search_size;
+    uint16_t jmp_reset_offset[2];
+    uint32_t jmp_insn_offset[2];
+    uint32_t unused;
+} TBCacheEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(TBCacheHeader) % 8);
+QEMU_BUILD_BUG_ON(sizeof(TBCacheEntry) % 8);
+
+static struct {
+    char *path;
+    TBCacheHeader header;
+    bool restoring;
+    bool recording;
+    void *base;
+    /* translations ending past @limit are not recorded */
+    size_t limit;
+    /*
+     * Maps an entry to itself while it can be restored, to NULL once
+     * it has been restored or if it was generated by this run.
+     */
+    GHashTable *index;
+    /* entries loaded from the cache file */
+    void *map;
+    size_t map_size;
+    const uint8_t *entries;
+    size_t entries_len;
+    uint32_t n_entries;
+    /* entries generated by this run */
+    GByteArray *records;
+    uint32_t n_records;
+    size_t records_end;
+    TranslationBlock *last_tb;
+    size_t last_len;
+    size_t last_end;
+} tb_cache;
+
+static size_t tb_cache_entry_len(const TBCacheEntry *e)
+{
+    return ROUND_UP(sizeof(*e) + e->size + e->code_size + e->search_size, 8);
+}
+
+static guint tb_cache_hash(gconstpointer p)
+{
+    const TBCacheEntry *e = p;
+
+    return tb_hash_func(e->pc, e->pc, e->flags, e->cflags,
+                        e->trace_vcpu_dstate);
+}
+
+static gboolean tb_cache_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheEntry *ea = a;
+    const TBCacheEntry *eb = b;
+
+    return ea->pc == eb->pc &&
+           ea->cs_base == eb->cs_base &&
+           ea->flags == eb->flags &&
+           ea->cflags == eb->cflags &&
+           ea->trace_vcpu_dstate == eb->trace_vcpu_dstate;
+}
+
+static void tb_cache_host_features(uint64_t *features)
+{
+    features[0] = qemu_getauxval(AT_HWCAP);
+    features[1] = qemu_getauxval(AT_HWCAP2);
+#ifdef CONFIG_CPUID_H
+    {
+        int max = __get_cpuid_max(0, NULL);
+        unsigned int a, b, c, d;
+
+        /* the TCG backend picks instructions according to these */
+        if (max >= 1) {
+            __cpuid(1, a, b, c, d);
+            features[2] = ((uint64_t)c << 32) | d;
+        }
+        if (max >= 7) {
+            __cpuid_count(7, 0, a, b, c, d);
+            features[3] = ((uint64_t)c << 32) | b;
+        }
+    }
+#endif
+}
+
+/*
+ * Whether the generated code stays valid if QEMU, and code_gen_buffer
+ * with it, is loaded at another address.
+ */
+static bool tb_cache_slide_invariant(void)
+{
+#if defined(__x86_64__)
+    /* below 4GB, tcg_out_movi encodes TB pointers as imm32 */
+    return (uintptr_t)tcg_ctx->code_gen_prologue > UINT32_MAX;
+#else
+    return false;
+#endif
+}
+
+static bool tb_cache_get_layout(TBCacheLayout *layout)
+{
+    struct stat st;
+
+    memset(layout, 0, sizeof(*layout));
+    if (stat("/proc/self/exe", &st) < 0) {
+        return false;
+    }
+    layout->exe_ino = st.st_ino;
+    layout->exe_size = st.st_size;
+    layout->exe_mtime = st.st_mtime;
+    tb_cache_host_features(layout->host_features);
+    /* catches a position-independent QEMU loaded at another address */
+    layout->text_anchor = (uintptr_t)tb_cache_get_layout;
+    layout->prologue = (uintptr_t)tcg_ctx->code_gen_prologue;
+    layout->region_start = (uintptr_t)tcg_ctx->code_gen_buffer;
+    layout->region_size = tcg_ctx->code_gen_buffer_size;
+    layout->guest_base = guest_base;
+    if (tb_cache_slide_invariant()) {
+        layout->text_anchor = 0;
+        layout->prologue = layout->region_start - layout->prologue;
+        layout->region_start -= (uintptr_t)tb_cache_get_layout;
+        /*
+         * guest_base is in a segment or register unless it fits a
+         * displacement, then it is part of the code.
+         */
+        if (guest_base > INT32_MAX) {
+            layout->guest_base = UINT64_MAX;
+        }
+    }
+    layout->tb_struct_size = sizeof(TranslationBlock);
+    layout->icache_linesize = qemu_icache_linesize;
+    return true;
+}
+
+static bool tb_cache_hash_file(const char *path, uint32_t *crc, uint64_t *size)
+{
+    g_autofree uint8_t *buf = g_malloc(64 * KiB);
+    uLong c = crc32(0, NULL, 0);
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    *size = 0;
+    do {
+        n = read(fd, buf, 64 * KiB);
+        if (n > 0) {
+            c = crc32(c, buf, n);
+            *size += n;
+        }
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    close(fd);
+
+    *crc = c;
+    return n == 0;
+}
+
+static bool tb_cache_entry_valid(const TBCacheEntry *e, size_t reserved)
+{
+    size_t code_offset;
+
+    code_offset = ROUND_UP(e->tb_offset + sizeof(TranslationBlock),
+                           qemu_icache_linesize);
+    return e->size != 0 &&
+           e->code_offset == code_offset &&
+           (uint64_t)e->code_offset + e->code_size + e->search_size
+               <= reserved;
+}
+
+static void tb_cache_load(void)
+{
+    const TBCacheHeader *hdr;
+    const uint8_t *p, *end;
+    struct stat st;
+    uint32_t i;
+    void *map;
+    int fd;
+
+    fd = open(tb_cache.path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    hdr = map;
+    if (memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC)) ||
+        hdr->version != TB_CACHE_VERSION ||
+        memcmp(&hdr->layout, &tb_cache.header.layout, sizeof(hdr->layout)) ||
+        hdr->reserved > tb_cache.limit) {
+        goto discard;
+    }
+
+    p = map + sizeof(*hdr);
+    end = map + st.st_size;
+    for (i = 0; i < hdr->n_entries; i++) {
+        const TBCacheEntry *e = (const TBCacheEntry *)p;
+
+        if (end - p < sizeof(*e) || end - p < tb_cache_entry_len(e) ||
+            !tb_cache_entry_valid(e, hdr->reserved)) {
+            goto discard;
+        }
+        /* keep the first of duplicate entries, like tb_cache_record */
+        if (!g_hash_table_contains(tb_cache.index, e)) {
+            g_hash_table_insert(tb_cache.index, (gpointer)e, (gpointer)e);
+        }
+        p += tb_cache_entry_len(e);
+    }
+
+    tb_cache.map = map;
+    tb_cache.map_size = st.st_size;
+    tb_cache.entries = map + sizeof(*hdr);
+    tb_cache.entries_len = p - tb_cache.entries;
+    tb_cache.n_entries = hdr->n_entries;
+    tb_cache.header.reserved = hdr->reserved;
+    trace_tb_cache_load(tb_cache.path, hdr->n_entries, hdr->reserved);
+    return;
+
+ discard:
+    trace_tb_cache_discard(tb_cache.path);
+    g_hash_table_remove_all(tb_cache.index);
+    munmap(map, st.st_size);
+}
+
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model)
+{
+    g_autofree char *params = NULL;
+    uint32_t crc;
+    uint64_t size;
+
+#ifdef CONFIG_PLUGIN
+    if (qemu_plugin_tb_trans_enabled()) {
+        warn_report("The translation cache cannot be used with plugins");
+        return;
+    }
+#endif
+    if (!tb_cache_hash_file(exec_path, &crc, &size)) {
+        warn_report("Could not read %s, translation cache disabled",
+                    exec_path);
+        return;
+    }
+    if (!tb_cache_get_layout(&tb_cache.header.layout)) {
+        warn_report("Could not identify the QEMU binary, "
+                    "translation cache disabled");
+        return;
+    }
+    if (g_mkdir_with_parents(dir, 0755) < 0) {
+        warn_report("Could not create %s: %s", dir, strerror(errno));
+        return;
+    }
+
+    params = g_strdup_printf("%s %s", TARGET_NAME, cpu_model ?: "");
+    tb_cache.path = g_strdup_printf("%s/%s-%08" PRIx32 "-%" PRIx64
+                                    "-%08lx.tbc", dir, TARGET_NAME, crc, size,
+                                    crc32(0, (const Bytef *)params,
+                                          strlen(params)));
+    memcpy(tb_cache.header.magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    tb_cache.header.version = TB_CACHE_VERSION;
+
+    /* leave at least half of the buffer to uncached translations */
+    tb_cache.base = tcg_ctx->code_gen_buffer;
+    tb_cache.limit = (tcg_ctx->code_gen_highwater - tb_cache.base) / 2;
+    tb_cache.index = g_hash_table_new(tb_cache_hash, tb_cache_equal);
+    tb_cache.records = g_byte_array_new();
+
+    tb_cache_load();
+
+    /* new translations go after the ones that can be restored */
+    tcg_ctx->code_gen_ptr = tb_cache.base + tb_cache.header.reserved;
+    tb_cache.records_end = tb_cache.header.reserved;
+    tb_cache.restoring = true;
+    tb_cache.recording = true;
+}
+
+TranslationBlock *tb_cache_restore(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint32_t flags,
+                                   uint32_t cflags)
+{
+    TBCacheEntry key;
+    const TBCacheEntry *e;
+    const uint8_t *guest;
+    TranslationBlock *tb;
+    gpointer orig, value;
+
+    if (!tb_cache.restoring || cpu->singlestep_enabled || singlestep) {
+        return NULL;
+    }
+
+    key.pc = pc;
+    key.cs_base = cs_base;
+    key.flags = flags;
+    key.cflags = cflags;
+    key.trace_vcpu_dstate = *cpu->trace_dstate;
+    if (!g_hash_table_lookup_extended(tb_cache.index, &key, &orig, &value) ||
+        value == NULL) {
+        return NULL;
+    }
+    e = value;
+
+    /* the guest code must be the one the entry was generated from */
+    guest = (const uint8_t *)(e + 1);
+    if (page_check_range(pc, e->size, PAGE_READ) < 0 ||
+        memcmp(g2h(pc), guest, e->size)) {
+        return NULL;
+    }
+
+    /*
+     * A slot can only be filled once: after invalidation, the TB that
+     * occupies it may still be executing on another vCPU.
+     */
+    g_hash_table_insert(tb_cache.index, orig, NULL);
+
+    tb = tb_cache.base + e->tb_offset;
+    memset(tb, 0, sizeof(*tb));
+    tb->pc = pc;
+    tb->cs_base = cs_base;
+    tb->flags = flags;
+    tb->cflags = cflags;
+    tb->size = e->size;
+    tb->icount = e->icount;
+    tb->trace_vcpu_dstate = e->trace_vcpu_dstate;
+    tb->tc.ptr = tb_cache.base + e->code_offset;
+    tb->tc.size = e->code_size;
+    tb->jmp_reset_offset[0] = e->jmp_reset_offset[0];
+    tb->jmp_reset_offset[1] = e->jmp_reset_offset[1];
+    if (TCG_TARGET_HAS_direct_jump) {
+        tb->jmp_target_arg[0] = e->jmp_insn_offset[0];
+        tb->jmp_target_arg[1] = e->jmp_insn_offset[1];
+    }
+
+    memcpy(tb->tc.ptr, guest + e->size, e->code_size + e->search_size);
+    flush_icache_range((uintptr_t)tb->tc.ptr,
+                       (uintptr_t)tb->tc.ptr + e->code_size);
+    return tb;
+}
+
+/*
+ * Called once @tb has been generated and its jumps reset, but before it
+ * is linked and other vCPUs can patch its code.
+ */
+void tb_cache_record(TranslationBlock *tb, int search_size)
+{
+    static const uint8_t zero[8];
+    TBCacheEntry e;
+    size_t end, len;
+
+    if (!tb_cache.recording ||
+        (tb->cflags & CF_NOCACHE) || tcg_ctx->tb_host_ptr || tb->size == 0) {
+        return;
+    }
+    end = tb->tc.ptr + tb->tc.size + search_size - tb_cache.base;
+    if (end > tb_cache.limit) {
+        tb_cache.recording = false;
+        return;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.pc = tb->pc;
+    e.cs_base = tb->cs_base;
+    e.flags = tb->flags;
+    e.cflags = tb->cflags;
+    e.trace_vcpu_dstate = tb->trace_vcpu_dstate;
+    if (g_hash_table_contains(tb_cache.index, &e)) {
+        return;
+    }
+    e.size = tb->size;
+    e.icount = tb->icount;
+    e.tb_offset = (void *)tb - tb_cache.base;
+    e.code_offset = tb->tc.ptr - tb_cache.base;
+    e.code_size = tb->tc.size;
+    e.search_size = search_size;
+    e.jmp_reset_offset[0] = tb->jmp_reset_offset[0];
+    e.jmp_reset_offset[1] = tb->jmp_reset_offset[1];
+    if (TCG_TARGET_HAS_direct_jump) {
+        e.jmp_insn_offset[0] = tb->jmp_target_arg[0];
+        e.jmp_insn_offset[1] = tb->jmp_target_arg[1];
+    }
+
+    tb_cache.last_tb = tb;
+    tb_cache.last_len = tb_cache.records->len;
+    tb_cache.last_end = tb_cache.records_end;
+
+    len = tb_cache_entry_len(&e);
+    g_byte_array_append(tb_cache.records, (const guint8 *)&e, sizeof(e));
+    g_byte_array_append(tb_cache.records, g2h(tb->pc), e.size);
+    g_byte_array_append(tb_cache.records, tb->tc.ptr,
+                        e.code_size + e.search_size);
+    g_byte_array_append(tb_cache.records, zero,
+                        tb_cache.last_len + len - tb_cache.records->len);
+    g_hash_table_insert(tb_cache.index, g_memdup(&e, sizeof(e)), NULL);
+    tb_cache.n_records++;
+    tb_cache.records_end = end;
+}
+
+/* @tb lost the race against another vCPU translating the same block */
+void tb_cache_unrecord(TranslationBlock *tb)
+{
+    if (tb_cache.last_tb != tb) {
+        return;
+    }
+    g_byte_array_set_size(tb_cache.records, tb_cache.last_len);
+    tb_cache.n_records--;
+    tb_cache.records_end = tb_cache.last_end;
+    tb_cache.last_tb = NULL;
+}
+
+void tb_cache_flush(void)
+{
+    /* the region is reused from its start: no slot is free anymore */
+    tb_cache.restoring = false;
+    tb_cache.recording = false;
+    tb_cache.last_tb = NULL;
+}
+
+void tb_cache_save(void)
+{
+    g_autofree char *tmp = NULL;
+    TBCacheHeader hdr;
+    int fd;
+
+    if (!tb_cache.path) {
+        return;
+    }
+
+    mmap_lock();
+    if (tb_cache.n_records == 0) {
+        goto out;
+    }
+
+    hdr = tb_cache.header;
+    hdr.n_entries = tb_cache.n_entries + tb_cache.n_records;
+    hdr.reserved = tb_cache.records_end;
+
+    /* rename() keeps the file consistent for concurrent runs */
+    tmp = g_strdup_printf("%s.%d", tb_cache.path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        warn_report("Could not save translation cache %s: %s",
+                    tb_cache.path, strerror(errno));
+        goto out;
+    }
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        qemu_write_full(fd, tb_cache.entries, tb_cache.entries_len) !=
+            tb_cache.entries_len ||
+        qemu_write_full(fd, tb_cache.records->data, tb_cache.records->len) !=
+            tb_cache.records->len) {
+        warn_report("Could not save translation cache %s: %s",
+                    tb_cache.path, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+    close(fd);
+    if (rename(tmp, tb_cache.path) < 0) {
+        warn_report("Could not save translation cache %s: %s",
+                    tb_cache.path, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+    trace_tb_cache_save(tb_cache.path, tb_cache.n_records);
+    tb_cache.n_records = 0;
+
+ out:
+    mmap_unlock();
+}
@@ -28,6 +28,12 @@ DEF_HELPER_FLAGS_1(lookup_tb_ptr, TCG_CALL_NO_WG_SE, ptr, env)
 
 DEF_HELPER_FLAGS_1(exit_atomic, TCG_CALL_NO_WG, noreturn, env)
 
+#ifdef CONFIG_PLUGIN
+DEF_HELPER_FLAGS_2(plugin_tb_exec, TCG_CALL_NO_RWG, void, env, ptr)
+DEF_HELPER_FLAGS_2(plugin_insn_exec, TCG_CALL_NO_RWG, void, env, ptr)
+DEF_HELPER_FLAGS_4(plugin_mem_exec, TCG_CALL_NO_RWG, void, env, tl, i32, ptr)
+#endif
+
 #ifdef CONFIG_SOFTMMU
 
 DEF_HELPER_FLAGS_5(atomic_cmpxchgb, TCG_CALL_NO_WG,
@@ -48,6 +48,7 @@
 
 #include "exec/cputlb.h"
 #include "exec/tb-hash.h"
+#include "exec/tb-cache.h"
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
@@ -57,6 +58,7 @@
 #include "exec/log.h"
 #include "sysemu/cpus.h"
 #include "sysemu/tcg.h"
+#include "qemu/plugin.h"
 
 /* #define DEBUG_TB_INVALIDATE */
 /* #define DEBUG_TB_FLUSH */
@@ -1251,11 +1253,15 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     CPU_FOREACH(cpu) {
         cpu_tb_jmp_cache_clear(cpu);
     }
+    /* all vCPUs are out of cpu_exec, nobody is looking at the L2 cache */
+    memset(tb_ctx.l2_cache, 0, sizeof(tb_ctx.l2_cache));
 
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
     tcg_region_reset_all();
+    tb_cache_flush();
+    qemu_plugin_flush_tbs();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     atomic_mb_set(&tb_ctx.tb_flush_count, tb_ctx.tb_flush_count + 1);
@@ -1429,7 +1435,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
 {
     CPUState *cpu;
     PageDesc *p;
+    TBL2CacheSet *set;
     uint32_t h;
+    int i;
     tb_page_addr_t phys_pc;
 
     assert_memory_lock();
@@ -1448,6 +1456,14 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
         return;
     }
 
+    /* the L2 lookup cache would reject it anyway, but free the entry */
+    set = &tb_ctx.l2_cache[h & (TB_L2_CACHE_SETS - 1)];
+    for (i = 0; i < TB_L2_CACHE_WAYS; i++) {
+        if (atomic_read(&set->tbs[i]) == tb) {
+            atomic_set(&set->tbs[i], NULL);
+        }
+    }
+
     /* remove the TB from the page list */
     if (rm_from_page_list) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
@@ -1666,6 +1682,51 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
+static void tb_init_jumps(TranslationBlock *tb)
+{
+    qemu_spin_init(&tb->jmp_lock);
+    tb->jmp_list_head = (uintptr_t)NULL;
+    tb->jmp_list_next[0] = (uintptr_t)NULL;
+    tb->jmp_list_next[1] = (uintptr_t)NULL;
+    tb->jmp_dest[0] = (uintptr_t)NULL;
+    tb->jmp_dest[1] = (uintptr_t)NULL;
+
+    /* init original jump addresses which have been set during tcg_gen_code() */
+    if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+        tb_reset_jump(tb, 0);
+    }
+    if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+        tb_reset_jump(tb, 1);
+    }
+}
+
+/*
+ * Link a TB restored from the persistent translation cache, like
+ * tb_gen_code does for the TBs it generates.
+ */
+static TranslationBlock *tb_link_restored(CPUArchState *env,
+                                          TranslationBlock *tb,
+                                          tb_page_addr_t phys_pc)
+{
+    TranslationBlock *existing_tb;
+    tb_page_addr_t phys_page2;
+    target_ulong virt_page2;
+
+    tb_init_jumps(tb);
+
+    virt_page2 = (tb->pc + tb->size - 1) & TARGET_PAGE_MASK;
+    phys_page2 = -1;
+    if ((tb->pc & TARGET_PAGE_MASK) != virt_page2) {
+        phys_page2 = get_page_addr_code(env, virt_page2);
+    }
+    existing_tb = tb_link_page(tb, phys_pc, phys_page2);
+    if (unlikely(existing_tb != tb)) {
+        return existing_tb;
+    }
+    tcg_tb_insert(tb);
+    return tb;
+}
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
@@ -1705,6 +1766,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         max_insns = 1;
     }
 
+    if (phys_pc != -1) {
+        tb = tb_cache_restore(cpu, pc, cs_base, flags, cflags);
+        if (tb) {
+            return tb_link_restored(env, tb, phys_pc);
+        }
+    }
+
  buffer_overflow:
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
@@ -1842,20 +1910,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
                  CODE_GEN_ALIGN));
 
     /* init jump list */
-    qemu_spin_init(&tb->jmp_lock);
-    tb->jmp_list_head = (uintptr_t)NULL;
-    tb->jmp_list_next[0] = (uintptr_t)NULL;
-    tb->jmp_list_next[1] = (uintptr_t)NULL;
-    tb->jmp_dest[0] = (uintptr_t)NULL;
-    tb->jmp_dest[1] = (uintptr_t)NULL;
+    tb_init_jumps(tb);
 
-    /* init original jump addresses which have been set during tcg_gen_code() */
-    if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-        tb_reset_jump(tb, 0);
-    }
-    if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-        tb_reset_jump(tb, 1);
-    }
+    /* save the code before other vCPUs can patch its jumps */
+    tb_cache_record(tb, search_size);
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1872,6 +1930,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (unlikely(existing_tb != tb)) {
         uintptr_t orig_aligned = (uintptr_t)gen_code_buf;
 
+        tb_cache_unrecord(tb);
         orig_aligned -= ROUND_UP(sizeof(*tb), qemu_icache_linesize);
         atomic_set(&tcg_ctx->code_gen_ptr, (void *)orig_aligned);
         return existing_tb;
@@ -2329,6 +2388,8 @@ void dump_exec_info(void)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    size_t l2_hits, l2_misses, l2_used = 0;
+    int i, j;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2366,6 +2427,19 @@ void dump_exec_info(void)
     qemu_printf("TB invalidate count %zu\n",
                 tcg_tb_phys_invalidate_count());
 
+    tcg_tb_l2_cache_stats(&l2_hits, &l2_misses);
+    for (i = 0; i < TB_L2_CACHE_SETS; i++) {
+        for (j = 0; j < TB_L2_CACHE_WAYS; j++) {
+            l2_used += atomic_read(&tb_ctx.l2_cache[i].tbs[j]) != NULL;
+        }
+    }
+    qemu_printf("TB L2 cache usage   %zu/%d entries\n",
+                l2_used, TB_L2_CACHE_SETS * TB_L2_CACHE_WAYS);
+    qemu_printf("TB L2 cache hits    %zu (%zu%%)\n", l2_hits,
+                l2_hits + l2_misses ?
+                (l2_hits * 100) / (l2_hits + l2_misses) : 0);
+    qemu_printf("TB L2 cache misses  %zu\n", l2_misses);
+
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     qemu_printf("TLB full flushes    %zu\n", flush_full);
     qemu_printf("TLB partial flushes %zu\n", flush_part);
@@ -25,9 +25,21 @@
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+/*
+ * The background copy runs in up to BACKUP_MAX_WORKERS coroutines, each
+ * copying one chunk at a time.  The chunk size starts at
+ * BACKUP_CHUNK_DEFAULT and adapts so that copying a chunk takes about
+ * BACKUP_TARGET_LATENCY_NS, see backup_adapt_chunk().
+ */
+#define BACKUP_MAX_WORKERS 8
+#define BACKUP_CHUNK_DEFAULT (1 * MiB)
+#define BACKUP_CHUNK_MAX (4 * MiB)
+#define BACKUP_TARGET_LATENCY_NS (50 * SCALE_MS)
+
 typedef struct CowRequest {
     int64_t start_byte;
     int64_t end_byte;
@@ -50,7 +62,8 @@ typedef struct BackupBlockJob {
     uint64_t len;
     uint64_t bytes_read;
     int64_t cluster_size;
-    NotifierWithReturn before_write;
+    /* Copy-before-write filter node above the source */
+    BlockDriverState *backup_top;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 
     bool use_copy_range;
@@ -58,8 +71,22 @@ typedef struct BackupBlockJob {
 
     BdrvRequestFlags write_flags;
     bool initializing_bitmap;
+
+    /* Background copy workers, see backup_loop() */
+    int in_flight;
+    CoQueue worker_queue;
+    int64_t chunk_size;
+    /* First error that a worker reported to the user */
+    int worker_ret;
 } BackupBlockJob;
 
+typedef struct BackupTopState {
+    /* NULL while the job does not intercept guest writes */
+    BackupBlockJob *job;
+    /* Set when the filter is being dropped from the graph */
+    bool stop;
+} BackupTopState;
+
 static const BlockJobDriver backup_job_driver;
 
 /* See if in-flight requests overlap and wait for them to complete */
@@ -104,20 +131,24 @@ static void cow_request_end(CowRequest *req)
 static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
                                                       int64_t start,
                                                       int64_t end,
-                                                      bool is_write_notifier,
+                                                      bool is_cbw,
                                                       bool *error_is_read,
-                                                      void **bounce_buffer)
+                                                      void **bounce_buffer,
+                                                      int64_t bounce_size)
 {
     int ret;
     BlockBackend *blk = job->common.blk;
     int nbytes;
-    int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
+    int64_t dirty_bytes;
+    int read_flags = is_cbw ? BDRV_REQ_NO_SERIALISING : 0;
 
     assert(QEMU_IS_ALIGNED(start, job->cluster_size));
-    bdrv_reset_dirty_bitmap(job->copy_bitmap, start, job->cluster_size);
-    nbytes = MIN(job->cluster_size, job->len - start);
+    assert(QEMU_IS_ALIGNED(bounce_size, job->cluster_size));
+    dirty_bytes = MIN(end - start, bounce_size);
+    bdrv_reset_dirty_bitmap(job->copy_bitmap, start, dirty_bytes);
+    nbytes = MIN(dirty_bytes, job->len - start);
     if (!*bounce_buffer) {
-        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+        *bounce_buffer = blk_blockalign(blk, bounce_size);
     }
 
     ret = blk_co_pread(blk, start, nbytes, *bounce_buffer, read_flags);
@@ -141,7 +172,7 @@ static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
 
     return nbytes;
 fail:
-    bdrv_set_dirty_bitmap(job->copy_bitmap, start, job->cluster_size);
+    bdrv_set_dirty_bitmap(job->copy_bitmap, start, dirty_bytes);
     return ret;
 
 }
@@ -151,13 +182,13 @@ fail:
 static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
                                                 int64_t start,
                                                 int64_t end,
-                                                bool is_write_notifier)
+                                                bool is_cbw)
 {
     int ret;
     int nr_clusters;
     BlockBackend *blk = job->common.blk;
     int nbytes;
-    int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
+    int read_flags = is_cbw ? BDRV_REQ_NO_SERIALISING : 0;
 
     assert(QEMU_IS_ALIGNED(job->copy_range_size, job->cluster_size));
     assert(QEMU_IS_ALIGNED(start, job->cluster_size));
@@ -248,21 +279,29 @@ static int64_t backup_bitmap_reset_unallocated(BackupBlockJob *s,
     return ret;
 }
 
+/*
+ * Copy the dirty clusters in [offset, offset + bytes) to the target.
+ * @is_cbw is true if this is called from the copy-before-write filter,
+ * before a guest write to the same range.
+ */
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
-                                      bool is_write_notifier)
+                                      bool is_cbw)
 {
     CowRequest cow_request;
     int ret = 0;
     int64_t start, end; /* bytes */
     void *bounce_buffer = NULL;
+    int64_t bounce_size;
     int64_t status_bytes;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
     start = QEMU_ALIGN_DOWN(offset, job->cluster_size);
     end = QEMU_ALIGN_UP(bytes + offset, job->cluster_size);
+    bounce_size = MIN(end - start,
+                      MAX(BACKUP_CHUNK_MAX, job->cluster_size));
 
     trace_backup_do_cow_enter(job, start, offset, bytes);
 
@@ -297,17 +336,19 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
         trace_backup_do_cow_process(job, start);
 
+        ret = -ENOTSUP;
         if (job->use_copy_range) {
-            ret = backup_cow_with_offload(job, start, dirty_end,
-                                          is_write_notifier);
-            if (ret < 0) {
+            ret = backup_cow_with_offload(job, start, dirty_end, is_cbw);
+            if (ret == -ENOTSUP) {
+                /* Only give up on offloading if it cannot work at all */
                 job->use_copy_range = false;
             }
         }
-        if (!job->use_copy_range) {
+        if (ret < 0) {
+            /* Copy this extent through a bounce buffer instead */
             ret = backup_cow_with_bounce_buffer(job, start, dirty_end,
-                                                is_write_notifier,
-                                                error_is_read, &bounce_buffer);
+                                                is_cbw, error_is_read,
+                                                &bounce_buffer, bounce_size);
         }
         if (ret < 0) {
             break;
@@ -335,18 +376,165 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     return ret;
 }
 
-static int coroutine_fn backup_before_write_notify(
-        NotifierWithReturn *notifier,
-        void *opaque)
+static int coroutine_fn backup_top_cbw(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes)
+{
+    BackupTopState *s = bs->opaque;
+
+    if (!s->job) {
+        return 0;
+    }
+    return backup_do_cow(s->job, offset, bytes, NULL, true);
+}
+
+static int coroutine_fn backup_top_preadv(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn backup_top_pwritev(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    /* The data does not change, so there is nothing to copy first */
+    if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        int ret = backup_top_cbw(bs, offset, bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn backup_top_pwrite_zeroes(BlockDriverState *bs,
+    int64_t offset, int bytes, BdrvRequestFlags flags)
+{
+    if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        int ret = backup_top_cbw(bs, offset, bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+}
+
+static int coroutine_fn backup_top_pdiscard(BlockDriverState *bs,
+    int64_t offset, int bytes)
+{
+    int ret = backup_top_cbw(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_pdiscard(bs->backing, offset, bytes);
+}
+
+static int coroutine_fn backup_top_flush(BlockDriverState *bs)
+{
+    if (bs->backing == NULL) {
+        /* we can be here after failed bdrv_append in backup_top_insert */
+        return 0;
+    }
+    return bdrv_co_flush(bs->backing->bs);
+}
+
+static void backup_top_refresh_filename(BlockDriverState *bs)
+{
+    if (bs->backing == NULL) {
+        /* we can be here after failed bdrv_attach_child in
+         * bdrv_set_backing_hd */
+        return;
+    }
+    pstrcpy(bs->exact_filename, sizeof(bs->exact_filename),
+            bs->backing->bs->filename);
+}
+
+static void backup_top_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    BackupTopState *s = bs->opaque;
+
+    if (s->stop) {
+        /* The filter is about to go away, do not forward anything */
+        *nperm = 0;
+        *nshared = BLK_PERM_ALL;
+        return;
+    }
+
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+}
+
+/*
+ * Filter node that the backup job inserts above its source.  Guest writes
+ * go through it, so it can copy the old data of the range they touch to
+ * the target before letting them through.
+ */
+static BlockDriver bdrv_backup_top = {
+    .format_name                = "backup-top",
+    .instance_size              = sizeof(BackupTopState),
+    .bdrv_co_preadv             = backup_top_preadv,
+    .bdrv_co_pwritev            = backup_top_pwritev,
+    .bdrv_co_pwrite_zeroes      = backup_top_pwrite_zeroes,
+    .bdrv_co_pdiscard           = backup_top_pdiscard,
+    .bdrv_co_flush              = backup_top_flush,
+    .bdrv_co_block_status       = bdrv_co_block_status_from_backing,
+    .bdrv_refresh_filename      = backup_top_refresh_filename,
+    .bdrv_child_perm            = backup_top_child_perm,
+
+    .is_filter                  = true,
+};
+
+static BlockDriverState *backup_top_insert(BlockDriverState *bs, Error **errp)
+{
+    BlockDriverState *top;
+    Error *local_err = NULL;
+
+    top = bdrv_new_open_driver(&bdrv_backup_top, NULL, BDRV_O_RDWR, errp);
+    if (top == NULL) {
+        return NULL;
+    }
+    top->implicit = true;
+    top->total_sectors = bs->total_sectors;
+    top->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+                                 (BDRV_REQ_FUA & bs->supported_write_flags);
+    top->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+         bs->supported_zero_flags);
+
+    /* bdrv_append takes ownership of one reference, keep one for the job */
+    bdrv_ref(top);
+    bdrv_drained_begin(bs);
+    bdrv_append(top, bs, &local_err);
+    bdrv_drained_end(bs);
+
+    if (local_err) {
+        bdrv_unref(top);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    return top;
+}
+
+static void backup_top_remove(BlockDriverState *top)
 {
-    BackupBlockJob *job = container_of(notifier, BackupBlockJob, before_write);
-    BdrvTrackedRequest *req = opaque;
+    BackupTopState *s = top->opaque;
+    BlockDriverState *bs = backing_bs(top);
 
-    assert(req->bs == blk_bs(job->common.blk));
-    assert(QEMU_IS_ALIGNED(req->offset, BDRV_SECTOR_SIZE));
-    assert(QEMU_IS_ALIGNED(req->bytes, BDRV_SECTOR_SIZE));
+    bdrv_drained_begin(bs);
+    s->job = NULL;
+    s->stop = true;
+    bdrv_child_refresh_perms(top, top->backing, &error_abort);
+    bdrv_replace_node(top, bs, &error_abort);
+    bdrv_drained_end(bs);
 
-    return backup_do_cow(job, req->offset, req->bytes, NULL, true);
+    bdrv_unref(top);
 }
 
 static void backup_cleanup_sync_bitmap(BackupBlockJob *job, int ret)
@@ -400,6 +588,11 @@ static void backup_clean(Job *job)
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
     BlockDriverState *bs = blk_bs(s->common.blk);
 
+    if (s->backup_top) {
+        backup_top_remove(s->backup_top);
+        s->backup_top = NULL;
+    }
+
     if (s->copy_bitmap) {
         bdrv_release_dirty_bitmap(bs, s->copy_bitmap);
         s->copy_bitmap = NULL;
@@ -458,31 +651,125 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_loop(BackupBlockJob *job)
+/*
+ * Grow the chunk size while chunks are copied well within
+ * BACKUP_TARGET_LATENCY_NS and shrink it when they take longer, so that
+ * fast storage is copied with few large requests while guest writes that
+ * wait for a chunk on slow storage are not held up for too long.
+ */
+static void backup_adapt_chunk(BackupBlockJob *job, int64_t bytes,
+                               int64_t ns)
 {
-    bool error_is_read;
+    int64_t max_chunk = MAX(BACKUP_CHUNK_MAX, job->cluster_size);
+
+    if (bytes < job->chunk_size) {
+        /* End of the image; says nothing about the chunk size */
+        return;
+    }
+
+    if (ns < BACKUP_TARGET_LATENCY_NS / 2) {
+        job->chunk_size = MIN(job->chunk_size * 2, max_chunk);
+    } else if (ns > BACKUP_TARGET_LATENCY_NS) {
+        job->chunk_size = MAX(QEMU_ALIGN_DOWN(job->chunk_size / 2,
+                                              job->cluster_size),
+                              job->cluster_size);
+    }
+    trace_backup_adapt_chunk(job, bytes, ns, job->chunk_size);
+}
+
+typedef struct BackupCopyTask {
+    BackupBlockJob *job;
     int64_t offset;
+    int64_t bytes;
+} BackupCopyTask;
+
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupCopyTask *task = opaque;
+    BackupBlockJob *job = task->job;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job, task->offset, task->bytes, &error_is_read,
+                        false);
+    if (ret < 0) {
+        /* Unless reported, the chunk stays dirty and is retried later */
+        if (backup_error_action(job, error_is_read, -ret) ==
+            BLOCK_ERROR_ACTION_REPORT && !job->worker_ret)
+        {
+            job->worker_ret = ret;
+        }
+    } else {
+        backup_adapt_chunk(job, task->bytes,
+                           qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
+    }
+
+    job->in_flight--;
+    qemu_co_queue_restart_all(&job->worker_queue);
+    g_free(task);
+}
+
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int max)
+{
+    while (job->in_flight > max) {
+        qemu_co_queue_wait(&job->worker_queue, NULL);
+    }
+}
+
+/*
+ * Hand the dirty parts of the copy bitmap to up to BACKUP_MAX_WORKERS
+ * concurrent copy coroutines, one chunk at a time.  Chunks that fail
+ * without the error being reported stay dirty, so keep going over the
+ * bitmap until it is clean.
+ */
+static int coroutine_fn backup_loop(BackupBlockJob *job)
+{
+    int64_t offset, bytes;
     BdrvDirtyBitmapIter *bdbi;
+    BackupCopyTask *task;
+    Coroutine *co;
     int ret = 0;
 
     bdbi = bdrv_dirty_iter_new(job->copy_bitmap);
-    while ((offset = bdrv_dirty_iter_next(bdbi)) != -1) {
-        do {
+    do {
+        bdrv_set_dirty_iter(bdbi, 0);
+        while ((offset = bdrv_dirty_iter_next(bdbi)) != -1) {
             if (yield_and_check(job)) {
                 goto out;
             }
-            ret = backup_do_cow(job, offset,
-                                job->cluster_size, &error_is_read, false);
-            if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
-                           BLOCK_ERROR_ACTION_REPORT)
-            {
+            backup_wait_for_workers(job, BACKUP_MAX_WORKERS - 1);
+            if (job->worker_ret < 0) {
                 goto out;
             }
-        } while (ret < 0);
-    }
+
+            bytes = MIN(job->chunk_size, job->len - offset);
+            task = g_new(BackupCopyTask, 1);
+            *task = (BackupCopyTask) {
+                .job    = job,
+                .offset = offset,
+                .bytes  = bytes,
+            };
+            co = qemu_coroutine_create(backup_worker_entry, task);
+            job->in_flight++;
+            qemu_coroutine_enter(co);
+
+            if (offset + bytes >= job->len) {
+                break;
+            }
+            bdrv_set_dirty_iter(bdbi, offset + bytes);
+        }
+        backup_wait_for_workers(job, 0);
+    } while (!job->worker_ret && !job_is_cancelled(&job->common.job) &&
+             bdrv_get_dirty_count(job->copy_bitmap) > 0);
 
  out:
+    backup_wait_for_workers(job, 0);
     bdrv_dirty_iter_free(bdbi);
+    if (job->worker_ret < 0) {
+        ret = job->worker_ret;
+    }
     return ret;
 }
 
@@ -514,16 +801,17 @@ static void backup_init_copy_bitmap(BackupBlockJob *job)
 static int coroutine_fn backup_run(Job *job, Error **errp)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
-    BlockDriverState *bs = blk_bs(s->common.blk);
+    BackupTopState *top_state = s->backup_top->opaque;
     int ret = 0;
 
     QLIST_INIT(&s->inflight_reqs);
     qemu_co_rwlock_init(&s->flush_rwlock);
+    qemu_co_queue_init(&s->worker_queue);
 
     backup_init_copy_bitmap(s);
 
-    s->before_write.notify = backup_before_write_notify;
-    bdrv_add_before_write_notifier(bs, &s->before_write);
+    /* Start copying before guest writes */
+    top_state->job = s;
 
     if (s->sync_mode == MIRROR_SYNC_MODE_TOP) {
         int64_t offset = 0;
@@ -549,8 +837,8 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
         /* All bits are set in copy_bitmap to allow any cluster to be copied.
          * This does not actually require them to be copied. */
         while (!job_is_cancelled(job)) {
-            /* Yield until the job is cancelled.  We just let our before_write
-             * notify callback service CoW requests. */
+            /* Yield until the job is cancelled.  We just let our backup-top
+             * filter service CoW requests. */
             job_yield(job);
         }
     } else {
@@ -558,7 +846,7 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     }
 
  out:
-    notifier_with_return_remove(&s->before_write);
+    top_state->job = NULL;
 
     /* wait until pending backup_do_cow() calls have completed */
     qemu_co_rwlock_wrlock(&s->flush_rwlock);
@@ -632,6 +920,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     int ret;
     int64_t cluster_size;
     BdrvDirtyBitmap *copy_bitmap = NULL;
+    BlockDriverState *backup_top = NULL;
 
     assert(bs);
     assert(target);
@@ -702,6 +991,23 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     }
     bdrv_disable_dirty_bitmap(copy_bitmap);
 
+    /*
+     * Once the filter is in place, the device is attached to it rather than
+     * to @bs, so take the default job ID from the device name beforehand.
+     */
+    if (job_id == NULL && !(creation_flags & JOB_INTERNAL)) {
+        job_id = bdrv_get_device_name(bs);
+    }
+
+    /*
+     * Insert the filter before creating the job so that the job's own
+     * BlockBackend stays attached to @bs and bypasses the filter.
+     */
+    backup_top = backup_top_insert(bs, errp);
+    if (!backup_top) {
+        goto error;
+    }
+
     /* job->len is fixed, so we can't allow resize */
     job = block_job_create(job_id, &backup_job_driver, txn, bs,
                            BLK_PERM_CONSISTENT_READ,
@@ -711,6 +1017,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     if (!job) {
         goto error;
     }
+    job->backup_top = backup_top;
+    backup_top = NULL;
 
     /* The target must match the source in size, so no resize here either */
     job->target = blk_new(job->common.job.aio_context,
@@ -751,7 +1059,10 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
+    block_job_add_bdrv(&job->common, "backup-top", job->backup_top, 0,
+                       BLK_PERM_ALL, &error_abort);
     job->len = len;
+    job->chunk_size = MAX(BACKUP_CHUNK_DEFAULT, cluster_size);
 
     return &job->common;
 
@@ -763,6 +1074,9 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     if (sync_bitmap) {
         bdrv_reclaim_dirty_bitmap(bs, sync_bitmap, NULL);
     }
+    if (backup_top) {
+        backup_top_remove(backup_top);
+    }
     if (job) {
         backup_clean(&job->common.job);
         job_early_fail(&job->common.job);
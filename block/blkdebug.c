@@ -683,6 +683,42 @@ static int coroutine_fn blkdebug_co_block_status(BlockDriverState *bs,
                                           pnum, map, file);
 }
 
+static int coroutine_fn
+blkdebug_co_copy_range_from(BlockDriverState *bs, BdrvChild *src,
+                            uint64_t src_offset, BdrvChild *dst,
+                            uint64_t dst_offset, uint64_t bytes,
+                            BdrvRequestFlags read_flags,
+                            BdrvRequestFlags write_flags)
+{
+    int err;
+
+    err = rule_check(bs, src_offset, bytes, BLKDEBUG_IO_TYPE_COPY_RANGE);
+    if (err) {
+        return err;
+    }
+
+    return bdrv_co_copy_range_from(bs->file, src_offset, dst, dst_offset,
+                                   bytes, read_flags, write_flags);
+}
+
+static int coroutine_fn
+blkdebug_co_copy_range_to(BlockDriverState *bs, BdrvChild *src,
+                          uint64_t src_offset, BdrvChild *dst,
+                          uint64_t dst_offset, uint64_t bytes,
+                          BdrvRequestFlags read_flags,
+                          BdrvRequestFlags write_flags)
+{
+    int err;
+
+    err = rule_check(bs, dst_offset, bytes, BLKDEBUG_IO_TYPE_COPY_RANGE);
+    if (err) {
+        return err;
+    }
+
+    return bdrv_co_copy_range_to(src, src_offset, bs->file, dst_offset, bytes,
+                                 read_flags, write_flags);
+}
+
 static void blkdebug_close(BlockDriverState *bs)
 {
     BDRVBlkdebugState *s = bs->opaque;
@@ -952,6 +988,8 @@ static BlockDriver bdrv_blkdebug = {
     .bdrv_co_pwrite_zeroes  = blkdebug_co_pwrite_zeroes,
     .bdrv_co_pdiscard       = blkdebug_co_pdiscard,
     .bdrv_co_block_status   = blkdebug_co_block_status,
+    .bdrv_co_copy_range_from = blkdebug_co_copy_range_from,
+    .bdrv_co_copy_range_to  = blkdebug_co_copy_range_to,
 
     .bdrv_debug_event           = blkdebug_debug_event,
     .bdrv_debug_breakpoint      = blkdebug_debug_breakpoint,
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/coroutine.h"
 #include "qemu/range.h"
 #include "trace.h"
@@ -23,11 +24,24 @@
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
+#include "block/accounting.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * Bounds and targets for the adaptive sizing of copy operations, see
+ * mirror_adapt().  MAX_IN_FLIGHT and the buffer size divided by it
+ * are only the starting point.
+ */
+#define MAX_IN_FLIGHT_LIMIT 64
+#define MIN_IO_BYTES (64 * KiB)
+#define MIRROR_ADAPT_INTERVAL_NS (100 * SCALE_MS)
+#define MIRROR_ADAPT_MIN_OPS 8
+/* Copy operations should not take much longer than this to complete */
+#define MIRROR_TARGET_LATENCY_NS (50 * SCALE_MS)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -83,6 +97,21 @@ typedef struct MirrorBlockJob {
     int in_active_write_counter;
     bool prepared;
     bool in_drain;
+
+    /* Adaptive sizing of copy operations, see mirror_adapt() */
+    BlockAcctStats stats;
+    int max_in_flight;
+    int64_t max_io_bytes;
+    /* Whether max_in_flight held copies back in this interval */
+    bool in_flight_limited;
+    int64_t adapt_start_ns;
+    uint64_t adapt_ops;
+    uint64_t adapt_bytes;
+    uint64_t adapt_time_ns;
+    /* Lowest latency per byte seen so far, aging slowly */
+    double base_ns_per_byte;
+    int64_t throughput;
+    int64_t latency_ns;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -104,6 +133,10 @@ struct MirrorOp {
     bool is_active_write;
     CoQueue waiting_requests;
 
+    /* Copy operations are accounted in MirrorBlockJob.stats */
+    bool is_accounted;
+    BlockAcctCookie acct;
+
     QTAILQ_ENTRY(MirrorOp) next;
 };
 
@@ -162,6 +195,70 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Adapt the number and the size of copy operations to the throughput and
+ * latency measured over the last interval.  Concurrency grows by one
+ * while the latency per byte stays close to the lowest one seen, and is
+ * cut by a quarter once queuing inflates it; this keeps fast storage
+ * busy without starving other users of slow storage.  Operations are
+ * then sized so that, at the measured throughput, each one completes
+ * within MIRROR_TARGET_LATENCY_NS.
+ */
+static void mirror_adapt(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->adapt_start_ns;
+    uint64_t nr_ops, nr_bytes, total_time_ns;
+    uint64_t ops, bytes;
+    double ns_per_byte;
+    int64_t min_io_bytes, max_io_bytes, io_bytes;
+
+    qemu_mutex_lock(&s->stats.lock);
+    nr_ops = s->stats.nr_ops[BLOCK_ACCT_WRITE];
+    nr_bytes = s->stats.nr_bytes[BLOCK_ACCT_WRITE];
+    total_time_ns = s->stats.total_time_ns[BLOCK_ACCT_WRITE];
+    qemu_mutex_unlock(&s->stats.lock);
+
+    ops = nr_ops - s->adapt_ops;
+    bytes = nr_bytes - s->adapt_bytes;
+    if (elapsed < MIRROR_ADAPT_INTERVAL_NS || ops < MIRROR_ADAPT_MIN_OPS) {
+        return;
+    }
+
+    s->throughput = bytes * NANOSECONDS_PER_SECOND / elapsed;
+    s->latency_ns = (total_time_ns - s->adapt_time_ns) / ops;
+    ns_per_byte = (double)(total_time_ns - s->adapt_time_ns) / bytes;
+
+    if (!s->base_ns_per_byte || ns_per_byte < s->base_ns_per_byte) {
+        s->base_ns_per_byte = ns_per_byte;
+    } else {
+        /* Forget a faster past, so that the job keeps probing */
+        s->base_ns_per_byte += (ns_per_byte - s->base_ns_per_byte) / 16;
+    }
+
+    if (ns_per_byte > 2 * s->base_ns_per_byte) {
+        s->max_in_flight = MAX(s->max_in_flight * 3 / 4, 1);
+    } else if (s->in_flight_limited) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT_LIMIT);
+    }
+
+    min_io_bytes = MAX(s->granularity, MIN_IO_BYTES);
+    max_io_bytes = MAX(MAX(s->buf_size / 4, MAX_IO_BYTES), min_io_bytes);
+    io_bytes = s->throughput * MIRROR_TARGET_LATENCY_NS /
+               NANOSECONDS_PER_SECOND / s->max_in_flight;
+    io_bytes = QEMU_ALIGN_DOWN(io_bytes, s->granularity);
+    s->max_io_bytes = MIN(MAX(io_bytes, min_io_bytes), max_io_bytes);
+
+    trace_mirror_adapt(s, s->throughput, s->latency_ns, s->max_in_flight,
+                       s->max_io_bytes);
+
+    s->adapt_start_ns = now;
+    s->adapt_ops = nr_ops;
+    s->adapt_bytes = nr_bytes;
+    s->adapt_time_ns = total_time_ns;
+    s->in_flight_limited = false;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -171,6 +268,15 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->offset, op->bytes, ret);
 
+    if (op->is_accounted) {
+        if (ret >= 0) {
+            block_acct_done(&s->stats, &op->acct);
+        } else {
+            block_acct_failed(&s->stats, &op->acct);
+        }
+        mirror_adapt(s);
+    }
+
     s->in_flight--;
     s->bytes_in_flight -= op->bytes;
     iov = op->qiov.iov;
@@ -368,6 +474,9 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->bytes_in_flight += op->bytes;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
+    block_acct_start(&s->stats, &op->acct, op->bytes, BLOCK_ACCT_WRITE);
+    op->is_accounted = true;
+
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
                          &op->qiov, 0);
     mirror_read_complete(op, ret);
@@ -454,7 +563,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -551,8 +660,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
+            s->in_flight_limited = true;
             mirror_wait_for_free_in_flight_slot(s);
         }
 
@@ -851,6 +961,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                                  checking for a NULL string */
     int ret = 0;
 
+    block_acct_init(&s->stats);
+
     if (job_is_cancelled(&s->common.job)) {
         goto immediate_exit;
     }
@@ -922,7 +1034,11 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     mirror_free_init(s);
 
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->adapt_start_ns = s->last_pause_ns;
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || job_is_cancelled(&s->common.job)) {
@@ -963,9 +1079,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
+                if (s->in_flight >= s->max_in_flight) {
+                    s->in_flight_limited = true;
+                }
                 mirror_wait_for_free_in_flight_slot(s);
                 continue;
             } else if (cnt != 0) {
@@ -1062,6 +1181,7 @@ immediate_exit:
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
     bdrv_dirty_iter_free(s->dbi);
+    block_acct_cleanup(&s->stats);
 
     if (need_drain) {
         s->in_drain = true;
@@ -1146,6 +1266,23 @@ static bool mirror_drained_poll(BlockJob *job)
     return !!s->in_flight;
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (!s->throughput && !s->latency_ns) {
+        /* Nothing measured yet */
+        return;
+    }
+
+    info->has_mirror = true;
+    info->mirror = g_new0(BlockJobMirrorInfo, 1);
+    info->mirror->max_in_flight = s->max_in_flight;
+    info->mirror->chunk_size = s->max_io_bytes;
+    info->mirror->throughput = s->throughput;
+    info->mirror->latency_ns = s->latency_ns;
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1159,6 +1296,7 @@ static const BlockJobDriver mirror_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1174,6 +1312,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
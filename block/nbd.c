@@ -34,6 +34,7 @@
 #include "qemu/option.h"
 #include "qemu/cutils.h"
 #include "qemu/main-loop.h"
+#include "qemu/error-report.h"
 
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/qmp/qstring.h"
@@ -44,9 +45,10 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ (uint64_t)(intptr_t)(conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ (uint64_t)(intptr_t)(conn))
 
 typedef struct {
     Coroutine *coroutine;
@@ -59,23 +61,33 @@ typedef enum NBDClientState {
     NBD_CLIENT_QUIT
 } NBDClientState;
 
-typedef struct BDRVNBDState {
+/* One socket to the server, with its own request slots and reply loop */
+typedef struct NBDConnection {
+    struct BDRVNBDState *s;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    NBDExportInfo info;
+    uint32_t context_id; /* Meta context id negotiated on this socket */
 
     CoMutex send_mutex;
     CoQueue free_sema;
     Coroutine *connection_co;
     int in_flight;
-    NBDClientState state;
 
     NBDClientRequest requests[MAX_NBD_REQUESTS];
     NBDReply reply;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    NBDConnection *conns;
+    unsigned num_conns;
+    unsigned next_conn;
+    NBDExportInfo info;
+    NBDClientState state;
     BlockDriverState *bs;
 
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t connections;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
@@ -89,12 +101,12 @@ static void nbd_channel_error(BDRVNBDState *s, int ret)
     s->state = NBD_CLIENT_QUIT;
 }
 
-static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
+static void nbd_recv_coroutines_wake_all(NBDConnection *conn)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        NBDClientRequest *req = &s->requests[i];
+        NBDClientRequest *req = &conn->requests[i];
 
         if (req->coroutine && req->receiving) {
             aio_co_wake(req->coroutine);
@@ -102,17 +114,41 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
     }
 }
 
+/*
+ * Pick the connection with the fewest requests in flight.  The scan
+ * starts after the previous pick so that ties are spread round-robin.
+ */
+static NBDConnection *nbd_pick_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    unsigned i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NBDConnection *conn = &s->conns[(s->next_conn + i) % s->num_conns];
+
+        if (!best || conn->in_flight < best->in_flight) {
+            best = conn;
+        }
+    }
+    s->next_conn = (best - s->conns + 1) % s->num_conns;
+    return best;
+}
+
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->num_conns; i++) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(s->conns[i].ioc));
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
     /*
      * The node is still drained, so we know the coroutine has yielded in
@@ -120,7 +156,12 @@ static void nbd_client_attach_aio_context_bh(void *opaque)
      * entered for the first time. Both places are safe for entering the
      * coroutine.
      */
-    qemu_aio_coroutine_enter(bs->aio_context, s->connection_co);
+    for (i = 0; i < s->num_conns; i++) {
+        if (s->conns[i].connection_co) {
+            qemu_aio_coroutine_enter(bs->aio_context,
+                                     s->conns[i].connection_co);
+        }
+    }
     bdrv_dec_in_flight(bs);
 }
 
@@ -128,8 +169,12 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
+    for (i = 0; i < s->num_conns; i++) {
+        qio_channel_attach_aio_context(QIO_CHANNEL(s->conns[i].ioc),
+                                       new_context);
+    }
 
     bdrv_inc_in_flight(bs);
 
@@ -144,25 +189,32 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
 static void nbd_teardown_connection(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
-    assert(s->ioc);
+    unsigned i;
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(s->ioc,
-                         QIO_CHANNEL_SHUTDOWN_BOTH,
-                         NULL);
-    BDRV_POLL_WHILE(bs, s->connection_co);
+    for (i = 0; i < s->num_conns; i++) {
+        assert(s->conns[i].ioc);
+        qio_channel_shutdown(s->conns[i].ioc,
+                             QIO_CHANNEL_SHUTDOWN_BOTH,
+                             NULL);
+    }
+    for (i = 0; i < s->num_conns; i++) {
+        BDRV_POLL_WHILE(bs, s->conns[i].connection_co);
+    }
 
     nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(s->sioc));
-    s->sioc = NULL;
-    object_unref(OBJECT(s->ioc));
-    s->ioc = NULL;
+    for (i = 0; i < s->num_conns; i++) {
+        object_unref(OBJECT(s->conns[i].sioc));
+        s->conns[i].sioc = NULL;
+        object_unref(OBJECT(s->conns[i].ioc));
+        s->conns[i].ioc = NULL;
+    }
 }
 
 static coroutine_fn void nbd_connection_entry(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
+    BDRVNBDState *s = conn->s;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
@@ -177,8 +229,8 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * Therefore we keep an additional in_flight reference all the time and
          * only drop it temporarily here.
          */
-        assert(s->reply.handle == 0);
-        ret = nbd_receive_reply(s->bs, s->ioc, &s->reply, &local_err);
+        assert(conn->reply.handle == 0);
+        ret = nbd_receive_reply(s->bs, conn->ioc, &conn->reply, &local_err);
 
         if (local_err) {
             trace_nbd_read_reply_entry_fail(ret, error_get_pretty(local_err));
@@ -194,11 +246,12 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * handler acts as a synchronization point and ensures that only
          * one coroutine is called until the reply finishes.
          */
-        i = HANDLE_TO_INDEX(s, s->reply.handle);
+        i = HANDLE_TO_INDEX(conn, conn->reply.handle);
         if (i >= MAX_NBD_REQUESTS ||
-            !s->requests[i].coroutine ||
-            !s->requests[i].receiving ||
-            (nbd_reply_is_structured(&s->reply) && !s->info.structured_reply))
+            !conn->requests[i].coroutine ||
+            !conn->requests[i].receiving ||
+            (nbd_reply_is_structured(&conn->reply) &&
+             !s->info.structured_reply))
         {
             nbd_channel_error(s, -EINVAL);
             break;
@@ -216,27 +269,27 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          *   connection_co happens through a bottom half, which can only
          *   run after we yield.
          */
-        aio_co_wake(s->requests[i].coroutine);
+        aio_co_wake(conn->requests[i].coroutine);
         qemu_coroutine_yield();
     }
 
-    nbd_recv_coroutines_wake_all(s);
+    nbd_recv_coroutines_wake_all(conn);
     bdrv_dec_in_flight(s->bs);
 
-    s->connection_co = NULL;
+    conn->connection_co = NULL;
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDConnection *conn,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = conn->s;
     int rc, i = -1;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    while (s->in_flight == MAX_NBD_REQUESTS) {
-        qemu_co_queue_wait(&s->free_sema, &s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    while (conn->in_flight == MAX_NBD_REQUESTS) {
+        qemu_co_queue_wait(&conn->free_sema, &conn->send_mutex);
     }
 
     if (s->state != NBD_CLIENT_CONNECTED) {
@@ -244,10 +297,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
         goto err;
     }
 
-    s->in_flight++;
+    conn->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->requests[i].coroutine == NULL) {
+        if (conn->requests[i].coroutine == NULL) {
             break;
         }
     }
@@ -255,40 +308,40 @@ static int nbd_co_send_request(BlockDriverState *bs,
     g_assert(qemu_in_coroutine());
     assert(i < MAX_NBD_REQUESTS);
 
-    s->requests[i].coroutine = qemu_coroutine_self();
-    s->requests[i].offset = request->from;
-    s->requests[i].receiving = false;
+    conn->requests[i].coroutine = qemu_coroutine_self();
+    conn->requests[i].offset = request->from;
+    conn->requests[i].receiving = false;
 
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 
-    assert(s->ioc);
+    assert(conn->ioc);
 
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
+        qio_channel_set_cork(conn->ioc, true);
+        rc = nbd_send_request(conn->ioc, request);
         if (rc >= 0 && s->state == NBD_CLIENT_CONNECTED) {
-            if (qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+            if (qio_channel_writev_all(conn->ioc, qiov->iov, qiov->niov,
                                        NULL) < 0) {
                 rc = -EIO;
             }
         } else if (rc >= 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(conn->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(conn->ioc, request);
     }
 
 err:
     if (rc < 0) {
         nbd_channel_error(s, rc);
         if (i != -1) {
-            s->requests[i].coroutine = NULL;
-            s->in_flight--;
+            conn->requests[i].coroutine = NULL;
+            conn->in_flight--;
         }
-        qemu_co_queue_next(&s->free_sema);
+        qemu_co_queue_next(&conn->free_sema);
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
@@ -348,11 +401,12 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
  * Based on our request, we expect only one extent in reply, for the
  * base:allocation context.
  */
-static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
+static int nbd_parse_blockstatus_payload(NBDConnection *conn,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_length,
                                          NBDExtent *extent, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     uint32_t context_id;
 
     /* The server succeeded, so it must have sent [at least] one extent */
@@ -363,11 +417,11 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
     }
 
     context_id = payload_advance32(&payload);
-    if (s->info.context_id != context_id) {
+    if (conn->context_id != context_id) {
         error_setg(errp, "Protocol error: unexpected context id %d for "
                          "NBD_REPLY_TYPE_BLOCK_STATUS, when negotiated context "
                          "id is %d", context_id,
-                         s->info.context_id);
+                         conn->context_id);
         return -EINVAL;
     }
 
@@ -465,17 +519,18 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
+static int nbd_co_receive_offset_data_payload(NBDConnection *conn,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     QEMUIOVector sub_qiov;
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &conn->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -484,7 +539,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
         return -EINVAL;
     }
 
-    if (nbd_read64(s->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
+    if (nbd_read64(conn->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
         return -EIO;
     }
 
@@ -502,7 +557,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(conn->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -510,14 +565,14 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDConnection *conn, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
-    len = s->reply.structured.length;
+    len = conn->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -534,7 +589,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, "structured payload", errp);
+    ret = nbd_read(conn->ioc, *payload, len, "structured payload", errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -560,11 +615,12 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     int ret;
-    int i = HANDLE_TO_INDEX(s, handle);
+    int i = HANDLE_TO_INDEX(conn, handle);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
 
@@ -574,36 +630,36 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
     *request_ret = 0;
 
     /* Wait until we're woken up by nbd_connection_entry.  */
-    s->requests[i].receiving = true;
+    conn->requests[i].receiving = true;
     qemu_coroutine_yield();
-    s->requests[i].receiving = false;
+    conn->requests[i].receiving = false;
     if (s->state != NBD_CLIENT_CONNECTED) {
         error_setg(errp, "Connection closed");
         return -EIO;
     }
-    assert(s->ioc);
+    assert(conn->ioc);
 
-    assert(s->reply.handle == handle);
+    assert(conn->reply.handle == handle);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&conn->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(conn->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(conn->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
     assert(s->info.structured_reply);
-    chunk = &s->reply.structured;
+    chunk = &conn->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -625,7 +681,8 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
+        return nbd_co_receive_offset_data_payload(conn,
+                                                  conn->requests[i].offset,
                                                   qiov, errp);
     }
 
@@ -633,7 +690,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    ret = nbd_co_receive_structured_payload(conn, payload, errp);
     if (ret < 0) {
         return ret;
     }
@@ -653,24 +710,24 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
-    int ret = nbd_co_do_receive_one_chunk(s, handle, only_structured,
+    int ret = nbd_co_do_receive_one_chunk(conn, handle, only_structured,
                                           request_ret, qiov, payload, errp);
 
     if (ret < 0) {
         memset(reply, 0, sizeof(*reply));
-        nbd_channel_error(s, ret);
+        nbd_channel_error(conn->s, ret);
     } else {
         /* For assert at loop start in nbd_connection_entry */
-        *reply = s->reply;
-        s->reply.handle = 0;
+        *reply = conn->reply;
+        conn->reply.handle = 0;
     }
 
-    if (s->connection_co) {
-        aio_co_wake(s->connection_co);
+    if (conn->connection_co) {
+        aio_co_wake(conn->connection_co);
     }
 
     return ret;
@@ -711,21 +768,23 @@ static void nbd_iter_request_error(NBDReplyChunkIter *iter, int ret)
  * NBD_FOREACH_REPLY_CHUNK
  * The pointer stored in @payload requires g_free() to free it.
  */
-#define NBD_FOREACH_REPLY_CHUNK(s, iter, handle, structured, \
+#define NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, structured, \
                                 qiov, reply, payload) \
     for (iter = (NBDReplyChunkIter) { .only_structured = structured }; \
-         nbd_reply_chunk_iter_receive(s, &iter, handle, qiov, reply, payload);)
+         nbd_reply_chunk_iter_receive(conn, &iter, handle, qiov, reply, \
+                                      payload);)
 
 /*
  * nbd_reply_chunk_iter_receive
  * The pointer stored in @payload requires g_free() to free it.
  */
-static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
+static bool nbd_reply_chunk_iter_receive(NBDConnection *conn,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
                                          void **payload)
 {
+    BDRVNBDState *s = conn->s;
     int ret, request_ret;
     NBDReply local_reply;
     NBDStructuredReplyChunk *chunk;
@@ -745,7 +804,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
         reply = &local_reply;
     }
 
-    ret = nbd_co_receive_one_chunk(s, handle, iter->only_structured,
+    ret = nbd_co_receive_one_chunk(conn, handle, iter->only_structured,
                                    &request_ret, qiov, reply, payload,
                                    &local_err);
     if (ret < 0) {
@@ -777,22 +836,22 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     return true;
 
 break_loop:
-    s->requests[HANDLE_TO_INDEX(s, handle)].coroutine = NULL;
+    conn->requests[HANDLE_TO_INDEX(conn, handle)].coroutine = NULL;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->in_flight--;
-    qemu_co_queue_next(&s->free_sema);
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->in_flight--;
+    qemu_co_queue_next(&conn->free_sema);
+    qemu_co_mutex_unlock(&conn->send_mutex);
 
     return false;
 }
 
-static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_return_code(NBDConnection *conn, uint64_t handle,
                                       int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, NULL, NULL) {
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, NULL, NULL) {
         /* nbd_reply_chunk_iter_receive does all the work */
     }
 
@@ -801,16 +860,17 @@ static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_cmdread_reply(NBDConnection *conn, uint64_t handle,
                                         uint64_t offset, QEMUIOVector *qiov,
                                         int *request_ret, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
     Error *local_err = NULL;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, s->info.structured_reply,
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, s->info.structured_reply,
                             qiov, &reply, &payload)
     {
         int ret;
@@ -853,11 +913,12 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
+static int nbd_co_receive_blockstatus_reply(NBDConnection *conn,
                                             uint64_t handle, uint64_t length,
                                             NBDExtent *extent,
                                             int *request_ret, Error **errp)
 {
+    BDRVNBDState *s = conn->s;
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
@@ -865,7 +926,8 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     bool received = false;
 
     assert(!extent->length);
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, &reply, &payload) {
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, &reply,
+                            &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
 
@@ -880,7 +942,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
             }
             received = true;
 
-            ret = nbd_parse_blockstatus_payload(s, &reply.structured,
+            ret = nbd_parse_blockstatus_payload(conn, &reply.structured,
                                                 payload, length, extent,
                                                 &local_err);
             if (ret < 0) {
@@ -913,12 +975,11 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
-                          QEMUIOVector *write_qiov)
+static int nbd_co_conn_request(NBDConnection *conn, NBDRequest *request,
+                               QEMUIOVector *write_qiov)
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -927,12 +988,12 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(conn, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_return_code(s, request->handle,
+    ret = nbd_co_receive_return_code(conn, request->handle,
                                      &request_ret, &local_err);
     if (local_err) {
         trace_nbd_co_request_fail(request->from, request->len, request->handle,
@@ -944,12 +1005,21 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     return ret ? ret : request_ret;
 }
 
+static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+                          QEMUIOVector *write_qiov)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+
+    return nbd_co_conn_request(nbd_pick_connection(s), request, write_qiov);
+}
+
 static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                                 uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -981,12 +1051,13 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
         request.len -= slop;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    conn = nbd_pick_connection(s);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_cmdread_reply(s, request.handle, offset, qiov,
+    ret = nbd_co_receive_cmdread_reply(conn, request.handle, offset, qiov,
                                        &request_ret, &local_err);
     if (local_err) {
         trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1059,6 +1130,8 @@ static int nbd_client_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_FLUSH };
+    unsigned i;
+    int ret;
 
     if (!(s->info.flags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -1067,7 +1140,22 @@ static int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    return nbd_co_request(bs, &request, NULL);
+    /*
+     * With NBD_FLAG_CAN_MULTI_CONN, a flush on any connection also covers
+     * the writes completed on the others.  Otherwise (only possible for a
+     * read-only export, see nbd_open) flush them all.
+     */
+    if (s->info.flags & NBD_FLAG_CAN_MULTI_CONN) {
+        return nbd_co_request(bs, &request, NULL);
+    }
+
+    for (i = 0; i < s->num_conns; i++) {
+        ret = nbd_co_conn_request(&s->conns[i], &request, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
 }
 
 static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
@@ -1095,6 +1183,7 @@ static int coroutine_fn nbd_client_co_block_status(
     int ret, request_ret;
     NBDExtent extent = { 0 };
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1131,12 +1220,13 @@ static int coroutine_fn nbd_client_co_block_status(
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    conn = nbd_pick_connection(s);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_blockstatus_reply(s, request.handle, bytes,
+    ret = nbd_co_receive_blockstatus_reply(conn, request.handle, bytes,
                                            &extent, &request_ret, &local_err);
     if (local_err) {
         trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1162,10 +1252,12 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    unsigned i;
 
-    assert(s->ioc);
-
-    nbd_send_request(s->ioc, &request);
+    for (i = 0; i < s->num_conns; i++) {
+        assert(s->conns[i].ioc);
+        nbd_send_request(s->conns[i].ioc, &request);
+    }
 
     nbd_teardown_connection(bs);
 }
@@ -1191,10 +1283,18 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+/*
+ * Connect @conn to the server.  The first connection fills in s->info;
+ * the others must find the export unchanged.
+ */
+static int nbd_client_connect(BlockDriverState *bs, NBDConnection *conn,
+                              Error **errp)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     AioContext *aio_context = bdrv_get_aio_context(bs);
+    bool primary = conn == &s->conns[0];
+    NBDExportInfo local_info = {};
+    NBDExportInfo *info = primary ? &s->info : &local_info;
     int ret;
 
     /*
@@ -1212,25 +1312,37 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     qio_channel_attach_aio_context(QIO_CHANNEL(sioc), aio_context);
 
-    s->info.request_sizes = true;
-    s->info.structured_reply = true;
-    s->info.base_allocation = true;
-    s->info.x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
-    s->info.name = g_strdup(s->export ?: "");
+    info->request_sizes = true;
+    info->structured_reply = true;
+    info->base_allocation = true;
+    info->x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
+    info->name = g_strdup(s->export ?: "");
     ret = nbd_receive_negotiate(aio_context, QIO_CHANNEL(sioc), s->tlscreds,
-                                s->hostname, &s->ioc, &s->info, errp);
-    g_free(s->info.x_dirty_bitmap);
-    g_free(s->info.name);
+                                s->hostname, &conn->ioc, info, errp);
+    g_free(info->x_dirty_bitmap);
+    g_free(info->name);
     if (ret < 0) {
         object_unref(OBJECT(sioc));
         return ret;
     }
-    if (s->x_dirty_bitmap && !s->info.base_allocation) {
+    if (s->x_dirty_bitmap && !info->base_allocation) {
         error_setg(errp, "requested x-dirty-bitmap %s not found",
                    s->x_dirty_bitmap);
         ret = -EINVAL;
         goto fail;
     }
+    conn->context_id = info->context_id;
+    if (!primary) {
+        if (info->size != s->info.size || info->flags != s->info.flags ||
+            info->structured_reply != s->info.structured_reply ||
+            info->base_allocation != s->info.base_allocation) {
+            error_setg(errp, "NBD export '%s' changed between connections",
+                       s->export ?: "");
+            ret = -EINVAL;
+            goto fail;
+        }
+        goto done;
+    }
     if (s->info.flags & NBD_FLAG_READ_ONLY) {
         ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only", errp);
         if (ret < 0) {
@@ -1248,11 +1360,12 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
         }
     }
 
-    s->sioc = sioc;
+ done:
+    conn->sioc = sioc;
 
-    if (!s->ioc) {
-        s->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(s->ioc));
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
     }
 
     trace_nbd_client_connect_success(s->export);
@@ -1267,8 +1380,12 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     {
         NBDRequest request = { .type = NBD_CMD_DISC };
 
-        nbd_send_request(s->ioc ?: QIO_CHANNEL(sioc), &request);
+        nbd_send_request(conn->ioc ?: QIO_CHANNEL(sioc), &request);
 
+        if (conn->ioc) {
+            object_unref(OBJECT(conn->ioc));
+            conn->ioc = NULL;
+        }
         object_unref(OBJECT(sioc));
 
         return ret;
@@ -1590,6 +1707,13 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sockets to open to the server, requests are "
+                    "spread across them. Only used if the server allows "
+                    "multiple connections. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1600,6 +1724,7 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     BDRVNBDState *s = bs->opaque;
     QemuOpts *opts;
     Error *local_err = NULL;
+    uint64_t connections;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -1640,6 +1765,14 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     s->x_dirty_bitmap = g_strdup(qemu_opt_get(opts, "x-dirty-bitmap"));
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+    s->connections = connections;
+
     ret = 0;
 
  error:
@@ -1657,6 +1790,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     int ret;
+    unsigned i;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     ret = nbd_process_options(bs, options, errp);
@@ -1665,21 +1799,61 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->bs = bs;
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_queue_init(&s->free_sema);
+    s->conns = g_new0(NBDConnection, s->connections);
+    for (i = 0; i < s->connections; i++) {
+        s->conns[i].s = s;
+        qemu_co_mutex_init(&s->conns[i].send_mutex);
+        qemu_co_queue_init(&s->conns[i].free_sema);
+    }
 
-    ret = nbd_client_connect(bs, errp);
+    ret = nbd_client_connect(bs, &s->conns[0], errp);
     if (ret < 0) {
+        g_free(s->conns);
         return ret;
     }
+    s->num_conns = 1;
+
+    /*
+     * Without NBD_FLAG_CAN_MULTI_CONN, writes through one connection need
+     * not be visible to, nor flushed by, another one.
+     */
+    if (s->connections > 1 &&
+        !(s->info.flags & (NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_READ_ONLY))) {
+        warn_report("NBD server does not allow multiple connections to "
+                    "export '%s', using one", s->export ?: "");
+    } else {
+        for (i = 1; i < s->connections; i++) {
+            ret = nbd_client_connect(bs, &s->conns[i], errp);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->num_conns++;
+        }
+    }
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    for (i = 0; i < s->num_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        conn->connection_co = qemu_coroutine_create(nbd_connection_entry,
+                                                    conn);
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), conn->connection_co);
+    }
 
     return 0;
+
+fail:
+    for (i = 0; i < s->num_conns; i++) {
+        NBDRequest request = { .type = NBD_CMD_DISC };
+
+        nbd_send_request(s->conns[i].ioc, &request);
+        object_unref(OBJECT(s->conns[i].sioc));
+        object_unref(OBJECT(s->conns[i].ioc));
+    }
+    g_free(s->conns);
+    return ret;
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
@@ -1726,6 +1900,7 @@ static void nbd_close(BlockDriverState *bs)
     BDRVNBDState *s = bs->opaque;
 
     nbd_client_close(bs);
+    g_free(s->conns);
 
     object_unref(OBJECT(s->tlscreds));
     qapi_free_SocketAddress(s->saddr);
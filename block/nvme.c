@@ -31,6 +31,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_MAX_IO_QUEUES 64
 
 typedef struct {
     int32_t  head, tail;
@@ -46,7 +47,7 @@ typedef struct {
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
-    bool busy;
+    int free_req_next; /* q->reqs[] index of next free request */
 } NVMeRequest;
 
 typedef struct {
@@ -61,6 +62,7 @@ typedef struct {
     NVMeQueue   sq, cq;
     int         cq_phase;
     NVMeRequest reqs[NVME_QUEUE_SIZE];
+    int         free_req_head;
     bool        busy;
     int         need_kick;
     int         inflight;
@@ -98,6 +100,8 @@ typedef struct {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* Number of io queues requested by the user */
+    int num_io_queues;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -123,6 +127,7 @@ typedef struct {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -138,6 +143,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of NVMe io queues to use (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -203,9 +213,12 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
     if (r) {
         goto fail;
     }
+    q->free_req_head = -1;
     for (i = 0; i < NVME_QUEUE_SIZE; i++) {
         NVMeRequest *req = &q->reqs[i];
         req->cid = i + 1;
+        req->free_req_next = q->free_req_head;
+        q->free_req_head = i;
         req->prp_list_page = q->prp_list_pages + i * s->page_size;
         req->prp_list_iova = prp_list_iova + i * s->page_size;
     }
@@ -250,8 +263,7 @@ static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
  */
 static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
 {
-    int i;
-    NVMeRequest *req = NULL;
+    NVMeRequest *req;
 
     qemu_mutex_lock(&q->lock);
     while (q->inflight + q->need_kick > NVME_QUEUE_SIZE - 2) {
@@ -265,20 +277,31 @@ static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
             return NULL;
         }
     }
-    for (i = 0; i < NVME_QUEUE_SIZE; i++) {
-        if (!q->reqs[i].busy) {
-            q->reqs[i].busy = true;
-            req = &q->reqs[i];
-            break;
-        }
-    }
     /* We have checked inflight and need_kick while holding q->lock, so one
      * free req must be available. */
-    assert(req);
+    assert(q->free_req_head != -1);
+    req = &q->reqs[q->free_req_head];
+    q->free_req_head = req->free_req_next;
+    req->free_req_next = -1;
     qemu_mutex_unlock(&q->lock);
     return req;
 }
 
+/* With q->lock */
+static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
+{
+    req->free_req_next = q->free_req_head;
+    q->free_req_head = req - q->reqs;
+}
+
+/* Return a request that was never submitted */
+static void nvme_put_free_req(NVMeQueuePair *q, NVMeRequest *req)
+{
+    qemu_mutex_lock(&q->lock);
+    nvme_put_free_req_locked(q, req);
+    qemu_mutex_unlock(&q->lock);
+}
+
 static inline int nvme_translate_error(const NvmeCqe *c)
 {
     uint16_t status = (le16_to_cpu(c->status) >> 1) & 0xFF;
@@ -338,8 +361,8 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
-        preq->busy = false;
         preq->cb = preq->opaque = NULL;
+        nvme_put_free_req_locked(q, preq);
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, nvme_translate_error(c));
         qemu_mutex_lock(&q->lock);
@@ -523,6 +546,12 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
 
+    if (offsetof(NVMeRegs, doorbells) +
+        ((n * 2 + 1) * s->doorbell_scale + 1) * sizeof(uint32_t) >
+        NVME_BAR_SIZE) {
+        error_setg(errp, "No doorbell for io queue [%d]", n);
+        return false;
+    }
     q = nvme_create_queue_pair(bs, n, queue_size, errp);
     if (!q) {
         return false;
@@ -546,6 +575,11 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n & 0xFFFF),
+        };
+        nvme_cmd_sync(bs, s->queues[0], &cmd);
         nvme_free_queue_pair(bs, q);
         return false;
     }
@@ -555,6 +589,59 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     return true;
 }
 
+/* Set up s->num_io_queues io queues, or as many as the controller allows */
+static bool nvme_add_io_queues(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int n = s->num_io_queues;
+    Error *local_err = NULL;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((n - 1) << 16) | (n - 1)),
+    };
+
+    /* The controller may grant fewer queues; that shows when creating them */
+    nvme_cmd_sync(bs, s->queues[0], &cmd);
+
+    if (!nvme_add_io_queue(bs, errp)) {
+        return false;
+    }
+    while (s->nr_queues - 1 < n) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            warn_reportf_err(local_err, "Using %d of %d NVMe io queues: ",
+                             s->nr_queues - 1, n);
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Pick the io queue with the fewest requests in flight, so that the load is
+ * spread over all hardware queues and a full queue does not make requests
+ * wait while others have free slots.  The counters are read without the
+ * queue locks; a stale value only makes the choice less balanced.
+ */
+static NVMeQueuePair *nvme_pick_io_queue(BDRVNVMeState *s)
+{
+    NVMeQueuePair *best = NULL;
+    int best_load = INT_MAX;
+    int i;
+
+    assert(s->nr_queues > 1);
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        int load = atomic_read(&q->inflight) + atomic_read(&q->need_kick);
+
+        if (load < best_load) {
+            best = q;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -567,7 +654,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int num_io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int ret;
@@ -580,6 +667,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     qemu_co_queue_init(&s->dma_flush_queue);
     s->device = g_strdup(device);
     s->nsid = namespace;
+    s->num_io_queues = num_io_queues;
     s->aio_context = bdrv_get_aio_context(bs);
     ret = event_notifier_init(&s->irq_notifier, 0);
     if (ret) {
@@ -674,7 +762,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queues(bs, errp)) {
         ret = -EIO;
     }
 out:
@@ -761,6 +849,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int64_t num_io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -774,7 +863,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_io_queues < 1 || num_io_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between "
+                   "1 and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -837,6 +933,71 @@ static coroutine_fn int nvme_cmd_unmap_qiov(BlockDriverState *bs,
     return r;
 }
 
+/* Point @cmd at the first @entries pages of req->prp_list_page */
+static void nvme_cmd_set_prps(BDRVNVMeState *s, NvmeCmd *cmd,
+                              NVMeRequest *req, QEMUIOVector *qiov,
+                              int entries)
+{
+    uint64_t *pagelist = req->prp_list_page;
+    int i;
+
+    assert(entries <= s->page_size / sizeof(uint64_t));
+    switch (entries) {
+    case 0:
+        abort();
+    case 1:
+        cmd->prp1 = pagelist[0];
+        cmd->prp2 = 0;
+        break;
+    case 2:
+        cmd->prp1 = pagelist[0];
+        cmd->prp2 = pagelist[1];
+        break;
+    default:
+        cmd->prp1 = pagelist[0];
+        cmd->prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+        break;
+    }
+    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
+    for (i = 0; i < entries; ++i) {
+        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
+    }
+}
+
+/*
+ * Map @qiov if all of it lies in fixed mappings, i.e. guest RAM that
+ * vfio-helpers registers through its RAMBlock notifier, or buffers passed
+ * to bdrv_register_buf().  This is the common case for guest I/O and needs
+ * neither s->dma_map_lock nor any VFIO ioctl.  Returns false if some part of
+ * @qiov needs a temporary mapping.
+ */
+static bool nvme_cmd_map_qiov_fixed(BlockDriverState *bs, NvmeCmd *cmd,
+                                    NVMeRequest *req, QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t *pagelist = req->prp_list_page;
+    int i, j;
+    int entries = 0;
+
+    assert(qiov->size);
+    assert(QEMU_IS_ALIGNED(qiov->size, s->page_size));
+    assert(qiov->size / s->page_size <= s->page_size / sizeof(uint64_t));
+    for (i = 0; i < qiov->niov; ++i) {
+        uint64_t iova;
+
+        if (qemu_vfio_dma_lookup(s->vfio, qiov->iov[i].iov_base,
+                                 qiov->iov[i].iov_len, &iova)) {
+            return false;
+        }
+        for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+    }
+
+    nvme_cmd_set_prps(s, cmd, req, qiov, entries);
+    return true;
+}
+
 /* Called with s->dma_map_lock */
 static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
                                           NVMeRequest *req, QEMUIOVector *qiov)
@@ -883,28 +1044,7 @@ try_map:
     }
 
     s->dma_map_count += qiov->size;
-
-    assert(entries <= s->page_size / sizeof(uint64_t));
-    switch (entries) {
-    case 0:
-        abort();
-    case 1:
-        cmd->prp1 = pagelist[0];
-        cmd->prp2 = 0;
-        break;
-    case 2:
-        cmd->prp1 = pagelist[0];
-        cmd->prp2 = pagelist[1];
-        break;
-    default:
-        cmd->prp1 = pagelist[0];
-        cmd->prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
-        break;
-    }
-    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
-    for (i = 0; i < entries; ++i) {
-        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
-    }
+    nvme_cmd_set_prps(s, cmd, req, qiov, entries);
     return 0;
 fail:
     /* No need to unmap [0 - i) iovs even if we've failed, since we don't
@@ -946,8 +1086,9 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_pick_io_queue(s);
     NVMeRequest *req;
+    bool fixed;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -964,16 +1105,18 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        req->busy = false;
-        return r;
+    fixed = nvme_cmd_map_qiov_fixed(bs, &cmd, req, qiov);
+    if (!fixed) {
+        qemu_co_mutex_lock(&s->dma_map_lock);
+        r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
+        qemu_co_mutex_unlock(&s->dma_map_lock);
+        if (r) {
+            nvme_put_free_req(ioq, req);
+            return r;
+        }
     }
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
 
@@ -982,11 +1125,13 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         qemu_coroutine_yield();
     }
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_unmap_qiov(bs, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        return r;
+    if (!fixed) {
+        qemu_co_mutex_lock(&s->dma_map_lock);
+        r = nvme_cmd_unmap_qiov(bs, qiov);
+        qemu_co_mutex_unlock(&s->dma_map_lock);
+        if (r) {
+            return r;
+        }
     }
 
     trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
@@ -1061,7 +1206,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_pick_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1072,7 +1217,6 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
         .ret = -EINPROGRESS,
     };
 
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1061,6 +1061,83 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocate clusters for guest data.  While other allocating writes are in
+ * flight, they are carved from an extent of QCOW2_DATA_RESERVE_SIZE whose
+ * refcounts are raised in a single update_refcount(), so that concurrent
+ * allocating writes spend little time under s->lock.  What is left of the
+ * extent is given back by qcow2_release_data_clusters() whenever the image
+ * is marked clean or a snapshot is taken; after a crash it shows up as
+ * leaked clusters.
+ *
+ * Returns the offset of the first cluster.  *nb_clusters may be decreased
+ * if the extent is shorter than requested.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+
+    assert(*nb_clusters > 0);
+
+    if (!s->data_reserve_clusters) {
+        uint64_t n;
+
+        if (QLIST_EMPTY(&s->cluster_allocs)) {
+            /* Nothing to batch with, keep the image layout compact */
+            return qcow2_alloc_clusters(bs, *nb_clusters << s->cluster_bits);
+        }
+
+        n = MAX(*nb_clusters, QCOW2_DATA_RESERVE_SIZE >> s->cluster_bits);
+
+        offset = qcow2_alloc_clusters(bs, n << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        s->data_reserve_offset = offset;
+        s->data_reserve_clusters = n;
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->data_reserve_clusters);
+    offset = s->data_reserve_offset;
+    s->data_reserve_offset += *nb_clusters << s->cluster_bits;
+    s->data_reserve_clusters -= *nb_clusters;
+
+    return offset;
+}
+
+/*
+ * Like qcow2_alloc_clusters_at(), but takes the clusters from the data
+ * extent if it starts at @offset.
+ */
+int64_t qcow2_alloc_data_clusters_at(BlockDriverState *bs, uint64_t offset,
+                                     int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->data_reserve_clusters && offset == s->data_reserve_offset) {
+        nb_clusters = MIN(nb_clusters, s->data_reserve_clusters);
+        s->data_reserve_offset += nb_clusters << s->cluster_bits;
+        s->data_reserve_clusters -= nb_clusters;
+        return nb_clusters;
+    }
+
+    return qcow2_alloc_clusters_at(bs, offset, nb_clusters);
+}
+
+/* Drop the refcounts of the data clusters that have not been handed out */
+void qcow2_release_data_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->data_reserve_clusters) {
+        qcow2_free_clusters(bs, s->data_reserve_offset,
+                            s->data_reserve_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->data_reserve_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1253,7 +1330,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1309,7 +1386,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1383,7 +1460,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1599,12 +1676,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t *l2_table, l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1616,7 +1693,16 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        /* A subcluster cannot be both allocated and zero */
+        if ((l2_bitmap >> 32) & l2_bitmap) {
+            fprintf(stderr, "ERROR: cluster %d: subclusters are both "
+                    "allocated and zero, bitmap=0x%" PRIx64 "\n",
+                    i, l2_bitmap);
+            res->corruptions++;
+        }
 
         switch (qcow2_get_cluster_type(bs, l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1636,6 +1722,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 break;
             }
 
+            if (l2_bitmap) {
+                fprintf(stderr, "ERROR compressed cluster %d with non-zero "
+                        "subcluster allocation bitmap, entry=0x%" PRIx64 "\n",
+                        i, l2_entry);
+                res->corruptions++;
+                break;
+            }
+
             /* Mark cluster as used */
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
@@ -1679,15 +1773,17 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
+                        int idx = i * (l2_entry_size(s) / sizeof(uint64_t));
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
+                        /* Only possible without subclusters */
                         l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
-                                l2e_offset, sizeof(uint64_t), false);
+                                l2e_offset, l2_entry_size(s), false);
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Overlap check failed\n");
                             res->check_errors++;
@@ -1697,7 +1793,8 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
-                                               &l2_table[i], sizeof(uint64_t));
+                                               &l2_table[idx],
+                                               l2_entry_size(s));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Failed to overwrite L2 "
                                     "table entry: %s\n", strerror(-ret));
@@ -1740,7 +1837,17 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         case QCOW2_CLUSTER_ZERO_PLAIN:
+            /* Impossible when the image has subclusters */
+            assert(!l2_bitmap);
+            break;
+
         case QCOW2_CLUSTER_UNALLOCATED:
+            if (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) {
+                fprintf(stderr, "ERROR: cluster %d: unallocated cluster has "
+                        "allocated subclusters, bitmap=0x%" PRIx64 "\n",
+                        i, l2_bitmap);
+                res->corruptions++;
+            }
             break;
 
         default:
@@ -1904,7 +2011,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1913,7 +2020,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1936,9 +2043,10 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j,
+                                     refcount == 1 ?
+                                     l2_entry |  QCOW_OFLAG_COPIED :
+                                     l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
@@ -356,6 +356,9 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -ENOTSUP;
     }
 
+    /* Do not let the snapshot's refcounts cover unused data clusters */
+    qcow2_release_data_clusters(bs);
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID */
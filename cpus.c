@@ -236,6 +236,8 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
     } else {
         mttcg_enabled = default_mttcg_enabled();
     }
+
+    tcg_ebb_regalloc = qemu_opt_get_bool(opts, "ebb-regalloc", false);
 }
 
 /* The current number of executed instructions is based on what we
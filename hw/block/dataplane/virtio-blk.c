@@ -25,6 +25,7 @@
 #include "block/aio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/iothread.h"
 
 struct VirtIOBlockDataPlane {
     bool starting;
@@ -41,8 +42,10 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext *ctx;                /* AioContext of the BlockBackend */
+    AioContext **vq_aio_context;    /* AioContext of each virtqueue */
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -63,6 +66,12 @@ static void notify_guest_bh(void *opaque)
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
+    /*
+     * Requests complete under the BlockBackend's AioContext lock, which
+     * also protects batch_notify_vqs when virtqueues are processed by
+     * other IOThreads.
+     */
+    aio_context_acquire(s->ctx);
     memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
     memset(s->batch_notify_vqs, 0, sizeof(bitmap));
 
@@ -78,6 +87,38 @@ static void notify_guest_bh(void *opaque)
             bits &= bits - 1; /* clear right-most bit */
         }
     }
+    aio_context_release(s->ctx);
+}
+
+/* Context: QEMU global mutex held */
+static IOThread **virtio_blk_parse_iothread_vq_mapping(const char *mapping,
+                                                       unsigned *num,
+                                                       Error **errp)
+{
+    gchar **ids = g_strsplit(mapping, ":", -1);
+    unsigned i, n = g_strv_length(ids);
+    IOThread **iothreads = NULL;
+
+    if (!n) {
+        error_setg(errp, "iothread-vq-mapping must list at least one IOThread");
+        goto out;
+    }
+
+    iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        iothreads[i] = iothread_by_id(ids[i]);
+        if (!iothreads[i]) {
+            error_setg(errp, "IOThread '%s' not found", ids[i]);
+            g_free(iothreads);
+            iothreads = NULL;
+            goto out;
+        }
+    }
+    *num = n;
+
+out:
+    g_strfreev(ids);
+    return iothreads;
 }
 
 /* Context: QEMU global mutex held */
@@ -88,10 +129,18 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    unsigned i, num_iothreads = 0;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties "
+                   "cannot be set at the same time");
+        return false;
+    }
+
+    if (conf->iothread || conf->iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -110,6 +159,18 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
             return false;
         }
+
+        if (conf->iothread_vq_mapping) {
+            iothreads = virtio_blk_parse_iothread_vq_mapping(
+                conf->iothread_vq_mapping, &num_iothreads, errp);
+            if (!iothreads) {
+                return false;
+            }
+        } else {
+            iothreads = g_new(IOThread *, 1);
+            iothreads[0] = conf->iothread;
+            num_iothreads = 1;
+        }
     }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
@@ -119,13 +180,31 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
-
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
+
+    /*
+     * The BlockBackend lives in the first IOThread.  Virtqueues mapped to
+     * other IOThreads are popped and parsed there, then submitted under
+     * the BlockBackend's AioContext lock; completions run in the first
+     * IOThread.  Only virtqueue processing is spread over the IOThreads,
+     * block layer submission is still serialized by that lock.
+     */
+    if (num_iothreads) {
+        s->iothreads = iothreads;
+        s->num_iothreads = num_iothreads;
+        for (i = 0; i < num_iothreads; i++) {
+            object_ref(OBJECT(iothreads[i]));
+        }
+        s->ctx = iothread_get_aio_context(iothreads[0]);
+        for (i = 0; i < conf->num_queues; i++) {
+            s->vq_aio_context[i] =
+                iothread_get_aio_context(iothreads[i % num_iothreads]);
+        }
     } else {
         s->ctx = qemu_get_aio_context();
+        for (i = 0; i < conf->num_queues; i++) {
+            s->vq_aio_context[i] = s->ctx;
+        }
     }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
@@ -139,6 +218,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -148,9 +228,11 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
     }
+    g_free(s->iothreads);
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
@@ -228,14 +310,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -245,19 +328,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues
+ * mapped to the current AioContext.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_aio_context[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -284,8 +371,24 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < nvqs; i++) {
+        AioContext *ctx = s->vq_aio_context[i];
+        unsigned j;
+
+        /* Visit each AioContext once */
+        for (j = 0; j < i && s->vq_aio_context[j] != ctx; j++) {
+            /* nothing */
+        }
+        if (j < i) {
+            continue;
+        }
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
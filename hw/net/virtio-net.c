@@ -33,6 +33,7 @@
 #include "standard-headers/linux/ethtool.h"
 #include "sysemu/sysemu.h"
 #include "trace.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -68,6 +69,16 @@
    tso/gso/gro 'off'. */
 #define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 /* temporary until standard header include it */
 #if !defined(VIRTIO_NET_HDR_F_RSC_INFO)
 
@@ -99,6 +110,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = virtio_endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = virtio_endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = virtio_endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -129,6 +142,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -515,6 +533,9 @@ static void virtio_net_reset(VirtIODevice *vdev)
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
 
+    /* RSS is configured again by the driver */
+    memset(&n->rss_data, 0, sizeof(n->rss_data));
+
     /* Flush any async TX */
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
@@ -552,14 +573,16 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
-    if (version_1) {
+    if (version_1 && hash_report) {
+        n->guest_hdr_len = sizeof(struct virtio_net_hdr_v1_hash);
+    } else if (version_1) {
         n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
@@ -692,6 +715,9 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         return features;
     }
 
+    /* The hash is computed by the device model, vhost cannot do it */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -763,7 +789,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
@@ -1011,6 +1039,105 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * VIRTIO_NET_CTRL_MQ_RSS_CONFIG (@do_rss) and VIRTIO_NET_CTRL_MQ_HASH_CONFIG
+ * share the layout of struct virtio_net_rss_config, the latter with a
+ * single entry indirection table and no max_tx_vq.
+ */
+static int virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                 unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData rss = {};
+    struct virtio_net_rss_config cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    size_t s, offset;
+    unsigned int queues, i;
+
+    if (!virtio_vdev_has_feature(vdev, do_rss ? VIRTIO_NET_F_RSS
+                                              : VIRTIO_NET_F_HASH_REPORT)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    offset = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, offset);
+    if (s != offset) {
+        return VIRTIO_NET_ERR;
+    }
+
+    rss.hash_types = virtio_ldl_p(vdev, &cfg.hash_types) &
+                     VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    if (do_rss) {
+        rss.indirections_len = virtio_lduw_p(vdev,
+                                             &cfg.indirection_table_mask) + 1;
+        rss.default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    } else {
+        rss.indirections_len = 1;
+    }
+    if (rss.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(rss.indirections_len)) {
+        trace_virtio_net_rss_error("indirection table length",
+                                   rss.indirections_len);
+        return VIRTIO_NET_ERR;
+    }
+
+    s = rss.indirections_len * sizeof(uint16_t);
+    if (do_rss &&
+        iov_to_buf(iov, iov_cnt, offset, rss.indirections_table, s) != s) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    if (tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        trace_virtio_net_rss_error("key length", tail.hash_key_length);
+        return VIRTIO_NET_ERR;
+    }
+    s = iov_to_buf(iov, iov_cnt, offset, rss.key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        return VIRTIO_NET_ERR;
+    }
+
+    if (do_rss) {
+        /* Every receive queue we may steer to must be enabled */
+        queues = MAX(virtio_lduw_p(vdev, &tail.max_tx_vq),
+                     rss.default_queue + 1);
+        for (i = 0; i < rss.indirections_len; i++) {
+            rss.indirections_table[i] =
+                virtio_lduw_p(vdev, &rss.indirections_table[i]);
+            queues = MAX(queues, rss.indirections_table[i] + 1);
+        }
+        if (queues > n->max_queues || (queues > 1 && !n->multiqueue)) {
+            trace_virtio_net_rss_error("number of queues", queues);
+            return VIRTIO_NET_ERR;
+        }
+    }
+
+    rss.redirect = do_rss;
+    rss.populate_hash = virtio_vdev_has_feature(vdev,
+                                                VIRTIO_NET_F_HASH_REPORT);
+    rss.enabled = rss.redirect || (rss.populate_hash && rss.hash_types);
+    n->rss_data = rss;
+    trace_virtio_net_rss_enable(rss.redirect, rss.hash_types,
+                                rss.indirections_len, tail.hash_key_length);
+
+    if (do_rss) {
+        n->curr_queues = queues;
+        virtio_net_set_status(vdev, vdev->status);
+        virtio_net_set_queues(n);
+    }
+
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -1019,6 +1146,13 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt, true);
+    }
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt, false);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -1037,6 +1171,11 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
         return VIRTIO_NET_ERR;
     }
 
+    /* Setting the number of queue pairs turns off RSS steering */
+    n->rss_data.redirect = false;
+    n->rss_data.enabled = n->rss_data.populate_hash &&
+                          n->rss_data.hash_types;
+
     n->curr_queues = queues;
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
@@ -1262,8 +1401,111 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+static int virtio_net_get_hash_type(struct NetRxPkt *pkt, uint32_t types,
+                                    NetRxPktRssType *type)
+{
+    bool isip4, isip6, isudp, istcp;
+
+    net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+
+    if (isip4) {
+        /* Fragments are hashed on the addresses only */
+        if (net_rx_pkt_get_ip4_info(pkt)->fragment) {
+            isudp = istcp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            *type = NetPktRssIpV4Tcp;
+            return VIRTIO_NET_HASH_REPORT_TCPv4;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            *type = NetPktRssIpV4Udp;
+            return VIRTIO_NET_HASH_REPORT_UDPv4;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            *type = NetPktRssIpV4;
+            return VIRTIO_NET_HASH_REPORT_IPv4;
+        }
+    } else if (isip6) {
+        eth_ip6_hdr_info *ip6info = net_rx_pkt_get_ip6_info(pkt);
+        bool ex = ip6info->rss_ex_src_valid || ip6info->rss_ex_dst_valid;
+
+        if (ip6info->fragment) {
+            isudp = istcp = false;
+        }
+        if (istcp && ex && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            *type = NetPktRssIpV6TcpEx;
+            return VIRTIO_NET_HASH_REPORT_TCPv6_EX;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            *type = NetPktRssIpV6Tcp;
+            return VIRTIO_NET_HASH_REPORT_TCPv6;
+        }
+        if (isudp && ex && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            *type = NetPktRssIpV6UdpEx;
+            return VIRTIO_NET_HASH_REPORT_UDPv6_EX;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            *type = NetPktRssIpV6Udp;
+            return VIRTIO_NET_HASH_REPORT_UDPv6;
+        }
+        if (ex && (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX)) {
+            *type = NetPktRssIpV6Ex;
+            return VIRTIO_NET_HASH_REPORT_IPv6_EX;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            *type = NetPktRssIpV6;
+            return VIRTIO_NET_HASH_REPORT_IPv6;
+        }
+    }
+
+    return VIRTIO_NET_HASH_REPORT_NONE;
+}
+
+/*
+ * Compute the Toeplitz hash of the packet, store it in @hdr for hash
+ * reporting and return the receive queue selected by the indirection
+ * table, or -1 if the packet stays on @nc.
+ */
+static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
+                                  size_t size,
+                                  struct virtio_net_hdr_v1_hash *hdr)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtioNetRssData *rss = &n->rss_data;
+    NetRxPktRssType type;
+    uint32_t hash = 0;
+    uint16_t index;
+    int report;
+
+    net_rx_pkt_set_protocols(n->rx_pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    report = virtio_net_get_hash_type(n->rx_pkt, rss->hash_types, &type);
+    if (report != VIRTIO_NET_HASH_REPORT_NONE) {
+        hash = net_rx_pkt_calc_rss_hash(n->rx_pkt, type, rss->key);
+    }
+
+    if (rss->populate_hash) {
+        stl_le_p(&hdr->hash_value, hash);
+        stw_le_p(&hdr->hash_report, report);
+    }
+
+    if (!rss->redirect) {
+        return -1;
+    }
+
+    if (report == VIRTIO_NET_HASH_REPORT_NONE) {
+        index = rss->default_queue;
+    } else {
+        index = rss->indirections_table[hash & (rss->indirections_len - 1)];
+    }
+    trace_virtio_net_rss_redirect(nc->queue_index, index, report, hash);
+
+    return index == nc->queue_index ? -1 : index;
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+                                      size_t size,
+                                      const struct virtio_net_hdr_v1_hash *hash)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1327,6 +1569,15 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->guest_hdr_len == sizeof(struct virtio_net_hdr_v1_hash)) {
+                iov_from_buf(sg, elem->in_num,
+                             offsetof(struct virtio_net_hdr_v1_hash,
+                                      hash_value),
+                             &hash->hash_value,
+                             sizeof(*hash) -
+                             offsetof(struct virtio_net_hdr_v1_hash,
+                                      hash_value));
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1369,10 +1620,31 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    struct virtio_net_hdr_v1_hash hash = {
+        .hash_report = cpu_to_le16(VIRTIO_NET_HASH_REPORT_NONE),
+    };
     ssize_t r;
+    int index = -1;
 
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    if (n->rss_data.enabled) {
+        index = virtio_net_process_rss(nc, buf, size, &hash);
+    }
+    if (index >= 0) {
+        r = virtio_net_receive_rcu(qemu_get_subqueue(n->nic, index),
+                                   buf, size, &hash);
+        /*
+         * The packet would be queued on @nc and only flushed when the
+         * guest refills this queue, not the one it was steered to.
+         * Drop it instead, like a NIC does when the ring is full.
+         */
+        if (r == 0) {
+            r = size;
+        }
+    } else {
+        r = virtio_net_receive_rcu(nc, buf, size, &hash);
+    }
     rcu_read_unlock();
     return r;
 }
@@ -2022,7 +2294,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         ssize_t ret;
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+        struct virtio_net_hdr_v1_hash mhdr;
 
         elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -2322,7 +2594,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     trace_virtio_net_post_load_device();
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                   VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -2528,6 +2802,53 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    VirtIONet *n = opaque;
+
+    return n->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(rss->indirections_len) ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name      = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_BOOL(rss_data.populate_hash, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -2578,6 +2899,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    }
 };
 
 static NetClientInfo net_virtio_info = {
@@ -2660,6 +2985,13 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->host_features |= (1ULL << VIRTIO_NET_F_SPEED_DUPLEX);
     }
 
+    if ((virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+         virtio_has_feature(n->host_features, VIRTIO_NET_F_HASH_REPORT)) &&
+        !virtio_has_feature(n->host_features, VIRTIO_NET_F_CTRL_VQ)) {
+        error_setg(errp, "'rss' and 'hash' require 'ctrl_vq'");
+        return;
+    }
+
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
@@ -2751,7 +3083,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2763,6 +3095,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
+
+    net_rx_pkt_init(&n->rx_pkt, false);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
@@ -2791,6 +3125,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
+    net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
 
@@ -2871,6 +3206,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
@@ -122,6 +122,13 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
@@ -134,7 +141,8 @@ struct AioContext {
     int poll_disable_cnt;
 
     /* Polling mode parameters */
-    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_ns;        /* current polling time in nanoseconds, the
+                             * longest of the handlers' polling times */
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
@@ -386,6 +394,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -622,4 +636,21 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+typedef void AioPollHandlerStatsFn(void *opaque, int fd, int64_t poll_ns,
+                                   uint64_t polls, uint64_t hits);
+
+/**
+ * aio_context_foreach_poll_handler:
+ * @ctx: the aio context
+ * @fn: called for each handler that supports polling
+ * @opaque: passed to @fn
+ *
+ * Report the adaptive polling state of each handler: its current polling
+ * time, how many event loop iterations polled it and in how many of them
+ * polling found it ready.  May be called from any thread.
+ */
+void aio_context_foreach_poll_handler(AioContext *ctx,
+                                      AioPollHandlerStatsFn *fn,
+                                      void *opaque);
+
 #endif
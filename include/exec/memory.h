@@ -423,6 +423,11 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    /*
+     * Alternative to log_sync for listeners that can only sync the whole
+     * dirty log at once; called on any sync, whatever the region.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
     void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
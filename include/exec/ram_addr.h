@@ -498,33 +498,30 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
          (start + rb->offset) &&
         !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        long nr = length >> TARGET_PAGE_BITS;
+        long real_dirty = 0;
         unsigned long * const *src;
         unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
-        unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
-                                        DIRTY_MEMORY_BLOCK_SIZE);
-        unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+        unsigned long offset = (word * BITS_PER_LONG) %
+                               DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long page = start >> TARGET_PAGE_BITS;
 
         src = atomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                *real_dirty_pages += ctpopl(bits);
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
-
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
+        /* Merge one dirty memory block at a time */
+        while (nr > 0) {
+            long chunk = MIN(nr, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+            num_dirty += bitmap_merge_and_clear_atomic(
+                dest + BIT_WORD(page), src[idx] + BIT_WORD(offset),
+                chunk, &real_dirty);
+            page += chunk;
+            nr -= chunk;
+            offset = 0;
+            idx++;
         }
+        *real_dirty_pages += real_dirty;
 
         if (rb->clear_bmap) {
             /*
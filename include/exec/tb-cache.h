@@ -0,0 +1,63 @@
+/*
+ * Persistent translation cache for user-mode emulation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef EXEC_TB_CACHE_H
+#define EXEC_TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+#ifdef CONFIG_USER_ONLY
+
+/*
+ * tb_cache_init:
+ * @dir: directory holding the cache files
+ * @exec_path: guest binary being run
+ * @cpu_model: -cpu option the guest CPU was created with
+ *
+ * Open the cache file for @exec_path and reserve the part of
+ * code_gen_buffer its translations were generated at.  Must be called
+ * after tcg_region_init(), once guest_base is final.
+ */
+void tb_cache_init(const char *dir, const char *exec_path,
+                   const char *cpu_model);
+
+/* Write the translations generated by this run back to the cache file. */
+void tb_cache_save(void);
+
+/*
+ * The following are called by translate-all.c with mmap_lock held.
+ */
+TranslationBlock *tb_cache_restore(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint32_t flags,
+                                   uint32_t cflags);
+void tb_cache_record(TranslationBlock *tb, int search_size);
+void tb_cache_unrecord(TranslationBlock *tb);
+/* Called from tb_flush, once code_gen_buffer has been emptied. */
+void tb_cache_flush(void);
+
+#else /* !CONFIG_USER_ONLY */
+
+static inline TranslationBlock *tb_cache_restore(CPUState *cpu,
+                                                 target_ulong pc,
+                                                 target_ulong cs_base,
+                                                 uint32_t flags,
+                                                 uint32_t cflags)
+{
+    return NULL;
+}
+
+static inline void tb_cache_record(TranslationBlock *tb, int search_size)
+{ }
+
+static inline void tb_cache_unrecord(TranslationBlock *tb)
+{ }
+
+static inline void tb_cache_flush(void)
+{ }
+
+#endif /* !CONFIG_USER_ONLY */
+
+#endif /* EXEC_TB_CACHE_H */
@@ -26,12 +26,28 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+#define TB_L2_CACHE_BITS         13
+#define TB_L2_CACHE_SETS         (1 << TB_L2_CACHE_BITS)
+#define TB_L2_CACHE_WAYS         4
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
 
+/*
+ * Second-level TB lookup cache, shared by all vCPUs and consulted
+ * between the per-vCPU tb_jmp_cache and the qht.  It is indexed with
+ * the qht hash, which covers the physical address of the TB, so unlike
+ * tb_jmp_cache it survives TLB flushes.  Entries are read and written
+ * without locks: a TB found there is checked in full before use.
+ */
+typedef struct TBL2CacheSet {
+    TranslationBlock *tbs[TB_L2_CACHE_WAYS];
+} TBL2CacheSet;
+
 struct TBContext {
 
     struct qht htable;
+    TBL2CacheSet l2_cache[TB_L2_CACHE_SETS];
 
     /* statistics */
     unsigned tb_flush_count;
@@ -34,6 +34,11 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    /*
+     * Colon-separated IOThread ids, virtqueues are assigned round-robin.
+     * The BlockBackend stays in the first IOThread's AioContext.
+     */
+    char *iothread_vq_mapping;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -48,6 +48,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
+    bool zero_copy_copied;
 };
 
 
@@ -261,4 +264,21 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_set_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Ask the kernel to allow zero copy transmission on
+ * the socket (SO_ZEROCOPY). On success the channel
+ * reports the QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY
+ * feature. This is only supported for TCP sockets
+ * on Linux.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                     Error **errp);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
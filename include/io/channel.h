@@ -44,6 +44,7 @@ enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
 };
 
 
@@ -141,6 +142,14 @@ struct QIOChannelClass {
                                   IOHandler *io_read,
                                   IOHandler *io_write,
                                   void *opaque);
+    ssize_t (*io_writev_zero_copy)(QIOChannel *ioc,
+                                   const struct iovec *iov,
+                                   size_t niov,
+                                   Error **errp);
+    int (*io_zero_copy_status)(QIOChannel *ioc,
+                               uint64_t *queued,
+                               uint64_t *sent,
+                               Error **errp);
 };
 
 /* General I/O handling functions */
@@ -349,6 +358,73 @@ int qio_channel_writev_all(QIOChannel *ioc,
                            size_t niov,
                            Error **erp);
 
+/**
+ * qio_channel_writev_zero_copy:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_writev(), but the data may be
+ * transmitted straight from the memory regions referenced
+ * by @iov instead of being copied first. The caller must
+ * therefore not modify or free that memory until
+ * qio_channel_zero_copy_status() reports that the write
+ * has completed.
+ *
+ * It is an error to call this method unless
+ * qio_channel_has_feature() returns a true value for
+ * the QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY constant.
+ *
+ * Returns: the number of bytes sent, or -1 on error,
+ * or QIO_CHANNEL_ERR_BLOCK if no data can be sent
+ * and the channel is non-blocking
+ */
+ssize_t qio_channel_writev_zero_copy(QIOChannel *ioc,
+                                     const struct iovec *iov,
+                                     size_t niov,
+                                     Error **errp);
+
+/**
+ * qio_channel_writev_zero_copy_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_writev_all(), using
+ * qio_channel_writev_zero_copy() to send the data.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int qio_channel_writev_zero_copy_all(QIOChannel *ioc,
+                                     const struct iovec *iov,
+                                     size_t niov,
+                                     Error **errp);
+
+/**
+ * qio_channel_zero_copy_status:
+ * @ioc: the channel object
+ * @queued: filled with the number of zero copy writes issued
+ * @sent: filled with the number of zero copy writes completed
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Collect the completion notifications for the writes
+ * issued with qio_channel_writev_zero_copy(), without
+ * blocking. Each successful call to that method counts
+ * as one write, and writes complete in the order they
+ * were issued: the memory passed to the N-th write may
+ * be reused once @sent is at least N.
+ *
+ * Returns: 1 if the transport had to fall back to copying
+ * the data of some write since the last call, 0 if not,
+ * or -1 on error
+ */
+int qio_channel_zero_copy_status(QIOChannel *ioc,
+                                 uint64_t *queued,
+                                 uint64_t *sent,
+                                 Error **errp);
+
 /**
  * qio_channel_readv:
  * @ioc: the channel object
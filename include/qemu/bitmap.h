@@ -39,6 +39,9 @@
  * bitmap_clear(dst, pos, nbits)		Clear specified bit area
  * bitmap_test_and_clear_atomic(dst, pos, nbits)    Test and clear area
  * bitmap_find_next_zero_area(buf, len, pos, n, mask)	Find bit free area
+ * bitmap_find_next_bit(buf, len, pos)	find_next_bit for large sparse bitmaps
+ * bitmap_merge_and_clear_atomic(dst, src, nbits, &count)
+ *                                    *dst |= *src, *src = 0 (atomically)
  * bitmap_to_le(dst, src, nbits)      Convert bitmap to little endian
  * bitmap_from_le(dst, src, nbits)    Convert bitmap from little endian
  * bitmap_copy_with_src_offset(dst, src, offset, nbits)
@@ -260,6 +263,12 @@ unsigned long bitmap_find_next_zero_area(unsigned long *map,
                                          unsigned long start,
                                          unsigned long nr,
                                          unsigned long align_mask);
+unsigned long bitmap_find_next_bit(const unsigned long *map,
+                                   unsigned long size,
+                                   unsigned long start);
+long bitmap_merge_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                   long nr, long *src_count);
+bool test_bitmap_next_accel(void);
 
 static inline unsigned long *bitmap_zero_extend(unsigned long *old,
                                                 long old_nbits, long new_nbits)
@@ -0,0 +1,127 @@
+/*
+ * Plugin support, internal interface
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_PLUGIN_H
+#define QEMU_PLUGIN_H
+
+#include "qemu/config-file.h"
+#include "qemu/qemu-plugin.h"
+#include "qemu/error-report.h"
+#include "qemu/queue.h"
+#include "qemu/option.h"
+
+/*
+ * Option parsing/processing.
+ * Note that we can load an arbitrary number of plugins.
+ */
+struct qemu_plugin_desc;
+typedef QTAILQ_HEAD(, qemu_plugin_desc) QemuPluginList;
+
+#ifdef CONFIG_PLUGIN
+extern QemuOptsList qemu_plugin_opts;
+
+static inline void qemu_plugin_add_opts(void)
+{
+    qemu_add_opts(&qemu_plugin_opts);
+}
+
+void qemu_plugin_opt_parse(const char *optarg, QemuPluginList *head);
+int qemu_plugin_load_list(QemuPluginList *head);
+#else /* !CONFIG_PLUGIN */
+static inline void qemu_plugin_add_opts(void)
+{ }
+
+static inline void qemu_plugin_opt_parse(const char *optarg,
+                                         QemuPluginList *head)
+{
+    error_report("plugin interface not enabled in this build");
+    exit(1);
+}
+
+static inline int qemu_plugin_load_list(QemuPluginList *head)
+{
+    return 0;
+}
+#endif /* !CONFIG_PLUGIN */
+
+enum plugin_dyn_cb_subtype {
+    PLUGIN_CB_REGULAR,
+    PLUGIN_CB_INLINE,
+};
+
+/*
+ * A dynamic callback, i.e. one attached to a translated block,
+ * instruction or memory access.  It is set up at translation time and
+ * run every time the instrumented code executes.
+ */
+struct qemu_plugin_dyn_cb {
+    enum plugin_dyn_cb_subtype type;
+    /* accesses the callback is interested in, memory callbacks only */
+    enum qemu_plugin_mem_rw rw;
+    void *userp;
+    union {
+        qemu_plugin_vcpu_udata_cb_t udata;
+        qemu_plugin_vcpu_mem_cb_t mem;
+        struct {
+            enum qemu_plugin_op op;
+            uint64_t imm;
+        } inline_insn;
+    } f;
+};
+
+struct TCGOp;
+
+struct qemu_plugin_insn {
+    GByteArray *data;
+    uint64_t vaddr;
+    /* struct qemu_plugin_dyn_cb, allocated on first registration */
+    GArray *exec_cbs;
+    GArray *mem_cbs;
+    /* helper calls emitted for this insn, dropped if nobody registers */
+    struct TCGOp *exec_op;
+    GPtrArray *mem_ops;
+};
+
+struct qemu_plugin_tb {
+    GPtrArray *insns;
+    uint64_t vaddr;
+    GArray *exec_cbs;
+    struct TCGOp *exec_op;
+};
+
+#ifdef CONFIG_PLUGIN
+
+/*
+ * Translation time: allocate the descriptors for a block that is about
+ * to be translated.  They live until the next tb_flush, which releases
+ * them through qemu_plugin_flush_tbs().
+ */
+bool qemu_plugin_tb_trans_enabled(void);
+struct qemu_plugin_tb *qemu_plugin_tb_new(uint64_t vaddr);
+struct qemu_plugin_insn *qemu_plugin_insn_new(struct qemu_plugin_tb *tb,
+                                              uint64_t vaddr);
+void qemu_plugin_tb_trans_cb(struct qemu_plugin_tb *tb);
+void qemu_plugin_flush_tbs(void);
+
+/* Execution time, called from the TCG helpers */
+void qemu_plugin_run_udata_cbs(unsigned int vcpu_index, GArray *cbs);
+void qemu_plugin_run_mem_cbs(unsigned int vcpu_index, GArray *cbs,
+                             uint64_t vaddr, qemu_plugin_meminfo_t info);
+
+/* Exit time, called from preexit_cleanup() in user mode */
+void qemu_plugin_atexit_cb(void);
+
+#else /* !CONFIG_PLUGIN */
+
+static inline void qemu_plugin_flush_tbs(void)
+{ }
+
+static inline void qemu_plugin_atexit_cb(void)
+{ }
+
+#endif /* !CONFIG_PLUGIN */
+
+#endif /* QEMU_PLUGIN_H */
@@ -0,0 +1,86 @@
+/*
+ * KVM dirty ring collection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_KVM_DIRTY_RING_H
+#define QEMU_KVM_DIRTY_RING_H
+
+#include <linux/kvm.h>
+#include "qemu/atomic.h"
+
+/*
+ * With KVM_CAP_DIRTY_LOG_RING every vCPU shares an array of
+ * struct kvm_dirty_gfn with the kernel.  The kernel publishes each page
+ * the vCPU dirties by filling the next entry and setting
+ * KVM_DIRTY_GFN_F_DIRTY.  Userspace harvests the entries in order and
+ * flags them with KVM_DIRTY_GFN_F_RESET; KVM_RESET_DIRTY_RINGS then
+ * hands them back to the kernel, which write-protects the pages again.
+ *
+ * Only the harvesting side lives here, so that it can be exercised
+ * without a kernel.
+ */
+
+/*
+ * @slot is (address space id << 16) | slot id, @offset is the page
+ * offset within that memory slot.
+ */
+typedef void KVMDirtyRingMarkFn(void *opaque, uint32_t slot, uint64_t offset);
+
+static inline bool kvm_dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    /* Pairs with the kernel's release store of the flags */
+    return atomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static inline void kvm_dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    /*
+     * Use a release store so that the kernel cannot recycle the entry
+     * before its contents have been read.
+     */
+    atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+/**
+ * kvm_dirty_ring_collect:
+ * @ring: the dirty ring of one vCPU
+ * @size: number of entries in @ring, a power of two
+ * @fetch_index: index of the next entry to harvest, updated on return
+ * @mark: called for each harvested entry
+ * @opaque: passed to @mark
+ *
+ * Harvest the entries published since the last call and mark them as
+ * collected.  The caller still has to issue KVM_RESET_DIRTY_RINGS.
+ *
+ * Returns the number of entries harvested.
+ */
+static inline uint32_t kvm_dirty_ring_collect(struct kvm_dirty_gfn *ring,
+                                              uint32_t size,
+                                              uint32_t *fetch_index,
+                                              KVMDirtyRingMarkFn *mark,
+                                              void *opaque)
+{
+    uint32_t fetch = *fetch_index;
+    uint32_t count = 0;
+
+    /* The kernel never has more than @size entries outstanding */
+    while (count < size) {
+        struct kvm_dirty_gfn *cur = &ring[fetch & (size - 1)];
+
+        if (!kvm_dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        mark(opaque, cur->slot, cur->offset);
+        kvm_dirty_gfn_set_collected(cur);
+        fetch++;
+        count++;
+    }
+
+    *fetch_index = fetch;
+    return count;
+}
+
+#endif
@@ -27,6 +27,15 @@
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
+
 #define SOCKET_MAX_FDS 16
 
 SocketAddress *
@@ -472,6 +481,69 @@ static void qio_channel_socket_copy_fds(struct msghdr *msg,
 }
 
 
+#ifdef QEMU_MSG_ZEROCOPY
+/*
+ * Once the kernel no longer references the pages of a MSG_ZEROCOPY
+ * write, it queues a notification on the socket error queue.  Pending
+ * notifications keep POLLERR raised on the socket, so they are also
+ * collected whenever a read or write would block.
+ */
+static int qio_channel_socket_zero_copy_reap(QIOChannelSocket *sioc,
+                                             Error **errp)
+{
+    struct msghdr msg = { NULL, };
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(*serr))];
+    ssize_t ret;
+    bool copied;
+
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read socket error queue");
+            return -1;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg ||
+            !((cmsg->cmsg_level == SOL_IP &&
+               cmsg->cmsg_type == IP_RECVERR) ||
+              (cmsg->cmsg_level == SOL_IPV6 &&
+               cmsg->cmsg_type == IPV6_RECVERR))) {
+            error_setg(errp, "Unexpected message on socket error queue");
+            return -1;
+        }
+
+        serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            error_setg_errno(errp, serr->ee_errno ? serr->ee_errno : EPROTO,
+                             "Zero copy write failed");
+            return -1;
+        }
+
+        /* Writes ee_info to ee_data, inclusive, have completed */
+        copied = serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+        trace_qio_channel_socket_zero_copy_done(sioc, serr->ee_info,
+                                                serr->ee_data, copied);
+        sioc->zero_copy_sent += (uint32_t)(serr->ee_data - serr->ee_info) + 1;
+        sioc->zero_copy_copied |= copied;
+    }
+    return 0;
+}
+#endif
+
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
                                         size_t niov,
@@ -502,6 +574,9 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     ret = recvmsg(sioc->fd, &msg, sflags);
     if (ret < 0) {
         if (errno == EAGAIN) {
+#ifdef QEMU_MSG_ZEROCOPY
+            qio_channel_socket_zero_copy_reap(sioc, NULL);
+#endif
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
@@ -697,6 +772,90 @@ qio_channel_socket_set_cork(QIOChannel *ioc,
     socket_set_cork(sioc->fd, v);
 }
 
+#ifdef QEMU_MSG_ZEROCOPY
+static ssize_t qio_channel_socket_writev_zero_copy(QIOChannel *ioc,
+                                                   const struct iovec *iov,
+                                                   size_t niov,
+                                                   Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    struct msghdr msg = { NULL, };
+    ssize_t ret;
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = niov;
+
+ retry:
+    ret = sendmsg(sioc->fd, &msg, MSG_ZEROCOPY);
+    if (ret <= 0) {
+        switch (errno) {
+        case EAGAIN:
+            qio_channel_socket_zero_copy_reap(sioc, NULL);
+            return QIO_CHANNEL_ERR_BLOCK;
+        case EINTR:
+            goto retry;
+        case ENOBUFS:
+            /*
+             * Too many notifications are waiting to be collected,
+             * send this one the usual way.
+             */
+            return qio_channel_socket_writev(ioc, iov, niov, NULL, 0, errp);
+        }
+        error_setg_errno(errp, errno,
+                         "Unable to write to socket");
+        return -1;
+    }
+
+    /* The kernel numbers each MSG_ZEROCOPY sendmsg that sent data */
+    sioc->zero_copy_queued++;
+    return ret;
+}
+
+
+static int qio_channel_socket_zero_copy_status(QIOChannel *ioc,
+                                               uint64_t *queued,
+                                               uint64_t *sent,
+                                               Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    int ret;
+
+    if (qio_channel_socket_zero_copy_reap(sioc, errp) < 0) {
+        return -1;
+    }
+
+    *queued = sioc->zero_copy_queued;
+    *sent = sioc->zero_copy_sent;
+    ret = sioc->zero_copy_copied;
+    sioc->zero_copy_copied = false;
+    return ret;
+}
+#endif
+
+
+int qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                     Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (qemu_setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY,
+                        &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno,
+                         "Unable to enable zero copy on socket");
+        return -1;
+    }
+
+    qio_channel_set_feature(QIO_CHANNEL(ioc),
+                            QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    trace_qio_channel_socket_zero_copy(ioc, ioc->fd);
+    return 0;
+#else
+    error_setg(errp, "Zero copy writes are not supported on this host");
+    return -1;
+#endif
+}
+
 
 static int
 qio_channel_socket_close(QIOChannel *ioc,
@@ -786,6 +945,10 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
     ioc_klass->io_set_aio_fd_handler = qio_channel_socket_set_aio_fd_handler;
+#ifdef QEMU_MSG_ZEROCOPY
+    ioc_klass->io_writev_zero_copy = qio_channel_socket_writev_zero_copy;
+    ioc_klass->io_zero_copy_status = qio_channel_socket_zero_copy_status;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
@@ -317,11 +317,33 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+static void query_one_poll_handler(void *opaque, int fd, int64_t poll_ns,
+                                   uint64_t polls, uint64_t hits)
+{
+    IOThreadPollHandlerInfoList ***prev = opaque;
+    IOThreadPollHandlerInfoList *elem;
+    IOThreadPollHandlerInfo *info;
+
+    info = g_new0(IOThreadPollHandlerInfo, 1);
+    info->fd = fd;
+    info->poll_ns = poll_ns;
+    info->polls = polls;
+    info->hits = hits;
+
+    elem = g_new0(IOThreadPollHandlerInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
     IOThreadInfoList *elem;
     IOThreadInfo *info;
+    IOThreadPollHandlerInfoList **handler_prev;
     IOThread *iothread;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
@@ -335,6 +357,10 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_ns = iothread->ctx->poll_ns;
+    handler_prev = &info->poll_handlers;
+    aio_context_foreach_poll_handler(iothread->ctx, query_one_poll_handler,
+                                     &handler_prev);
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -18,6 +18,8 @@
  */
 #include "qemu/osdep.h"
 #include "qemu.h"
+#include "exec/tb-cache.h"
+#include "qemu/plugin.h"
 #ifdef TARGET_GPROF
 #include <sys/gmon.h>
 #endif
@@ -35,4 +37,6 @@ void preexit_cleanup(CPUArchState *env, int code)
         __gcov_dump();
 #endif
         gdb_exit(env, code);
+        tb_cache_save();
+        qemu_plugin_atexit_cb();
 }
@@ -40,6 +40,8 @@
 #include "qemu/timer.h"
 #include "qemu/envlist.h"
 #include "qemu/guest-random.h"
+#include "qemu/plugin.h"
+#include "exec/tb-cache.h"
 #include "elf.h"
 #include "trace/control.h"
 #include "target_elf.h"
@@ -55,6 +57,7 @@ static envlist_t *envlist;
 static const char *cpu_model;
 static const char *cpu_type;
 static const char *seed_optarg;
+static const char *tb_cache_dir;
 unsigned long mmap_min_addr;
 unsigned long guest_base;
 int have_guest_base;
@@ -367,11 +370,21 @@ static void handle_arg_reserved_va(const char *arg)
     }
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = arg;
+}
+
 static void handle_arg_singlestep(const char *arg)
 {
     singlestep = 1;
 }
 
+static void handle_arg_ebb_regalloc(const char *arg)
+{
+    tcg_ebb_regalloc = true;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -391,6 +404,12 @@ static void handle_arg_trace(const char *arg)
     trace_file = trace_opt_parse(arg);
 }
 
+static QemuPluginList plugins = QTAILQ_HEAD_INITIALIZER(plugins);
+static void handle_arg_plugin(const char *arg)
+{
+    qemu_plugin_opt_parse(arg, &plugins);
+}
+
 #if defined(TARGET_XTENSA)
 static void handle_arg_abi_call0(const char *arg)
 {
@@ -443,12 +462,18 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"ebb-regalloc", "QEMU_EBB_REGALLOC", false, handle_arg_ebb_regalloc,
+     "",           "keep TCG globals in registers across branches"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "dir",        "keep translated code in 'dir' across runs"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_seed,
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
      "",           "[[enable=]<pattern>][,events=<file>][,file=<file>]"},
+    {"plugin",     "QEMU_PLUGIN",      true,  handle_arg_plugin,
+     "",           "[file=]<file>[,arg=<string>]"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
 #if defined(TARGET_XTENSA)
@@ -643,6 +668,7 @@ int main(int argc, char **argv, char **envp)
     cpu_model = NULL;
 
     qemu_add_opts(&qemu_trace_opts);
+    qemu_plugin_add_opts();
 
     optind = parse_args(argc, argv);
 
@@ -650,6 +676,9 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     trace_init_file(trace_file);
+    if (qemu_plugin_load_list(&plugins)) {
+        exit(1);
+    }
 
     /* Zero out regs */
     memset(regs, 0, sizeof(struct target_pt_regs));
@@ -834,6 +863,10 @@ int main(int argc, char **argv, char **envp)
     tcg_prologue_init(tcg_ctx);
     tcg_region_init();
 
+    if (tb_cache_dir && !singlestep && !gdbstub_port) {
+        tb_cache_init(tb_cache_dir, exec_path, cpu_model);
+    }
+
     target_cpu_copy_regs(env, regs);
 
     if (gdbstub_port) {
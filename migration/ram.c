@@ -29,6 +29,9 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -583,6 +586,13 @@ exit:
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
+/* We reserve 3 bits for compression methods */
+#define MULTIFD_FLAG_COMPRESSION_MASK (7 << 1)
+/* we need to be compatible. Before compression value was 0 */
+#define MULTIFD_FLAG_NOCOMP (0 << 1)
+#define MULTIFD_FLAG_ZLIB (1 << 1)
+#define MULTIFD_FLAG_ZSTD (2 << 1)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -591,7 +601,9 @@ typedef struct {
     uint32_t version;
     unsigned char uuid[16]; /* QemuUUID */
     uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
+    /* MultiFDCompression used by this channel, 0 (none) on older QEMU */
+    uint8_t compression;
+    uint8_t unused1[6];     /* Reserved for future use */
     uint64_t unused2[4];    /* Reserved for future use */
 } __attribute__((packed)) MultiFDInit_t;
 
@@ -663,6 +675,10 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* compression method used by this channel */
+    MultiFDCompression compression;
+    /* used for compression methods */
+    void *data;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -700,8 +716,540 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* compression method negotiated in the initial packet */
+    MultiFDCompression compression;
+    /* used for de-compression methods */
+    void *data;
 } MultiFDRecvParams;
 
+typedef struct {
+    /* Setup for sending side */
+    int (*send_setup)(MultiFDSendParams *p, Error **errp);
+    /* Cleanup for sending side */
+    void (*send_cleanup)(MultiFDSendParams *p);
+    /* Prepare the send packet: set next_packet_size and the flags */
+    int (*send_prepare)(MultiFDSendParams *p, uint32_t used, Error **errp);
+    /* Write the pages (or their compressed form) to the channel */
+    int (*send_write)(MultiFDSendParams *p, uint32_t used, Error **errp);
+    /* Setup for receiving side */
+    int (*recv_setup)(MultiFDRecvParams *p, Error **errp);
+    /* Cleanup for receiving side */
+    void (*recv_cleanup)(MultiFDRecvParams *p);
+    /* Read all pages of the current packet */
+    int (*recv_pages)(MultiFDRecvParams *p, uint32_t used, Error **errp);
+} MultiFDMethods;
+
+/* Multifd without compression */
+
+static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    return 0;
+}
+
+static void nocomp_send_cleanup(MultiFDSendParams *p)
+{
+}
+
+static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    p->next_packet_size = used * qemu_target_page_size();
+    p->flags |= MULTIFD_FLAG_NOCOMP;
+    return 0;
+}
+
+static int nocomp_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+}
+
+static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    return 0;
+}
+
+static void nocomp_recv_cleanup(MultiFDRecvParams *p)
+{
+}
+
+static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+}
+
+/* Multifd zlib compression */
+
+struct zlib_data {
+    /* stream for compression */
+    z_stream zs;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+static int zlib_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct zlib_data *z = g_new0(struct zlib_data, 1);
+    z_stream *zs = &z->zs;
+
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+    if (deflateInit(zs, migrate_compress_level()) != Z_OK) {
+        g_free(z);
+        error_setg(errp, "multifd %d: deflate init failed", p->id);
+        return -1;
+    }
+    /* Room for incompressible data plus the per-page flush overhead */
+    z->zbuff_len = MULTIFD_PACKET_SIZE * 2;
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        deflateEnd(zs);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+static void zlib_send_cleanup(MultiFDSendParams *p)
+{
+    struct zlib_data *z = p->data;
+
+    if (!z) {
+        return;
+    }
+    deflateEnd(&z->zs);
+    g_free(z->zbuff);
+    g_free(z);
+    p->data = NULL;
+}
+
+static int zlib_send_prepare(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct zlib_data *z = p->data;
+    z_stream *zs = &z->zs;
+    size_t page_size = qemu_target_page_size();
+    uint32_t out_size = 0;
+    int ret;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        uint32_t available = z->zbuff_len - out_size;
+        int flush = Z_NO_FLUSH;
+
+        /* Every packet must be decodable on its own by the receiver */
+        if (i == used - 1) {
+            flush = Z_SYNC_FLUSH;
+        }
+
+        zs->avail_in = page_size;
+        zs->next_in = p->pages->iov[i].iov_base;
+
+        zs->avail_out = available;
+        zs->next_out = z->zbuff + out_size;
+
+        do {
+            ret = deflate(zs, flush);
+        } while (ret == Z_OK && zs->avail_in && zs->avail_out);
+        if (ret == Z_OK && zs->avail_in) {
+            error_setg(errp, "multifd %d: deflate failed to compress all input",
+                       p->id);
+            return -1;
+        }
+        if (ret != Z_OK) {
+            error_setg(errp, "multifd %d: deflate returned %d instead of Z_OK",
+                       p->id, ret);
+            return -1;
+        }
+        out_size += available - zs->avail_out;
+    }
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_ZLIB;
+
+    return 0;
+}
+
+static int zlib_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct zlib_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+static int zlib_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct zlib_data *z = g_new0(struct zlib_data, 1);
+    z_stream *zs = &z->zs;
+
+    zs->next_in = 0;
+    zs->avail_in = 0;
+    zs->total_in = 0;
+    zs->opaque = Z_NULL;
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    if (inflateInit(zs) != Z_OK) {
+        g_free(z);
+        error_setg(errp, "multifd %d: inflate init failed", p->id);
+        return -1;
+    }
+    z->zbuff_len = MULTIFD_PACKET_SIZE * 2;
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        inflateEnd(zs);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+static void zlib_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct zlib_data *z = p->data;
+
+    if (!z) {
+        return;
+    }
+    inflateEnd(&z->zs);
+    g_free(z->zbuff);
+    g_free(z);
+    p->data = NULL;
+}
+
+static int zlib_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct zlib_data *z = p->data;
+    z_stream *zs = &z->zs;
+    uint32_t in_size = p->next_packet_size;
+    /* we measure the change of total_out */
+    uint32_t out_size = zs->total_out;
+    uint32_t expected_size = used * qemu_target_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    int ret;
+    uint32_t i;
+
+    if (flags != MULTIFD_FLAG_ZLIB) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_ZLIB);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet of %u bytes does not fit in "
+                   "zbuff of %u bytes", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    zs->avail_in = in_size;
+    zs->next_in = z->zbuff;
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        int flush = Z_NO_FLUSH;
+        unsigned long start = zs->total_out;
+
+        if (i == used - 1) {
+            flush = Z_SYNC_FLUSH;
+        }
+
+        zs->avail_out = iov->iov_len;
+        zs->next_out = iov->iov_base;
+
+        do {
+            ret = inflate(zs, flush);
+        } while (ret == Z_OK && zs->avail_in
+                 && (zs->total_out - start) < iov->iov_len);
+        if (ret == Z_OK && (zs->total_out - start) < iov->iov_len) {
+            error_setg(errp, "multifd %d: inflate generated too few output",
+                       p->id);
+            return -1;
+        }
+        if (ret != Z_OK) {
+            error_setg(errp, "multifd %d: inflate returned %d instead of Z_OK",
+                       p->id, ret);
+            return -1;
+        }
+    }
+    out_size = zs->total_out - out_size;
+    if (out_size != expected_size) {
+        error_setg(errp, "multifd %d: packet size received %u size expected %u",
+                   p->id, out_size, expected_size);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef CONFIG_ZSTD
+/* Multifd zstd compression */
+
+struct zstd_data {
+    /* stream for compression */
+    ZSTD_CStream *zcs;
+    /* stream for decompression */
+    ZSTD_DStream *zds;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_data *z = g_new0(struct zstd_data, 1);
+    size_t res;
+
+    z->zcs = ZSTD_createCStream();
+    if (!z->zcs) {
+        g_free(z);
+        error_setg(errp, "multifd %d: zstd createCStream failed", p->id);
+        return -1;
+    }
+    res = ZSTD_initCStream(z->zcs, migrate_compress_level());
+    if (ZSTD_isError(res)) {
+        ZSTD_freeCStream(z->zcs);
+        g_free(z);
+        error_setg(errp, "multifd %d: initCStream failed with error %s",
+                   p->id, ZSTD_getErrorName(res));
+        return -1;
+    }
+    z->zbuff_len = MULTIFD_PACKET_SIZE * 2;
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        ZSTD_freeCStream(z->zcs);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+static void zstd_send_cleanup(MultiFDSendParams *p)
+{
+    struct zstd_data *z = p->data;
+
+    if (!z) {
+        return;
+    }
+    ZSTD_freeCStream(z->zcs);
+    g_free(z->zbuff);
+    g_free(z);
+    p->data = NULL;
+}
+
+static int zstd_send_prepare(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    struct zstd_data *z = p->data;
+    ZSTD_outBuffer out = {
+        .dst = z->zbuff,
+        .size = z->zbuff_len,
+        .pos = 0,
+    };
+    size_t page_size = qemu_target_page_size();
+    size_t ret;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        ZSTD_EndDirective flush = ZSTD_e_continue;
+        ZSTD_inBuffer in = {
+            .src = p->pages->iov[i].iov_base,
+            .size = page_size,
+            .pos = 0,
+        };
+
+        /* Every packet must be decodable on its own by the receiver */
+        if (i == used - 1) {
+            flush = ZSTD_e_flush;
+        }
+
+        /*
+         * With ZSTD_e_continue the return value is only a hint; with
+         * ZSTD_e_flush, a non-zero value means that there is still
+         * buffered data to write out.
+         */
+        do {
+            ret = ZSTD_compressStream2(z->zcs, &out, &in, flush);
+        } while (!ZSTD_isError(ret) && out.pos < out.size &&
+                 (in.pos < in.size || (flush == ZSTD_e_flush && ret > 0)));
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %d: compressStream error %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (in.pos < in.size || (flush == ZSTD_e_flush && ret > 0)) {
+            error_setg(errp, "multifd %d: compressStream buffer too small",
+                       p->id);
+            return -1;
+        }
+    }
+    p->next_packet_size = out.pos;
+    p->flags |= MULTIFD_FLAG_ZSTD;
+
+    return 0;
+}
+
+static int zstd_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct zstd_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+static int zstd_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct zstd_data *z = g_new0(struct zstd_data, 1);
+    size_t res;
+
+    z->zds = ZSTD_createDStream();
+    if (!z->zds) {
+        g_free(z);
+        error_setg(errp, "multifd %d: zstd createDStream failed", p->id);
+        return -1;
+    }
+    res = ZSTD_initDStream(z->zds);
+    if (ZSTD_isError(res)) {
+        ZSTD_freeDStream(z->zds);
+        g_free(z);
+        error_setg(errp, "multifd %d: initDStream failed with error %s",
+                   p->id, ZSTD_getErrorName(res));
+        return -1;
+    }
+    z->zbuff_len = MULTIFD_PACKET_SIZE * 2;
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        ZSTD_freeDStream(z->zds);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+static void zstd_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct zstd_data *z = p->data;
+
+    if (!z) {
+        return;
+    }
+    ZSTD_freeDStream(z->zds);
+    g_free(z->zbuff);
+    g_free(z);
+    p->data = NULL;
+}
+
+static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct zstd_data *z = p->data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    ZSTD_inBuffer in;
+    size_t ret;
+    uint32_t i;
+
+    if (flags != MULTIFD_FLAG_ZSTD) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_ZSTD);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet of %u bytes does not fit in "
+                   "zbuff of %u bytes", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    in.src = z->zbuff;
+    in.size = in_size;
+    in.pos = 0;
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        ZSTD_outBuffer out = {
+            .dst = iov->iov_base,
+            .size = iov->iov_len,
+            .pos = 0,
+        };
+
+        do {
+            ret = ZSTD_decompressStream(z->zds, &out, &in);
+        } while (!ZSTD_isError(ret) && out.pos < out.size &&
+                 in.pos < in.size);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %d: decompressStream error %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (out.pos != out.size) {
+            error_setg(errp, "multifd %d: decompressStream generated %zu "
+                       "bytes, expected %zu", p->id, out.pos, out.size);
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif /* CONFIG_ZSTD */
+
+/*
+ * Indexed by MultiFDCompression.  The value is sent on the wire in the
+ * initial packet, so new methods must only ever be appended.
+ */
+static const MultiFDMethods multifd_methods[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = {
+        .send_setup = nocomp_send_setup,
+        .send_cleanup = nocomp_send_cleanup,
+        .send_prepare = nocomp_send_prepare,
+        .send_write = nocomp_send_write,
+        .recv_setup = nocomp_recv_setup,
+        .recv_cleanup = nocomp_recv_cleanup,
+        .recv_pages = nocomp_recv_pages,
+    },
+    [MULTIFD_COMPRESSION_ZLIB] = {
+        .send_setup = zlib_send_setup,
+        .send_cleanup = zlib_send_cleanup,
+        .send_prepare = zlib_send_prepare,
+        .send_write = zlib_send_write,
+        .recv_setup = zlib_recv_setup,
+        .recv_cleanup = zlib_recv_cleanup,
+        .recv_pages = zlib_recv_pages,
+    },
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = {
+        .send_setup = zstd_send_setup,
+        .send_cleanup = zstd_send_cleanup,
+        .send_prepare = zstd_send_prepare,
+        .send_write = zstd_send_write,
+        .recv_setup = zstd_recv_setup,
+        .recv_cleanup = zstd_recv_cleanup,
+        .recv_pages = zstd_recv_pages,
+    },
+#endif
+};
+
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg;
@@ -710,6 +1258,9 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
     msg.version = cpu_to_be32(MULTIFD_VERSION);
     msg.id = p->id;
+    msg.compression = p->compression;
+    memset(msg.unused1, 0, sizeof(msg.unused1));
+    memset(msg.unused2, 0, sizeof(msg.unused2));
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
     ret = qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
@@ -719,7 +1270,9 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     return 0;
 }
 
-static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+static int multifd_recv_initial_packet(QIOChannel *c,
+                                       MultiFDCompression *compression,
+                                       Error **errp)
 {
     MultiFDInit_t msg;
     int ret;
@@ -761,6 +1314,14 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
+    if (msg.compression >= MULTIFD_COMPRESSION__MAX) {
+        error_setg(errp, "multifd: channel %hhd uses compression method %d "
+                   "which is not supported by this QEMU", msg.id,
+                   msg.compression);
+        return -1;
+    }
+    *compression = msg.compression;
+
     return msg.id;
 }
 
@@ -902,6 +1463,11 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /*
+     * Protects packet_num, the transfer accounting and, while the scan
+     * threads run, the main migration stream.
+     */
+    QemuMutex mutex;
 } *multifd_send_state;
 
 /*
@@ -920,18 +1486,22 @@ struct {
  * thread is using the channel mutex when changing it, and the channel
  * have to had finish with its own, otherwise pending_job can't be
  * false.
+ *
+ * The RAM scan threads each own a "pages" too, which they pass as
+ * @pagesp; it is switched with a channel's one in the same way.
  */
 
-static int multifd_send_pages(RAMState *rs)
+static int multifd_send_pages(RAMState *rs, MultiFDPages_t **pagesp)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDPages_t *pages = *pagesp;
     uint64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
-    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+    for (i = atomic_read(&next_channel);;
+         i = (i + 1) % migrate_multifd_channels()) {
         p = &multifd_send_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
@@ -942,30 +1512,33 @@ static int multifd_send_pages(RAMState *rs)
         }
         if (!p->pending_job) {
             p->pending_job++;
-            next_channel = (i + 1) % migrate_multifd_channels();
+            atomic_set(&next_channel, (i + 1) % migrate_multifd_channels());
             break;
         }
         qemu_mutex_unlock(&p->mutex);
     }
     p->pages->used = 0;
 
-    p->packet_num = multifd_send_state->packet_num++;
     p->pages->block = NULL;
-    multifd_send_state->pages = p->pages;
+    *pagesp = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    p->packet_num = multifd_send_state->packet_num++;
     qemu_file_update_transfer(rs->f, transferred);
     ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
+    ram_counters.transferred += transferred;
+    qemu_mutex_unlock(&multifd_send_state->mutex);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
     return 1;
 }
 
-static int multifd_queue_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static int multifd_queue_page(RAMState *rs, MultiFDPages_t **pagesp,
+                              RAMBlock *block, ram_addr_t offset)
 {
-    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDPages_t *pages = *pagesp;
 
     if (!pages->block) {
         pages->block = block;
@@ -982,12 +1555,12 @@ static int multifd_queue_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
         }
     }
 
-    if (multifd_send_pages(rs) < 0) {
+    if (multifd_send_pages(rs, pagesp) < 0) {
         return -1;
     }
 
     if (pages->block != block) {
-        return  multifd_queue_page(rs, block, offset);
+        return  multifd_queue_page(rs, pagesp, block, offset);
     }
 
     return 1;
@@ -1047,8 +1620,10 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_methods[p->compression].send_cleanup(p);
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_mutex_destroy(&multifd_send_state->mutex);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -1065,7 +1640,7 @@ static void multifd_send_sync_main(RAMState *rs)
         return;
     }
     if (multifd_send_state->pages->used) {
-        if (multifd_send_pages(rs) < 0) {
+        if (multifd_send_pages(rs, &multifd_send_state->pages) < 0) {
             error_report("%s: multifd_send_pages fail", __func__);
             return;
         }
@@ -1125,9 +1700,17 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
-            flags = p->flags;
 
-            p->next_packet_size = used * qemu_target_page_size();
+            p->next_packet_size = 0;
+            if (used) {
+                ret = multifd_methods[p->compression].send_prepare(p, used,
+                                                                   &local_err);
+                if (ret != 0) {
+                    qemu_mutex_unlock(&p->mutex);
+                    break;
+                }
+            }
+            flags = p->flags;
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
@@ -1145,8 +1728,8 @@ static void *multifd_send_thread(void *opaque)
             }
 
             if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
+                ret = multifd_methods[p->compression].send_write(p, used,
+                                                                 &local_err);
                 if (ret != 0) {
                     break;
                 }
@@ -1217,16 +1800,19 @@ int multifd_save_setup(void)
 {
     int thread_count;
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    MultiFDCompression compression;
     uint8_t i;
 
     if (!migrate_use_multifd()) {
         return 0;
     }
     thread_count = migrate_multifd_channels();
+    compression = migrate_multifd_compression();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_mutex_init(&multifd_send_state->mutex);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1242,6 +1828,22 @@ int multifd_save_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdsend_%d", i);
+        p->compression = compression;
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+
+        if (multifd_methods[compression].send_setup(p, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
     return 0;
@@ -1319,6 +1921,7 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_methods[p->compression].recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
@@ -1398,8 +2001,8 @@ static void *multifd_recv_thread(void *opaque)
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+            ret = multifd_methods[p->compression].recv_pages(p, used,
+                                                             &local_err);
             if (ret != 0) {
                 break;
             }
@@ -1476,9 +2079,10 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
 {
     MultiFDRecvParams *p;
     Error *local_err = NULL;
+    MultiFDCompression compression;
     int id;
 
-    id = multifd_recv_initial_packet(ioc, &local_err);
+    id = multifd_recv_initial_packet(ioc, &compression, &local_err);
     if (id < 0) {
         multifd_recv_terminate_threads(local_err);
         error_propagate_prepend(errp, local_err,
@@ -1497,6 +2101,12 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
         error_propagate(errp, local_err);
         return false;
     }
+    p->compression = compression;
+    if (multifd_methods[compression].recv_setup(p, &local_err)) {
+        multifd_recv_terminate_threads(local_err);
+        error_propagate(errp, local_err);
+        return false;
+    }
     p->c = ioc;
     object_ref(OBJECT(ioc));
     /* initial packet */
@@ -1707,28 +2317,20 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
     if (!rs->fpo_enabled && rs->ram_bulk_stage && start > 0) {
         next = start + 1;
     } else {
-        next = find_next_bit(bitmap, size, start);
+        next = bitmap_find_next_bit(bitmap, size, start);
     }
 
     return next;
 }
 
-static inline bool migration_bitmap_clear_dirty(RAMState *rs,
-                                                RAMBlock *rb,
-                                                unsigned long page)
+/*
+ * Clear the dirty log of the memory region for the clear_bmap chunk of
+ * @page, if that has not been done yet since the last sync.
+ */
+static void migration_clear_memory_region_dirty_bitmap(RAMState *rs,
+                                                       RAMBlock *rb,
+                                                       unsigned long page)
 {
-    bool ret;
-
-    qemu_mutex_lock(&rs->bitmap_mutex);
-
-    /*
-     * Clear dirty bitmap if needed.  This _must_ be called before we
-     * send any of the page in the chunk because we need to make sure
-     * we can capture further page content changes when we sync dirty
-     * log the next time.  So as long as we are going to send any of
-     * the page in the chunk we clear the remote dirty bitmap for all.
-     * Clearing it earlier won't be a problem, but too late will.
-     */
     if (rb->clear_bmap && clear_bmap_test_and_clear(rb, page)) {
         uint8_t shift = rb->clear_bmap_shift;
         hwaddr size = 1ULL << (TARGET_PAGE_BITS + shift);
@@ -1746,6 +2348,25 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
         trace_migration_bitmap_clear_dirty(rb->idstr, start, size, page);
         memory_region_clear_dirty_bitmap(rb->mr, start, size);
     }
+}
+
+static inline bool migration_bitmap_clear_dirty(RAMState *rs,
+                                                RAMBlock *rb,
+                                                unsigned long page)
+{
+    bool ret;
+
+    qemu_mutex_lock(&rs->bitmap_mutex);
+
+    /*
+     * Clear dirty bitmap if needed.  This _must_ be called before we
+     * send any of the page in the chunk because we need to make sure
+     * we can capture further page content changes when we sync dirty
+     * log the next time.  So as long as we are going to send any of
+     * the page in the chunk we clear the remote dirty bitmap for all.
+     * Clearing it earlier won't be a problem, but too late will.
+     */
+    migration_clear_memory_region_dirty_bitmap(rs, rb, page);
 
     ret = test_and_clear_bit(page, rb->bmap);
 
@@ -1765,6 +2386,438 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * RAM scan threads
+ *
+ * With multifd, a single migration thread searching the dirty bitmap
+ * and queueing pages cannot keep many channels busy.  When
+ * multifd-scan-threads is set, the bitmap is instead cut in chunks that
+ * a pool of threads processes in parallel, both to sync it with the
+ * dirty log and to send the dirty pages.  Each thread fills its own
+ * MultiFDPages_t; zero pages still go to the main stream, serialized by
+ * multifd_send_state->mutex.  The migration thread waits for the job to
+ * complete, so it never touches the stream at the same time.
+ */
+
+/* Bitmap range handed out at a time, 64 MiB with 4 KiB pages */
+#define RAM_SCAN_CHUNK_PAGES (16 * 1024)
+
+typedef enum {
+    RAM_SCAN_SYNC,
+    RAM_SCAN_SEND,
+} RAMScanJob;
+
+typedef struct {
+    QemuThread thread;
+    /* Pages queued by this thread, sent in multifd packets */
+    MultiFDPages_t *pages;
+    /* Results of the last job */
+    uint64_t dirty_pages;
+    uint64_t real_dirty_pages;
+    uint64_t normal_pages;
+    uint64_t zero_pages;
+    int ret;
+} RAMScanThread;
+
+static struct {
+    RAMState *rs;
+    RAMScanThread *threads;
+    int thread_count;
+    /* Protects the fields below */
+    QemuMutex mutex;
+    /* Signalled when a new job is posted */
+    QemuCond job_cond;
+    /* Signalled when the last thread is done with the job */
+    QemuCond done_cond;
+    unsigned job_id;
+    RAMScanJob job;
+    /* Threads still working on the job */
+    int running;
+    bool quit;
+    /* Next chunk to hand out; NULL once the whole RAM has been seen */
+    RAMBlock *block;
+    unsigned long page;
+    /* Where the job started, and thus ends once wrapped around */
+    RAMBlock *start_block;
+    unsigned long start_page;
+    bool wrapped;
+    /* Set to make the threads drop the job, read without the lock */
+    bool stop;
+    /* For RAM_SCAN_SEND, in QEMU_CLOCK_REALTIME ns; 0 for no limit */
+    int64_t deadline;
+} *ram_scan_state;
+
+static RAMBlock *ram_scan_next_block(RAMBlock *block)
+{
+    do {
+        block = block ? QLIST_NEXT_RCU(block, next)
+                      : QLIST_FIRST_RCU(&ram_list.blocks);
+    } while (block && ramblock_is_ignored(block));
+
+    return block;
+}
+
+/* Called with ram_scan_state->mutex held, within an RCU critical section */
+static bool ram_scan_next_chunk(RAMBlock **block, unsigned long *start,
+                                unsigned long *end)
+{
+    unsigned long pages;
+    unsigned long page;
+    RAMBlock *rb;
+
+    while (ram_scan_state->block && !atomic_read(&ram_scan_state->stop)) {
+        rb = ram_scan_state->block;
+        page = ram_scan_state->page;
+        pages = rb->used_length >> TARGET_PAGE_BITS;
+
+        if (ram_scan_state->wrapped && rb == ram_scan_state->start_block &&
+            page >= ram_scan_state->start_page) {
+            /* Been once around the RAM */
+            ram_scan_state->block = NULL;
+            break;
+        }
+        if (page >= pages) {
+            ram_scan_state->page = 0;
+            ram_scan_state->block = ram_scan_next_block(rb);
+            if (!ram_scan_state->block && !ram_scan_state->wrapped) {
+                ram_scan_state->block = ram_scan_next_block(NULL);
+                ram_scan_state->wrapped = true;
+            }
+            continue;
+        }
+
+        *block = rb;
+        *start = page;
+        *end = MIN(QEMU_ALIGN_UP(page + 1, RAM_SCAN_CHUNK_PAGES), pages);
+        ram_scan_state->page = *end;
+
+        /*
+         * The dirty log must be cleared before any page of its chunk is
+         * sent.  Do it while handing out the first part of the chunk, so
+         * that no other thread can get to the rest before it is done.
+         */
+        if (ram_scan_state->job == RAM_SCAN_SEND && rb->clear_bmap) {
+            unsigned long clear_pages = 1UL << rb->clear_bmap_shift;
+
+            for (page = *start; page < *end;
+                 page = QEMU_ALIGN_DOWN(page, clear_pages) + clear_pages) {
+                migration_clear_memory_region_dirty_bitmap(ram_scan_state->rs,
+                                                           rb, page);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static void ram_scan_sync_chunk(RAMScanThread *t, RAMBlock *block,
+                                unsigned long start, unsigned long end)
+{
+    uint64_t real_dirty_pages = 0;
+
+    t->dirty_pages +=
+        cpu_physical_memory_sync_dirty_bitmap(block,
+                                              start << TARGET_PAGE_BITS,
+                                              (end - start) << TARGET_PAGE_BITS,
+                                              &real_dirty_pages);
+    t->real_dirty_pages += real_dirty_pages;
+}
+
+static int ram_scan_send_page(RAMScanThread *t, RAMBlock *block,
+                              unsigned long page)
+{
+    RAMState *rs = ram_scan_state->rs;
+    ram_addr_t offset = page << TARGET_PAGE_BITS;
+    int len;
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        qemu_mutex_lock(&multifd_send_state->mutex);
+        len = save_page_header(rs, rs->f, block, offset | RAM_SAVE_FLAG_ZERO);
+        qemu_put_byte(rs->f, 0);
+        ram_counters.transferred += len + 1;
+        qemu_mutex_unlock(&multifd_send_state->mutex);
+        t->zero_pages++;
+        return 0;
+    }
+
+    if (multifd_queue_page(rs, &t->pages, block, offset) < 0) {
+        return -1;
+    }
+    t->normal_pages++;
+    return 0;
+}
+
+static bool ram_scan_should_stop(void)
+{
+    RAMState *rs = ram_scan_state->rs;
+    bool stop;
+
+    if (!ram_scan_state->deadline) {
+        return qemu_file_get_error(rs->f) != 0;
+    }
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    stop = qemu_file_rate_limit(rs->f) != 0;
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+
+    return stop ||
+           qemu_clock_get_ns(QEMU_CLOCK_REALTIME) > ram_scan_state->deadline;
+}
+
+static int ram_scan_send_chunk(RAMScanThread *t, RAMBlock *block,
+                               unsigned long start, unsigned long end)
+{
+    RAMState *rs = ram_scan_state->rs;
+    unsigned long page = start;
+
+    while ((page = bitmap_find_next_bit(block->bmap, end, page)) < end) {
+        unsigned long base = QEMU_ALIGN_DOWN(page, BITS_PER_LONG);
+        unsigned long *word = block->bmap + BIT_WORD(page);
+        unsigned long bits = BITMAP_FIRST_WORD_MASK(page);
+
+        if (end - base < BITS_PER_LONG) {
+            bits &= BITMAP_LAST_WORD_MASK(end);
+        }
+
+        /* Take a whole word of dirty pages at once */
+        qemu_mutex_lock(&rs->bitmap_mutex);
+        bits &= *word;
+        *word &= ~bits;
+        rs->migration_dirty_pages -= ctpopl(bits);
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+
+        while (bits) {
+            if (ram_scan_send_page(t, block, base + ctzl(bits)) < 0) {
+                return -1;
+            }
+            bits &= bits - 1;
+        }
+
+        if (atomic_read(&ram_scan_state->stop) || ram_scan_should_stop()) {
+            atomic_set(&ram_scan_state->stop, true);
+            break;
+        }
+        page = base + BITS_PER_LONG;
+    }
+    return 0;
+}
+
+static void *ram_scan_thread(void *opaque)
+{
+    RAMScanThread *t = opaque;
+    RAMState *rs = ram_scan_state->rs;
+    unsigned job_id = 0;
+    RAMBlock *block;
+    unsigned long start, end;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&ram_scan_state->mutex);
+    while (true) {
+        while (!ram_scan_state->quit && ram_scan_state->job_id == job_id) {
+            qemu_cond_wait(&ram_scan_state->job_cond, &ram_scan_state->mutex);
+        }
+        if (ram_scan_state->quit) {
+            break;
+        }
+        job_id = ram_scan_state->job_id;
+        t->dirty_pages = t->real_dirty_pages = 0;
+        t->normal_pages = t->zero_pages = 0;
+        t->ret = 0;
+
+        rcu_read_lock();
+        while (ram_scan_next_chunk(&block, &start, &end)) {
+            qemu_mutex_unlock(&ram_scan_state->mutex);
+            if (ram_scan_state->job == RAM_SCAN_SYNC) {
+                ram_scan_sync_chunk(t, block, start, end);
+            } else {
+                t->ret = ram_scan_send_chunk(t, block, start, end);
+            }
+            qemu_mutex_lock(&ram_scan_state->mutex);
+            if (t->ret < 0) {
+                atomic_set(&ram_scan_state->stop, true);
+            }
+        }
+        rcu_read_unlock();
+
+        if (t->pages->used && t->ret == 0) {
+            qemu_mutex_unlock(&ram_scan_state->mutex);
+            t->ret = multifd_send_pages(rs, &t->pages) < 0 ? -1 : 0;
+            qemu_mutex_lock(&ram_scan_state->mutex);
+        }
+
+        if (--ram_scan_state->running == 0) {
+            qemu_cond_signal(&ram_scan_state->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&ram_scan_state->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Run a job on the scan threads, starting at @page of @block, and wait
+ * for it to complete.
+ *
+ * Returns true if the threads have been once around the RAM.
+ */
+static bool ram_scan_run(RAMScanJob job, RAMBlock *block, unsigned long page,
+                         int64_t deadline)
+{
+    bool complete;
+
+    qemu_mutex_lock(&ram_scan_state->mutex);
+    ram_scan_state->job = job;
+    ram_scan_state->block = ram_scan_state->start_block = block;
+    ram_scan_state->page = ram_scan_state->start_page = page;
+    ram_scan_state->wrapped = false;
+    ram_scan_state->stop = false;
+    ram_scan_state->deadline = deadline;
+    ram_scan_state->running = ram_scan_state->thread_count;
+    ram_scan_state->job_id++;
+    qemu_cond_broadcast(&ram_scan_state->job_cond);
+
+    while (ram_scan_state->running) {
+        qemu_cond_wait(&ram_scan_state->done_cond, &ram_scan_state->mutex);
+    }
+    complete = !ram_scan_state->block;
+    qemu_mutex_unlock(&ram_scan_state->mutex);
+
+    return complete;
+}
+
+/* Called with RCU critical section and bitmap_mutex held */
+static void ram_scan_sync_dirty_bitmap(RAMState *rs)
+{
+    int i;
+
+    ram_scan_run(RAM_SCAN_SYNC, ram_scan_next_block(NULL), 0, 0);
+
+    for (i = 0; i < ram_scan_state->thread_count; i++) {
+        RAMScanThread *t = &ram_scan_state->threads[i];
+
+        rs->migration_dirty_pages += t->dirty_pages;
+        rs->num_dirty_pages_period += t->real_dirty_pages;
+    }
+}
+
+/**
+ * ram_scan_save_pages: send dirty pages with the scan threads
+ *
+ * Goes once around the RAM, starting where the previous call stopped.
+ *
+ * Returns the number of pages sent, zero if there were none left,
+ * or negative on error
+ *
+ * Called within an RCU critical section.
+ *
+ * @rs: current RAM state
+ * @deadline: time at which to stop, in QEMU_CLOCK_REALTIME ns.  Zero
+ *            ignores both the deadline and the rate limit.
+ */
+static int ram_scan_save_pages(RAMState *rs, int64_t deadline)
+{
+    RAMBlock *block = rs->last_seen_block;
+    unsigned long page = rs->last_page;
+    uint64_t pages = 0;
+    int ret = 0;
+    int i;
+
+    if (!block || ramblock_is_ignored(block)) {
+        block = ram_scan_next_block(NULL);
+        page = 0;
+    }
+    if (!block) {
+        return 0;
+    }
+
+    if (ram_scan_run(RAM_SCAN_SEND, block, QEMU_ALIGN_DOWN(page,
+                     RAM_SCAN_CHUNK_PAGES), deadline)) {
+        rs->last_seen_block = block;
+        rs->last_page = page;
+    } else {
+        rs->last_seen_block = ram_scan_state->block;
+        rs->last_page = ram_scan_state->page;
+    }
+    if (ram_scan_state->wrapped) {
+        rs->ram_bulk_stage = false;
+    }
+
+    for (i = 0; i < ram_scan_state->thread_count; i++) {
+        RAMScanThread *t = &ram_scan_state->threads[i];
+
+        ram_counters.normal += t->normal_pages;
+        ram_counters.duplicate += t->zero_pages;
+        pages += t->normal_pages + t->zero_pages;
+        if (t->ret < 0) {
+            ret = t->ret;
+        }
+    }
+    trace_ram_scan_save_pages(pages, ram_scan_state->wrapped);
+
+    return ret < 0 ? ret : MIN(pages, INT_MAX);
+}
+
+static bool ram_scan_usable(void)
+{
+    return migrate_use_multifd() && migrate_multifd_scan_threads() &&
+           !migrate_postcopy_ram() && !migrate_use_compression() &&
+           !migrate_use_xbzrle() && !migrate_colo_enabled();
+}
+
+static void ram_scan_threads_cleanup(void)
+{
+    int i;
+
+    if (!ram_scan_state) {
+        return;
+    }
+
+    qemu_mutex_lock(&ram_scan_state->mutex);
+    ram_scan_state->quit = true;
+    qemu_cond_broadcast(&ram_scan_state->job_cond);
+    qemu_mutex_unlock(&ram_scan_state->mutex);
+
+    for (i = 0; i < ram_scan_state->thread_count; i++) {
+        qemu_thread_join(&ram_scan_state->threads[i].thread);
+        multifd_pages_clear(ram_scan_state->threads[i].pages);
+    }
+    qemu_mutex_destroy(&ram_scan_state->mutex);
+    qemu_cond_destroy(&ram_scan_state->job_cond);
+    qemu_cond_destroy(&ram_scan_state->done_cond);
+    g_free(ram_scan_state->threads);
+    g_free(ram_scan_state);
+    ram_scan_state = NULL;
+}
+
+static void ram_scan_threads_setup(RAMState *rs)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    int i;
+
+    if (!ram_scan_usable()) {
+        return;
+    }
+
+    ram_scan_state = g_malloc0(sizeof(*ram_scan_state));
+    ram_scan_state->rs = rs;
+    ram_scan_state->thread_count = migrate_multifd_scan_threads();
+    ram_scan_state->threads = g_new0(RAMScanThread,
+                                     ram_scan_state->thread_count);
+    qemu_mutex_init(&ram_scan_state->mutex);
+    qemu_cond_init(&ram_scan_state->job_cond);
+    qemu_cond_init(&ram_scan_state->done_cond);
+
+    for (i = 0; i < ram_scan_state->thread_count; i++) {
+        RAMScanThread *t = &ram_scan_state->threads[i];
+
+        t->pages = multifd_pages_init(page_count);
+        qemu_thread_create(&t->thread, "ramscan", ram_scan_thread, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1849,8 +2902,12 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        ramblock_sync_dirty_bitmap(rs, block);
+    if (ram_scan_state) {
+        ram_scan_sync_dirty_bitmap(rs);
+    } else {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
     }
     ram_counters.remaining = ram_bytes_remaining();
     rcu_read_unlock();
@@ -2089,7 +3146,8 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
-    if (multifd_queue_page(rs, block, offset) < 0) {
+    if (multifd_queue_page(rs, &multifd_send_state->pages,
+                           block, offset) < 0) {
         return -1;
     }
     ram_counters.normal++;
@@ -2782,6 +3840,7 @@ static void ram_save_cleanup(void *opaque)
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    ram_scan_threads_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -3436,6 +4495,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
     }
     (*rsp)->f = f;
+    ram_scan_threads_setup(*rsp);
 
     rcu_read_lock();
 
@@ -3509,7 +4569,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
             break;
         }
 
-        pages = ram_find_and_save_block(rs, false);
+        if (ram_scan_state) {
+            pages = ram_scan_save_pages(rs, t0 + MAX_WAIT * SCALE_MS);
+        } else {
+            pages = ram_find_and_save_block(rs, false);
+        }
         /* no more pages to sent */
         if (pages == 0) {
             done = 1;
@@ -3589,7 +4653,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     while (true) {
         int pages;
 
-        pages = ram_find_and_save_block(rs, !migration_in_colo_state());
+        if (ram_scan_state) {
+            pages = ram_scan_save_pages(rs, 0);
+        } else {
+            pages = ram_find_and_save_block(rs, !migration_in_colo_state());
+        }
         /* no more blocks to sent */
         if (pages == 0) {
             break;
@@ -35,6 +35,13 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * NBD_ZERO_COPY_MIN_LEN: read payloads smaller than this are always
+ * copied to the socket, as pinning the pages and collecting the
+ * completion costs more than the copy.
+ */
+#define NBD_ZERO_COPY_MIN_LEN (16 * KiB)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -77,8 +84,16 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+    bool zero_copy; /* data may have been sent with zero copy */
 };
 
+/* A read buffer that the kernel may still be transmitting from */
+typedef struct NBDZeroCopyBuffer {
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) entry;
+    void *data;
+    uint64_t seq; /* can be freed once this many writes completed */
+} NBDZeroCopyBuffer;
+
 struct NBDExport {
     int refcount;
     void (*close)(NBDExport *exp);
@@ -89,6 +104,7 @@ struct NBDExport {
     uint64_t dev_offset;
     uint64_t size;
     uint16_t nbdflags;
+    bool zero_copy;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 
@@ -138,6 +154,9 @@ struct NBDClient {
     bool structured_reply;
     NBDExportMetaContexts export_meta;
 
+    bool zero_copy;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) zero_copy_bufs;
+
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
@@ -1343,6 +1362,52 @@ static int nbd_receive_request(QIOChannel *ioc, NBDRequest *request,
 
 #define MAX_NBD_REQUESTS 16
 
+/*
+ * Free the read buffers whose zero copy writes have completed.  @data,
+ * if not NULL, is a buffer that has just been sent; it is kept until
+ * the writes issued so far have completed.
+ */
+static void nbd_zero_copy_collect(NBDClient *client, void *data)
+{
+    NBDZeroCopyBuffer *buf;
+    uint64_t queued = UINT64_MAX, sent = 0;
+    Error *local_err = NULL;
+    int ret;
+
+    ret = qio_channel_zero_copy_status(client->ioc, &queued, &sent,
+                                       &local_err);
+    if (ret < 0) {
+        /* Keep the outstanding buffers until the client goes away */
+        error_reportf_err(local_err, "Disabling NBD zero copy reads: ");
+        client->zero_copy = false;
+        queued = UINT64_MAX;
+        sent = 0;
+    } else if (ret > 0 && client->zero_copy) {
+        /* The kernel had to copy the data anyway, e.g. over loopback */
+        trace_nbd_zero_copy_disable(client);
+        client->zero_copy = false;
+    }
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_bufs)) &&
+           buf->seq <= sent) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_bufs, entry);
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+
+    if (!data) {
+        return;
+    }
+    if (sent >= queued) {
+        qemu_vfree(data);
+        return;
+    }
+    buf = g_new(NBDZeroCopyBuffer, 1);
+    buf->data = data;
+    buf->seq = queued;
+    QSIMPLEQ_INSERT_TAIL(&client->zero_copy_bufs, buf, entry);
+}
+
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -1350,12 +1415,21 @@ void nbd_client_get(NBDClient *client)
 
 void nbd_client_put(NBDClient *client)
 {
+    NBDZeroCopyBuffer *buf, *next_buf;
+
     if (--client->refcount == 0) {
         /* The last reference should be dropped by client->close,
          * which is called by client_close.
          */
         assert(client->closing);
 
+        /* Whatever has not completed by now belongs to a dead connection */
+        nbd_zero_copy_collect(client, NULL);
+        QSIMPLEQ_FOREACH_SAFE(buf, &client->zero_copy_bufs, entry, next_buf) {
+            qemu_vfree(buf->data);
+            g_free(buf);
+        }
+
         qio_channel_detach_aio_context(client->ioc);
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
@@ -1408,6 +1482,12 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
+    if (req->zero_copy || !QSIMPLEQ_EMPTY(&client->zero_copy_bufs)) {
+        nbd_zero_copy_collect(client, req->zero_copy ? req->data : NULL);
+        if (req->zero_copy) {
+            req->data = NULL;
+        }
+    }
     if (req->data) {
         qemu_vfree(req->data);
     }
@@ -1463,7 +1543,8 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
                           uint64_t size, const char *name, const char *desc,
                           const char *bitmap, bool readonly, bool shared,
                           void (*close)(NBDExport *), bool writethrough,
-                          BlockBackend *on_eject_blk, Error **errp)
+                          bool zero_copy, BlockBackend *on_eject_blk,
+                          Error **errp)
 {
     AioContext *ctx;
     BlockBackend *blk;
@@ -1505,6 +1586,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
     exp->dev_offset = dev_offset;
     exp->name = g_strdup(name);
     exp->description = g_strdup(desc);
+    exp->zero_copy = zero_copy;
     exp->nbdflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
     if (readonly) {
@@ -1705,6 +1787,41 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Send a reply whose last element is the payload of a read request.
+ * With zero copy, the payload is transmitted straight from the request
+ * buffer, and nbd_request_put() keeps the buffer until the kernel is
+ * done with it.  The headers are still copied, since they live on the
+ * stack.
+ */
+static int coroutine_fn nbd_co_send_read_iov(NBDClient *client,
+                                             struct iovec *iov,
+                                             unsigned niov, Error **errp)
+{
+    int ret;
+
+    if (!client->zero_copy || iov[niov - 1].iov_len < NBD_ZERO_COPY_MIN_LEN) {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+    if (ret == 0) {
+        ret = qio_channel_writev_zero_copy_all(client->ioc, &iov[niov - 1], 1,
+                                               errp);
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret < 0 ? -EIO : 0;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1731,7 +1848,10 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    if (len) {
+        return nbd_co_send_read_iov(client, iov, 2, errp);
+    }
+    return nbd_co_send_iov(client, iov, 1, errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1780,7 +1900,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_read_iov(client, iov, 2, errp);
 }
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
@@ -2121,6 +2241,9 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                 error_setg(errp, "No memory");
                 return -ENOMEM;
             }
+            req->zero_copy = client->zero_copy &&
+                             request->type == NBD_CMD_READ &&
+                             request->len >= NBD_ZERO_COPY_MIN_LEN;
         }
     }
 
@@ -2478,6 +2601,18 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    /* Data sent over TLS is encrypted into a separate buffer anyway */
+    if (client->exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        if (qio_channel_socket_set_zero_copy(client->sioc, &local_err) < 0) {
+            trace_nbd_zero_copy_unavailable(client,
+                                            error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+        } else {
+            client->zero_copy = true;
+        }
+    }
+
     nbd_client_receive_next_request(client);
 }
 
@@ -2506,6 +2641,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
     client->ioc = QIO_CHANNEL(sioc);
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
+    QSIMPLEQ_INIT(&client->zero_copy_bufs);
 
     co = qemu_coroutine_create(nbd_co_client_start, client);
     qemu_coroutine_enter(co);
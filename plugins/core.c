@@ -0,0 +1,314 @@
+/*
+ * QEMU Plugin Core code
+ *
+ * This is the core code that deals with the bookkeeping of plugins and
+ * of the callbacks they register, and runs those callbacks on behalf
+ * of the TCG helpers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/plugin.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "exec/memop.h"
+#include "trace/mem-internal.h" /* mem_info macros */
+
+#include "plugin.h"
+
+struct qemu_plugin_state {
+    QTAILQ_HEAD(, qemu_plugin_ctx) ctxs;
+    /* next plugin id, never reused */
+    qemu_plugin_id_t next_id;
+    /* number of installed plugins that asked for translation callbacks */
+    unsigned int n_tb_trans;
+    /*
+     * Descriptors of every block translated since the last tb_flush.
+     * Several vCPUs may translate at the same time, hence the lock.
+     */
+    QemuMutex lock;
+    GPtrArray *tbs;
+};
+
+static struct qemu_plugin_state plugin;
+
+static void __attribute__((__constructor__)) plugin_init(void)
+{
+    QTAILQ_INIT(&plugin.ctxs);
+    qemu_mutex_init(&plugin.lock);
+    plugin.tbs = g_ptr_array_new();
+}
+
+/*
+ * Run the exit callbacks of all installed plugins.  System emulation
+ * reaches this through atexit(); linux-user leaves with _exit() or
+ * exit_group(), which skip atexit handlers, so preexit_cleanup() calls
+ * it directly instead.
+ */
+void qemu_plugin_atexit_cb(void)
+{
+    struct qemu_plugin_ctx *ctx;
+
+    QTAILQ_FOREACH(ctx, &plugin.ctxs, entry) {
+        if (ctx->atexit_cb) {
+            ctx->atexit_cb(ctx->id, ctx->atexit_udata);
+        }
+    }
+}
+
+void plugin_add_ctx(struct qemu_plugin_ctx *ctx)
+{
+#ifndef CONFIG_USER_ONLY
+    if (QTAILQ_EMPTY(&plugin.ctxs)) {
+        atexit(qemu_plugin_atexit_cb);
+    }
+#endif
+    ctx->id = plugin.next_id++;
+    QTAILQ_INSERT_TAIL(&plugin.ctxs, ctx, entry);
+}
+
+void plugin_remove_ctx(struct qemu_plugin_ctx *ctx)
+{
+    if (ctx->tb_trans_cb) {
+        plugin.n_tb_trans--;
+    }
+    QTAILQ_REMOVE(&plugin.ctxs, ctx, entry);
+}
+
+struct qemu_plugin_ctx *plugin_id_to_ctx(qemu_plugin_id_t id)
+{
+    struct qemu_plugin_ctx *ctx;
+
+    QTAILQ_FOREACH(ctx, &plugin.ctxs, entry) {
+        if (ctx->id == id) {
+            return ctx;
+        }
+    }
+    error_report("plugin: invalid plugin id %" PRIu64, id);
+    abort();
+}
+
+void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                           qemu_plugin_vcpu_tb_trans_cb_t cb)
+{
+    struct qemu_plugin_ctx *ctx = plugin_id_to_ctx(id);
+
+    if (!ctx->installing) {
+        warn_report("plugin: translation callbacks can only be registered "
+                    "from qemu_plugin_install");
+        return;
+    }
+    if (!ctx->tb_trans_cb && cb) {
+        plugin.n_tb_trans++;
+    } else if (ctx->tb_trans_cb && !cb) {
+        plugin.n_tb_trans--;
+    }
+    ctx->tb_trans_cb = cb;
+}
+
+void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                    qemu_plugin_udata_cb_t cb, void *udata)
+{
+    struct qemu_plugin_ctx *ctx = plugin_id_to_ctx(id);
+
+    if (!ctx->installing) {
+        warn_report("plugin: exit callbacks can only be registered "
+                    "from qemu_plugin_install");
+        return;
+    }
+    ctx->atexit_cb = cb;
+    ctx->atexit_udata = udata;
+}
+
+/*
+ * Translation time
+ */
+
+bool qemu_plugin_tb_trans_enabled(void)
+{
+    return plugin.n_tb_trans > 0;
+}
+
+struct qemu_plugin_tb *qemu_plugin_tb_new(uint64_t vaddr)
+{
+    struct qemu_plugin_tb *tb = g_new0(struct qemu_plugin_tb, 1);
+
+    tb->vaddr = vaddr;
+    tb->insns = g_ptr_array_new();
+
+    qemu_mutex_lock(&plugin.lock);
+    g_ptr_array_add(plugin.tbs, tb);
+    qemu_mutex_unlock(&plugin.lock);
+    return tb;
+}
+
+struct qemu_plugin_insn *qemu_plugin_insn_new(struct qemu_plugin_tb *tb,
+                                              uint64_t vaddr)
+{
+    struct qemu_plugin_insn *insn = g_new0(struct qemu_plugin_insn, 1);
+
+    insn->vaddr = vaddr;
+    insn->data = g_byte_array_new();
+    insn->mem_ops = g_ptr_array_new();
+    g_ptr_array_add(tb->insns, insn);
+    return insn;
+}
+
+static void plugin_insn_free(gpointer data)
+{
+    struct qemu_plugin_insn *insn = data;
+
+    g_byte_array_unref(insn->data);
+    if (insn->exec_cbs) {
+        g_array_free(insn->exec_cbs, true);
+    }
+    if (insn->mem_cbs) {
+        g_array_free(insn->mem_cbs, true);
+    }
+    g_ptr_array_free(insn->mem_ops, true);
+    g_free(insn);
+}
+
+static void plugin_tb_free(gpointer data)
+{
+    struct qemu_plugin_tb *tb = data;
+
+    g_ptr_array_foreach(tb->insns, (GFunc)plugin_insn_free, NULL);
+    g_ptr_array_free(tb->insns, true);
+    if (tb->exec_cbs) {
+        g_array_free(tb->exec_cbs, true);
+    }
+    g_free(tb);
+}
+
+void qemu_plugin_tb_trans_cb(struct qemu_plugin_tb *tb)
+{
+    struct qemu_plugin_ctx *ctx;
+
+    QTAILQ_FOREACH(ctx, &plugin.ctxs, entry) {
+        if (ctx->tb_trans_cb) {
+            ctx->tb_trans_cb(ctx->id, tb);
+        }
+    }
+}
+
+/*
+ * Called from tb_flush with every vCPU stopped: no generated code that
+ * refers to these descriptors can run anymore.
+ */
+void qemu_plugin_flush_tbs(void)
+{
+    qemu_mutex_lock(&plugin.lock);
+    g_ptr_array_foreach(plugin.tbs, (GFunc)plugin_tb_free, NULL);
+    g_ptr_array_set_size(plugin.tbs, 0);
+    qemu_mutex_unlock(&plugin.lock);
+}
+
+static struct qemu_plugin_dyn_cb *plugin_get_dyn_cb(GArray **arr)
+{
+    GArray *cbs = *arr;
+
+    if (!cbs) {
+        cbs = g_array_sized_new(false, false,
+                                sizeof(struct qemu_plugin_dyn_cb), 1);
+        *arr = cbs;
+    }
+
+    g_array_set_size(cbs, cbs->len + 1);
+    return &g_array_index(cbs, struct qemu_plugin_dyn_cb, cbs->len - 1);
+}
+
+void plugin_register_dyn_cb__udata(GArray **arr,
+                                   qemu_plugin_vcpu_udata_cb_t cb,
+                                   enum qemu_plugin_cb_flags flags,
+                                   void *udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+
+    dyn_cb->userp = udata;
+    dyn_cb->type = PLUGIN_CB_REGULAR;
+    dyn_cb->f.udata = cb;
+}
+
+void plugin_register_inline_op(GArray **arr,
+                               enum qemu_plugin_mem_rw rw,
+                               enum qemu_plugin_op op, void *ptr,
+                               uint64_t imm)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+
+    dyn_cb->userp = ptr;
+    dyn_cb->type = PLUGIN_CB_INLINE;
+    dyn_cb->rw = rw;
+    dyn_cb->f.inline_insn.op = op;
+    dyn_cb->f.inline_insn.imm = imm;
+}
+
+void plugin_register_vcpu_mem_cb(GArray **arr,
+                                 qemu_plugin_vcpu_mem_cb_t cb,
+                                 enum qemu_plugin_cb_flags flags,
+                                 enum qemu_plugin_mem_rw rw,
+                                 void *udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+
+    dyn_cb->userp = udata;
+    dyn_cb->type = PLUGIN_CB_REGULAR;
+    dyn_cb->rw = rw;
+    dyn_cb->f.mem = cb;
+}
+
+/*
+ * Execution time
+ */
+
+static void plugin_run_inline_op(struct qemu_plugin_dyn_cb *cb)
+{
+    switch (cb->f.inline_insn.op) {
+    case QEMU_PLUGIN_INLINE_ADD_U64:
+        *(uint64_t *)cb->userp += cb->f.inline_insn.imm;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+void qemu_plugin_run_udata_cbs(unsigned int vcpu_index, GArray *cbs)
+{
+    size_t i;
+
+    for (i = 0; i < cbs->len; i++) {
+        struct qemu_plugin_dyn_cb *cb =
+            &g_array_index(cbs, struct qemu_plugin_dyn_cb, i);
+
+        if (cb->type == PLUGIN_CB_INLINE) {
+            plugin_run_inline_op(cb);
+        } else {
+            cb->f.udata(vcpu_index, cb->userp);
+        }
+    }
+}
+
+void qemu_plugin_run_mem_cbs(unsigned int vcpu_index, GArray *cbs,
+                             uint64_t vaddr, qemu_plugin_meminfo_t info)
+{
+    enum qemu_plugin_mem_rw rw;
+    size_t i;
+
+    rw = (info & TRACE_MEM_ST) ? QEMU_PLUGIN_MEM_W : QEMU_PLUGIN_MEM_R;
+    for (i = 0; i < cbs->len; i++) {
+        struct qemu_plugin_dyn_cb *cb =
+            &g_array_index(cbs, struct qemu_plugin_dyn_cb, i);
+
+        if (!(rw & cb->rw)) {
+            continue;
+        }
+        if (cb->type == PLUGIN_CB_INLINE) {
+            plugin_run_inline_op(cb);
+        } else {
+            cb->f.mem(vcpu_index, info, vaddr, cb->userp);
+        }
+    }
+}
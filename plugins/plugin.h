@@ -0,0 +1,50 @@
+/*
+ * Plugin Shared Internal Functions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef PLUGIN_INTERNAL_H
+#define PLUGIN_INTERNAL_H
+
+#include <gmodule.h>
+
+/* Minimum API version a plugin may be built against */
+#define QEMU_PLUGIN_MIN_VERSION 0
+
+struct qemu_plugin_ctx {
+    GModule *handle;
+    qemu_plugin_id_t id;
+    QTAILQ_ENTRY(qemu_plugin_ctx) entry;
+    qemu_plugin_vcpu_tb_trans_cb_t tb_trans_cb;
+    qemu_plugin_udata_cb_t atexit_cb;
+    void *atexit_udata;
+    /*
+     * Set while qemu_plugin_install runs; the global callbacks can
+     * only be registered at that point.
+     */
+    bool installing;
+};
+
+void plugin_add_ctx(struct qemu_plugin_ctx *ctx);
+void plugin_remove_ctx(struct qemu_plugin_ctx *ctx);
+struct qemu_plugin_ctx *plugin_id_to_ctx(qemu_plugin_id_t id);
+
+void plugin_register_dyn_cb__udata(GArray **arr,
+                                   qemu_plugin_vcpu_udata_cb_t cb,
+                                   enum qemu_plugin_cb_flags flags,
+                                   void *udata);
+
+void plugin_register_inline_op(GArray **arr,
+                               enum qemu_plugin_mem_rw rw,
+                               enum qemu_plugin_op op, void *ptr,
+                               uint64_t imm);
+
+void plugin_register_vcpu_mem_cb(GArray **arr,
+                                 qemu_plugin_vcpu_mem_cb_t cb,
+                                 enum qemu_plugin_cb_flags flags,
+                                 enum qemu_plugin_mem_rw rw,
+                                 void *udata);
+
+#endif /* PLUGIN_INTERNAL_H */
@@ -1851,6 +1851,82 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+typedef struct ConvertWriteCo {
+    ImgConvertState *s;
+    Coroutine *waiter;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    enum ImgConvertBlockStatus status;
+    bool done;
+    int ret;
+} ConvertWriteCo;
+
+static void coroutine_fn convert_co_write_entry(void *opaque)
+{
+    ConvertWriteCo *w = opaque;
+
+    w->ret = convert_co_write(w->s, w->sector_num, w->nb_sectors, w->buf,
+                              w->status);
+    w->done = true;
+    if (w->waiter) {
+        aio_co_wake(w->waiter);
+    }
+}
+
+/* Let the coroutine that waits to write at @sector_num go ahead */
+static void coroutine_fn convert_co_wake_next(ImgConvertState *s,
+                                              int64_t sector_num)
+{
+    int i;
+
+    s->wr_offs = sector_num;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            /*
+             * A -> B -> A cannot occur because A has
+             * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+             * B will never enter A during this time window.
+             */
+            qemu_coroutine_enter(s->co[i]);
+            break;
+        }
+    }
+}
+
+/*
+ * Write a buffer in order, but only wait for the previous writes to be
+ * submitted instead of completed.  Compressed writes spend most of their
+ * time compressing in a worker thread and the block driver allocates
+ * their clusters in submission order, so this lets up to -m clusters be
+ * compressed in parallel without changing the layout of the target.
+ */
+static int coroutine_fn
+convert_co_write_pipelined(ImgConvertState *s, int64_t sector_num,
+                           int nb_sectors, uint8_t *buf,
+                           enum ImgConvertBlockStatus status)
+{
+    ConvertWriteCo w = {
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .buf        = buf,
+        .status     = status,
+    };
+    Coroutine *co = qemu_coroutine_create(convert_co_write_entry, &w);
+
+    /* Returns once the request has been submitted */
+    qemu_coroutine_enter(co);
+    convert_co_wake_next(s, sector_num + nb_sectors);
+
+    /* @buf must stay valid until the write has completed */
+    while (!w.done) {
+        w.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return w.ret;
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1873,7 +1949,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
-        bool copy_range;
+        bool copy_range, pipelined = false;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1903,8 +1979,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
+        copy_range = s->copy_range && status == BLK_DATA;
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -1930,9 +2006,19 @@ retry:
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
-                    s->copy_range = false;
+                    /*
+                     * Copy this extent through the buffer instead; only
+                     * give up on offloading if it is not supported at all
+                     */
+                    if (ret == -ENOTSUP) {
+                        s->copy_range = false;
+                    }
+                    copy_range = false;
                     goto retry;
                 }
+            } else if (s->wr_in_order && s->compressed) {
+                pipelined = true;
+                ret = convert_co_write_pipelined(s, sector_num, n, buf, status);
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
@@ -1943,21 +2029,10 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !pipelined) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_next(s, sector_num + n);
         }
     }
 
@@ -161,6 +161,12 @@ static TCGContext **tcg_ctxs;
 static unsigned int n_tcg_ctxs;
 TCGv_env cpu_env = 0;
 
+/*
+ * Keep globals and local temps in registers across conditional
+ * branches, i.e. allocate registers over extended basic blocks.
+ */
+bool tcg_ebb_regalloc;
+
 struct tcg_region_tree {
     QemuMutex lock;
     GTree *tree;
@@ -845,6 +851,20 @@ size_t tcg_tb_phys_invalidate_count(void)
     return total;
 }
 
+void tcg_tb_l2_cache_stats(size_t *hits, size_t *misses)
+{
+    unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
+    unsigned int i;
+
+    *hits = *misses = 0;
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGContext *s = atomic_read(&tcg_ctxs[i]);
+
+        *hits += atomic_read(&s->tb_l2_cache_hits);
+        *misses += atomic_read(&s->tb_l2_cache_misses);
+    }
+}
+
 /* pool based memory allocation */
 void *tcg_malloc_internal(TCGContext *s, int size)
 {
@@ -1116,6 +1136,7 @@ void tcg_func_start(TCGContext *s)
     s->nb_ops = 0;
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->tb_host_ptr = false;
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -2468,6 +2489,44 @@ static void la_bb_end(TCGContext *s, int ng, int nt)
     }
 }
 
+/* liveness analysis: conditional branch, with tcg_ebb_regalloc: all
+   temps are dead, globals and local temps should be synced but stay
+   live for the fall-through path.  Indirect globals are still killed,
+   since liveness_pass_2 reloads them per basic block. */
+static void la_bb_sync(TCGContext *s, int ng, int nt)
+{
+    int i;
+
+    for (i = 0; i < ng; ++i) {
+        TCGTemp *ts = &s->temps[i];
+        int state = ts->state;
+
+        if (ts->indirect_reg) {
+            ts->state = TS_DEAD | TS_MEM;
+        } else {
+            ts->state = state | TS_MEM;
+            if (state != TS_DEAD) {
+                continue;
+            }
+        }
+        la_reset_pref(ts);
+    }
+    for (i = ng; i < nt; ++i) {
+        TCGTemp *ts = &s->temps[i];
+        int state = ts->state;
+
+        if (ts->temp_local) {
+            ts->state = state | TS_MEM;
+            if (state != TS_DEAD) {
+                continue;
+            }
+        } else {
+            ts->state = TS_DEAD;
+        }
+        la_reset_pref(ts);
+    }
+}
+
 /* liveness analysis: sync globals back to memory.  */
 static void la_global_sync(TCGContext *s, int ng)
 {
@@ -2759,6 +2818,9 @@ static void liveness_pass_1(TCGContext *s)
             /* If end of basic block, update.  */
             if (def->flags & TCG_OPF_BB_EXIT) {
                 la_func_end(s, nb_globals, nb_temps);
+            } else if ((def->flags & TCG_OPF_COND_BRANCH) &&
+                       tcg_ebb_regalloc) {
+                la_bb_sync(s, nb_globals, nb_temps);
             } else if (def->flags & TCG_OPF_BB_END) {
                 la_bb_end(s, nb_globals, nb_temps);
             } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
@@ -3309,6 +3371,30 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch with tcg_ebb_regalloc, we assume all
+   temporaries are dead and all globals and local temps are synced to
+   their canonical location; they can stay in registers for the
+   fall-through path. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    sync_globals(s, allocated_regs);
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        /* The liveness analysis already ensures that temps are dead and
+           that local temps are synced.  Keep tcg_debug_asserts for
+           safety. */
+        if (ts->temp_local) {
+            tcg_debug_assert(ts->val_type != TEMP_VAL_REG
+                             || ts->mem_coherent);
+        } else {
+            tcg_debug_assert(ts->val_type == TEMP_VAL_DEAD);
+        }
+    }
+}
+
 /*
  * Specialized code generation for INDEX_op_movi_*.
  */
@@ -3661,7 +3747,9 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if ((def->flags & TCG_OPF_COND_BRANCH) && tcg_ebb_regalloc) {
+        tcg_reg_alloc_cbranch(s, i_allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, i_allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -593,6 +593,7 @@ struct TCGContext {
 
     TCGRegSet reserved_regs;
     uint32_t tb_cflags; /* cflags of the current TB */
+    bool tb_host_ptr;   /* current TB embeds a host pointer */
     intptr_t current_frame_offset;
     intptr_t frame_start;
     intptr_t frame_end;
@@ -625,6 +626,8 @@ struct TCGContext {
     void *code_gen_highwater;
 
     size_t tb_phys_invalidate_count;
+    size_t tb_l2_cache_hits;
+    size_t tb_l2_cache_misses;
 
     /* Track which vCPU triggers events */
     CPUState *cpu;                      /* *_trans */
@@ -639,6 +642,12 @@ struct TCGContext {
 
     TCGLabel *exitreq_label;
 
+#ifdef CONFIG_PLUGIN
+    /* plugin descriptors of the TB and insn being translated, if any */
+    struct qemu_plugin_tb *plugin_tb;
+    struct qemu_plugin_insn *plugin_insn;
+#endif
+
     TCGTempSet free_temps[TCG_TYPE_COUNT * 2];
     TCGTemp temps[TCG_MAX_TEMPS]; /* globals first, temps after */
 
@@ -655,8 +664,17 @@ struct TCGContext {
 
 extern TCGContext tcg_init_ctx;
 extern __thread TCGContext *tcg_ctx;
+extern bool tcg_ebb_regalloc;
 extern TCGv_env cpu_env;
 
+static inline intptr_t tcg_host_ptr(intptr_t ptr)
+{
+    if (ptr) {
+        tcg_ctx->tb_host_ptr = true;
+    }
+    return ptr;
+}
+
 static inline size_t temp_idx(TCGTemp *ts)
 {
     ptrdiff_t n = ts - tcg_ctx->temps;
@@ -803,6 +821,7 @@ size_t tcg_code_capacity(void);
 void tcg_tb_insert(TranslationBlock *tb);
 void tcg_tb_remove(TranslationBlock *tb);
 size_t tcg_tb_phys_invalidate_count(void);
+void tcg_tb_l2_cache_stats(size_t *hits, size_t *misses);
 TranslationBlock *tcg_tb_lookup(uintptr_t tc_ptr);
 void tcg_tb_foreach(GTraverseFunc func, gpointer user_data);
 size_t tcg_nb_tbs(void);
@@ -970,6 +989,8 @@ enum {
     TCG_OPF_NOT_PRESENT  = 0x20,
     /* Instruction operands are vectors.  */
     TCG_OPF_VECTOR       = 0x40,
+    /* Instruction is a conditional branch; it also has TCG_OPF_BB_END.  */
+    TCG_OPF_COND_BRANCH  = 0x80,
 };
 
 typedef struct TCGOpDef {
@@ -1017,12 +1038,21 @@ TCGv_vec tcg_const_ones_vec(TCGType);
 TCGv_vec tcg_const_zeros_vec_matching(TCGv_vec);
 TCGv_vec tcg_const_ones_vec_matching(TCGv_vec);
 
+/*
+ * Host pointers tie the generated code to the address space of this
+ * process; tcg_host_ptr notes their use so that such TBs are not
+ * saved to the persistent translation cache.
+ */
 #if UINTPTR_MAX == UINT32_MAX
-# define tcg_const_ptr(x)        ((TCGv_ptr)tcg_const_i32((intptr_t)(x)))
-# define tcg_const_local_ptr(x)  ((TCGv_ptr)tcg_const_local_i32((intptr_t)(x)))
+# define tcg_const_ptr(x)        \
+    ((TCGv_ptr)tcg_const_i32(tcg_host_ptr((intptr_t)(x))))
+# define tcg_const_local_ptr(x)  \
+    ((TCGv_ptr)tcg_const_local_i32(tcg_host_ptr((intptr_t)(x))))
 #else
-# define tcg_const_ptr(x)        ((TCGv_ptr)tcg_const_i64((intptr_t)(x)))
-# define tcg_const_local_ptr(x)  ((TCGv_ptr)tcg_const_local_i64((intptr_t)(x)))
+# define tcg_const_ptr(x)        \
+    ((TCGv_ptr)tcg_const_i64(tcg_host_ptr((intptr_t)(x))))
+# define tcg_const_local_ptr(x)  \
+    ((TCGv_ptr)tcg_const_local_i64(tcg_host_ptr((intptr_t)(x))))
 #endif
 
 TCGLabel *gen_new_label(void);
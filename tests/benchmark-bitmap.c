@@ -0,0 +1,101 @@
+/*
+ * Dirty bitmap scanning speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/bitmap.h"
+
+/* One bit per 4 KiB page of a 1 TiB guest */
+#define BENCH_BITS  (TiB / (4 * KiB))
+
+static unsigned long *bench_bitmap(long stride)
+{
+    unsigned long *bmap = bitmap_new(BENCH_BITS);
+    long i;
+
+    for (i = stride - 1; i < BENCH_BITS; i += stride) {
+        set_bit(i, bmap);
+    }
+    return bmap;
+}
+
+typedef unsigned long FindFn(const unsigned long *map, unsigned long size,
+                             unsigned long start);
+
+static void find_speed(const char *name, FindFn *find, long stride,
+                       const unsigned long *bmap)
+{
+    unsigned long bit;
+    long found;
+    double total = 0.0;
+
+    g_test_timer_start();
+    do {
+        found = 0;
+        for (bit = find(bmap, BENCH_BITS, 0); bit < BENCH_BITS;
+             bit = find(bmap, BENCH_BITS, bit + 1)) {
+            found++;
+        }
+        g_assert_cmpint(found, ==, BENCH_BITS / stride);
+        total += BENCH_BITS / 8;
+    } while (g_test_timer_elapsed() < 2.0);
+
+    total /= MiB;
+    g_print("%s: 1 bit in %ld: %.2f MB/sec\n", name, stride,
+            total / g_test_timer_last());
+}
+
+static void test_find_speed(const void *opaque)
+{
+    long stride = (long)opaque;
+    unsigned long *bmap = bench_bitmap(stride);
+
+    find_speed("find_next_bit", find_next_bit, stride, bmap);
+    find_speed("bitmap_find_next_bit", bitmap_find_next_bit, stride, bmap);
+    g_free(bmap);
+}
+
+static void test_merge_speed(const void *opaque)
+{
+    long stride = (long)opaque;
+    unsigned long *src = bench_bitmap(stride);
+    unsigned long *dst = bitmap_new(BENCH_BITS);
+    double total = 0.0;
+    long count;
+
+    /* After the first pass this measures the scan of an empty source */
+    g_test_timer_start();
+    do {
+        count = 0;
+        bitmap_merge_and_clear_atomic(dst, src, BENCH_BITS, &count);
+        total += BENCH_BITS / 8;
+    } while (g_test_timer_elapsed() < 2.0);
+
+    total /= MiB;
+    g_print("bitmap_merge_and_clear_atomic: 1 bit in %ld: %.2f MB/sec\n",
+            stride, total / g_test_timer_last());
+
+    g_free(src);
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    long stride;
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (stride = 64; stride <= 64 * KiB; stride *= 32) {
+        snprintf(name, sizeof(name), "/bitmap/find/speed-%ld", stride);
+        g_test_add_data_func(name, (void *)stride, test_find_speed);
+    }
+    g_test_add_data_func("/bitmap/merge/speed", (void *)64L,
+                         test_merge_speed);
+
+    return g_test_run();
+}
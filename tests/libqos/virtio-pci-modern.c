@@ -0,0 +1,295 @@
+/*
+ * libqos virtio PCI VIRTIO 1.0 support
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/virtio-pci-modern.h"
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#include "hw/pci/pci.h"
+#include "hw/pci/pci_regs.h"
+
+/*
+ * Only INTx interrupts are supported: MSI-X vectors would have to be
+ * programmed through the common configuration structure.
+ */
+
+#define COMMON(dev, field) ((dev)->common_cfg_offset + (field))
+
+static uint8_t config_readb(QVirtioDevice *d, uint64_t addr)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->device_cfg_offset + addr);
+}
+
+static uint16_t config_readw(QVirtioDevice *d, uint64_t addr)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readw(dev->pdev, dev->bar, dev->device_cfg_offset + addr);
+}
+
+static uint32_t config_readl(QVirtioDevice *d, uint64_t addr)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readl(dev->pdev, dev->bar, dev->device_cfg_offset + addr);
+}
+
+static uint64_t config_readq(QVirtioDevice *d, uint64_t addr)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readq(dev->pdev, dev->bar, dev->device_cfg_offset + addr);
+}
+
+static uint64_t get_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_DFSELECT), 0);
+    lo = qpci_io_readl(dev->pdev, dev->bar, COMMON(dev, VIRTIO_PCI_COMMON_DF));
+    qpci_io_writel(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_DFSELECT), 1);
+    hi = qpci_io_readl(dev->pdev, dev->bar, COMMON(dev, VIRTIO_PCI_COMMON_DF));
+
+    return (hi << 32) | lo;
+}
+
+static void set_features(QVirtioDevice *d, uint64_t features)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+
+    /* The device only accepts the virtio 1.0 interface */
+    g_assert(features & (1ull << VIRTIO_F_VERSION_1));
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_GFSELECT), 0);
+    qpci_io_writel(dev->pdev, dev->bar, COMMON(dev, VIRTIO_PCI_COMMON_GF),
+                   features);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_GFSELECT), 1);
+    qpci_io_writel(dev->pdev, dev->bar, COMMON(dev, VIRTIO_PCI_COMMON_GF),
+                   features >> 32);
+}
+
+static uint64_t get_guest_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_GFSELECT), 0);
+    lo = qpci_io_readl(dev->pdev, dev->bar, COMMON(dev, VIRTIO_PCI_COMMON_GF));
+    qpci_io_writel(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_GFSELECT), 1);
+    hi = qpci_io_readl(dev->pdev, dev->bar, COMMON(dev, VIRTIO_PCI_COMMON_GF));
+
+    return (hi << 32) | lo;
+}
+
+static uint8_t get_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->bar,
+                         COMMON(dev, VIRTIO_PCI_COMMON_STATUS));
+}
+
+static void set_status(QVirtioDevice *d, uint8_t status)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writeb(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_STATUS), status);
+}
+
+static bool get_queue_isr_status(QVirtioDevice *d, QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+
+    g_assert(!dev->pdev->msix_enabled);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->isr_cfg_offset) & 1;
+}
+
+static void wait_config_isr_status(QVirtioDevice *d, gint64 timeout_us)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    gint64 start_time = g_get_monotonic_time();
+
+    g_assert(!dev->pdev->msix_enabled);
+    do {
+        g_assert(g_get_monotonic_time() - start_time <= timeout_us);
+        qtest_clock_step(dev->pdev->bus->qts, 100);
+    } while (!(qpci_io_readb(dev->pdev, dev->bar, dev->isr_cfg_offset) & 2));
+}
+
+static void queue_select(QVirtioDevice *d, uint16_t index)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writew(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_Q_SELECT), index);
+}
+
+static uint16_t get_queue_size(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readw(dev->pdev, dev->bar,
+                         COMMON(dev, VIRTIO_PCI_COMMON_Q_SIZE));
+}
+
+static void set_queue_address(QVirtioDevice *d, uint32_t pfn)
+{
+    /* The rings are set up separately by virtqueue_setup() */
+    g_assert_not_reached();
+}
+
+static void write_addr(QVirtioPCIDevice *dev, uint64_t lo_off, uint64_t addr)
+{
+    qpci_io_writel(dev->pdev, dev->bar, COMMON(dev, lo_off), addr);
+    qpci_io_writel(dev->pdev, dev->bar, COMMON(dev, lo_off + 4), addr >> 32);
+}
+
+static QVirtQueue *virtqueue_setup(QVirtioDevice *d, QGuestAllocator *alloc,
+                                   uint16_t index)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    QVirtQueuePCI *vqpci;
+    uint16_t notify_off;
+    uint64_t addr;
+
+    vqpci = g_malloc0(sizeof(*vqpci));
+
+    queue_select(d, index);
+    vqpci->vq.index = index;
+    vqpci->vq.size = get_queue_size(d);
+    vqpci->vq.free_head = 0;
+    vqpci->vq.num_free = vqpci->vq.size;
+    vqpci->vq.align = VIRTIO_PCI_VRING_ALIGN;
+    vqpci->vq.indirect = d->features & (1ull << VIRTIO_RING_F_INDIRECT_DESC);
+    vqpci->vq.event = d->features & (1ull << VIRTIO_RING_F_EVENT_IDX);
+
+    vqpci->msix_entry = -1;
+
+    /* Check different than 0 */
+    g_assert_cmpint(vqpci->vq.size, !=, 0);
+
+    /* Check power of 2 */
+    g_assert_cmpint(vqpci->vq.size & (vqpci->vq.size - 1), ==, 0);
+
+    addr = guest_alloc(alloc, qvring_size(vqpci->vq.size,
+                                          VIRTIO_PCI_VRING_ALIGN));
+    qvring_init(dev->pdev->bus->qts, alloc, &vqpci->vq, addr);
+
+    write_addr(dev, VIRTIO_PCI_COMMON_Q_DESCLO, vqpci->vq.desc);
+    write_addr(dev, VIRTIO_PCI_COMMON_Q_AVAILLO, vqpci->vq.avail);
+    write_addr(dev, VIRTIO_PCI_COMMON_Q_USEDLO, vqpci->vq.used);
+
+    notify_off = qpci_io_readw(dev->pdev, dev->bar,
+                               COMMON(dev, VIRTIO_PCI_COMMON_Q_NOFF));
+    vqpci->notify_offset = dev->notify_cfg_offset +
+                           notify_off * dev->notify_off_multiplier;
+
+    qpci_io_writew(dev->pdev, dev->bar,
+                   COMMON(dev, VIRTIO_PCI_COMMON_Q_ENABLE), 1);
+
+    return &vqpci->vq;
+}
+
+static void virtqueue_cleanup(QVirtQueue *vq, QGuestAllocator *alloc)
+{
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    guest_free(alloc, vq->desc);
+    g_free(vqpci);
+}
+
+static void virtqueue_kick(QVirtioDevice *d, QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    qpci_io_writew(dev->pdev, dev->bar, vqpci->notify_offset, vq->index);
+}
+
+const QVirtioBus qvirtio_pci_virtio_1 = {
+    .config_readb = config_readb,
+    .config_readw = config_readw,
+    .config_readl = config_readl,
+    .config_readq = config_readq,
+    .get_features = get_features,
+    .set_features = set_features,
+    .get_guest_features = get_guest_features,
+    .get_status = get_status,
+    .set_status = set_status,
+    .get_queue_isr_status = get_queue_isr_status,
+    .wait_config_isr_status = wait_config_isr_status,
+    .queue_select = queue_select,
+    .get_queue_size = get_queue_size,
+    .set_queue_address = set_queue_address,
+    .virtqueue_setup = virtqueue_setup,
+    .virtqueue_cleanup = virtqueue_cleanup,
+    .virtqueue_kick = virtqueue_kick,
+};
+
+/* Find the vendor capability of @cfg_type, returns its config offset or 0 */
+static uint8_t find_structure(QVirtioPCIDevice *dev, uint8_t cfg_type,
+                              uint8_t *bar, uint32_t *offset)
+{
+    uint8_t addr = qpci_config_readb(dev->pdev, PCI_CAPABILITY_LIST);
+
+    while (addr) {
+        if (qpci_config_readb(dev->pdev, addr) == PCI_CAP_ID_VNDR &&
+            qpci_config_readb(dev->pdev, addr + VIRTIO_PCI_CAP_CFG_TYPE) ==
+                cfg_type) {
+            *bar = qpci_config_readb(dev->pdev, addr + VIRTIO_PCI_CAP_BAR);
+            *offset = qpci_config_readl(dev->pdev,
+                                        addr + VIRTIO_PCI_CAP_OFFSET);
+            return addr;
+        }
+        addr = qpci_config_readb(dev->pdev, addr + PCI_CAP_LIST_NEXT);
+    }
+    return 0;
+}
+
+bool qvirtio_pci_init_virtio_1(QVirtioPCIDevice *dev)
+{
+    uint16_t device_id = qpci_config_readw(dev->pdev, PCI_DEVICE_ID);
+    uint8_t common_bar, notify_bar, isr_bar, device_bar;
+    uint8_t notify_cap;
+
+    if (device_id < 0x1040) {
+        return false;
+    }
+
+    g_assert(find_structure(dev, VIRTIO_PCI_CAP_COMMON_CFG, &common_bar,
+                            &dev->common_cfg_offset));
+    notify_cap = find_structure(dev, VIRTIO_PCI_CAP_NOTIFY_CFG, &notify_bar,
+                                &dev->notify_cfg_offset);
+    g_assert(notify_cap);
+    g_assert(find_structure(dev, VIRTIO_PCI_CAP_ISR_CFG, &isr_bar,
+                            &dev->isr_cfg_offset));
+    g_assert(find_structure(dev, VIRTIO_PCI_CAP_DEVICE_CFG, &device_bar,
+                            &dev->device_cfg_offset));
+    dev->notify_off_multiplier =
+        qpci_config_readl(dev->pdev, notify_cap + VIRTIO_PCI_NOTIFY_CAP_MULT);
+
+    /* QEMU puts all structures in the same BAR */
+    g_assert_cmpint(notify_bar, ==, common_bar);
+    g_assert_cmpint(isr_bar, ==, common_bar);
+    g_assert_cmpint(device_bar, ==, common_bar);
+    dev->bar_idx = common_bar;
+
+    dev->vdev.device_type = device_id - 0x1040;
+    dev->vdev.bus = &qvirtio_pci_virtio_1;
+    /* virtio 1.0 is always little-endian */
+    dev->vdev.big_endian = false;
+    return true;
+}
@@ -0,0 +1,22 @@
+/*
+ * libqos virtio PCI VIRTIO 1.0 definitions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_PCI_MODERN_H
+#define LIBQOS_VIRTIO_PCI_MODERN_H
+
+#include "libqos/virtio-pci.h"
+
+extern const QVirtioBus qvirtio_pci_virtio_1;
+
+/*
+ * Use the virtio 1.0 interface if @dev is a modern-only device, i.e. one
+ * created with disable-legacy=on.  Transitional devices keep using the
+ * legacy interface.
+ */
+bool qvirtio_pci_init_virtio_1(QVirtioPCIDevice *dev);
+
+#endif
@@ -22,6 +22,15 @@ typedef struct QVirtioPCIDevice {
     uint16_t config_msix_entry;
     uint64_t config_msix_addr;
     uint32_t config_msix_data;
+
+    int bar_idx;
+
+    /* virtio 1.0 structures, all in bar_idx */
+    uint32_t common_cfg_offset;
+    uint32_t notify_cfg_offset;
+    uint32_t notify_off_multiplier;
+    uint32_t isr_cfg_offset;
+    uint32_t device_cfg_offset;
 } QVirtioPCIDevice;
 
 typedef struct QVirtQueuePCI {
@@ -29,6 +38,9 @@ typedef struct QVirtQueuePCI {
     uint16_t msix_entry;
     uint64_t msix_addr;
     uint32_t msix_data;
+
+    /* virtio 1.0 only */
+    uint64_t notify_offset;
 } QVirtQueuePCI;
 
 extern const QVirtioBus qvirtio_pci;
@@ -512,6 +512,81 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#ifndef _WIN32
+typedef struct {
+    EventNotifier e;
+    int64_t poll_ns;
+    uint64_t polls;
+    uint64_t hits;
+} PollHandlerTestData;
+
+static bool poll_always_ready(void *opaque)
+{
+    return true;
+}
+
+static bool poll_never_ready(void *opaque)
+{
+    return false;
+}
+
+static void poll_handler_stats(void *opaque, int fd, int64_t poll_ns,
+                               uint64_t polls, uint64_t hits)
+{
+    PollHandlerTestData *data = opaque;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (event_notifier_get_fd(&data[i].e) == fd) {
+            data[i].poll_ns = poll_ns;
+            data[i].polls = polls;
+            data[i].hits = hits;
+        }
+    }
+}
+
+static void test_poll_handlers(void)
+{
+    PollHandlerTestData data[2] = {
+        { .poll_ns = -1 }, { .poll_ns = -1 },
+    };
+    int i;
+
+    /*
+     * The limit is large enough for a busy host not to make a single
+     * non-blocking aio_poll() exceed it and shrink the ready handler.
+     */
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0, &error_abort);
+
+    event_notifier_init(&data[0].e, false);
+    aio_set_event_notifier(ctx, &data[0].e, false, dummy_notifier_read,
+                           poll_always_ready);
+    event_notifier_init(&data[1].e, false);
+    aio_set_event_notifier(ctx, &data[1].e, false, dummy_notifier_read,
+                           poll_never_ready);
+
+    /* A non-blocking aio_poll() polls each handler exactly once */
+    for (i = 0; i < 10; i++) {
+        g_assert(aio_poll(ctx, false));
+    }
+
+    aio_context_foreach_poll_handler(ctx, poll_handler_stats, data);
+    g_assert_cmpint(data[0].poll_ns, >, 0);
+    g_assert_cmpint(data[0].polls, ==, 10);
+    g_assert_cmpint(data[0].hits, ==, 10);
+    g_assert_cmpint(data[1].poll_ns, ==, 0);
+    g_assert_cmpint(data[1].polls, ==, 10);
+    g_assert_cmpint(data[1].hits, ==, 0);
+    g_assert_cmpint(ctx->poll_ns, >=, data[0].poll_ns);
+
+    set_event_notifier(ctx, &data[0].e, NULL);
+    event_notifier_cleanup(&data[0].e);
+    set_event_notifier(ctx, &data[1].e, NULL);
+    event_notifier_cleanup(&data[1].e);
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+}
+#endif
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -900,6 +975,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll/handlers",           test_poll_handlers);
+#endif
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
 
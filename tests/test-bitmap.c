@@ -124,6 +124,81 @@ static void check_bitmap_set(void)
     bitmap_set_case(bitmap_set_atomic);
 }
 
+static void bitmap_find_next_bit_case(void)
+{
+    unsigned long *bmap;
+    long size, start, bit;
+
+    bmap = bitmap_new(BMAP_SIZE);
+
+    g_assert_cmpint(bitmap_find_next_bit(bmap, BMAP_SIZE, 0), ==, BMAP_SIZE);
+
+    /* A single bit, searched for from every position and bitmap size */
+    for (bit = 0; bit < BMAP_SIZE; bit += 7) {
+        set_bit(bit, bmap);
+        for (start = 0; start < BMAP_SIZE; start += 13) {
+            for (size = 1; size <= BMAP_SIZE; size += 61) {
+                g_assert_cmpint(bitmap_find_next_bit(bmap, size, start), ==,
+                                find_next_bit(bmap, size, start));
+            }
+        }
+        clear_bit(bit, bmap);
+    }
+
+    /* Every bit set */
+    bitmap_fill(bmap, BMAP_SIZE);
+    for (start = 0; start < BMAP_SIZE; start++) {
+        g_assert_cmpint(bitmap_find_next_bit(bmap, BMAP_SIZE, start), ==,
+                        start);
+    }
+
+    g_free(bmap);
+}
+
+static void bitmap_merge_case(void)
+{
+    unsigned long *src, *dst, *expected;
+    long i, src_count = 0, new_count;
+
+    src = bitmap_new(BMAP_SIZE);
+    dst = bitmap_new(BMAP_SIZE);
+    expected = bitmap_new(BMAP_SIZE);
+
+    for (i = 0; i < BMAP_SIZE; i += 3) {
+        set_bit(i, src);
+    }
+    for (i = 0; i < BMAP_SIZE / 2; i += 5) {
+        set_bit(i, dst);
+    }
+    bitmap_or(expected, src, dst, BMAP_SIZE);
+    new_count = bitmap_count_one(expected, BMAP_SIZE) -
+                bitmap_count_one(dst, BMAP_SIZE);
+
+    g_assert_cmpint(bitmap_merge_and_clear_atomic(dst, src, BMAP_SIZE,
+                                                  &src_count),
+                    ==, new_count);
+    g_assert_cmpint(src_count, ==, DIV_ROUND_UP(BMAP_SIZE, 3));
+    g_assert(bitmap_empty(src, BMAP_SIZE));
+    g_assert(bitmap_equal(dst, expected, BMAP_SIZE));
+
+    /* Nothing left to merge */
+    g_assert_cmpint(bitmap_merge_and_clear_atomic(dst, src, BMAP_SIZE,
+                                                  &src_count), ==, 0);
+    g_assert_cmpint(src_count, ==, DIV_ROUND_UP(BMAP_SIZE, 3));
+
+    g_free(src);
+    g_free(dst);
+    g_free(expected);
+}
+
+static void check_bitmap_scan(void)
+{
+    do {
+        bitmap_find_next_bit_case();
+        bitmap_merge_case();
+    } while (test_bitmap_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -132,6 +207,8 @@ int main(int argc, char **argv)
                     check_bitmap_copy_with_offset);
     g_test_add_func("/bitmap/bitmap_set",
                     check_bitmap_set);
+    g_test_add_func("/bitmap/bitmap_scan",
+                    check_bitmap_scan);
 
     g_test_run();
 
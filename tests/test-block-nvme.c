@@ -0,0 +1,547 @@
+/*
+ * Tests for the userspace NVMe driver
+ *
+ * The VFIO helpers are replaced by stubs that hand the driver the registers
+ * of a fake controller.  A thread plays the controller: it processes the
+ * submission queues, completes the commands and raises the interrupt
+ * notifier, and it can be told to reject some of the admin commands.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/nvme.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qemu/vfio-helpers.h"
+
+#define FAKE_BAR_SIZE 8192
+#define FAKE_PAGE_SIZE 4096
+#define FAKE_DISK_SIZE (1 * MiB)
+#define FAKE_MAX_QUEUES 8
+#define FAKE_IO_REQS 8
+
+typedef struct FakeQueue {
+    bool sq_valid;
+    uint8_t *sq;
+    int sq_size;
+    int sq_head;
+    int cqid;
+
+    bool cq_valid;
+    uint8_t *cq;
+    int cq_size;
+    int cq_tail;
+    int phase;
+} FakeQueue;
+
+typedef struct FakeNVMe {
+    NvmeBar *regs;
+    uint32_t *doorbells;
+    EventNotifier *irq;
+    QemuThread thread;
+    bool stop;
+    /* Do not process io queues while set */
+    bool hold_io;
+    FakeQueue queues[FAKE_MAX_QUEUES + 1];
+    uint8_t *disk;
+
+    /* Highest io queue ids that can be created */
+    int max_cqs;
+    int max_sqs;
+    bool fail_set_features;
+
+    /* cdw11 of Set Features (Number of Queues), -1 if not received */
+    int64_t set_queues_cdw11;
+    int nr_deleted_cqs;
+    int deleted_cq;
+    unsigned io_cmds[FAKE_MAX_QUEUES + 1];
+} FakeNVMe;
+
+static FakeNVMe fake;
+
+static void fake_nvme_complete(FakeNVMe *f, int qid, NvmeCmd *cmd,
+                               uint16_t status)
+{
+    FakeQueue *cq = &f->queues[f->queues[qid].cqid];
+    NvmeCqe *cqe = (NvmeCqe *)(cq->cq + cq->cq_tail * sizeof(NvmeCqe));
+
+    g_assert(cq->cq_valid);
+    cqe->result = 0;
+    cqe->sq_head = cpu_to_le16(f->queues[qid].sq_head);
+    cqe->sq_id = cpu_to_le16(qid);
+    cqe->cid = cmd->cid;
+    /* The phase bit makes the entry valid, so it must be written last */
+    smp_wmb();
+    atomic_set(&cqe->status, cpu_to_le16(status << 1 | cq->phase));
+    if (++cq->cq_tail == cq->cq_size) {
+        cq->cq_tail = 0;
+        cq->phase = !cq->phase;
+    }
+    event_notifier_set(f->irq);
+}
+
+static uint16_t fake_nvme_admin_cmd(FakeNVMe *f, NvmeCmd *cmd)
+{
+    uint32_t cdw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t cdw11 = le32_to_cpu(cmd->cdw11);
+    void *prp1 = (void *)(uintptr_t)le64_to_cpu(cmd->prp1);
+    int qid = cdw10 & 0xFFFF;
+    int cqid = cdw11 >> 16;
+    FakeQueue *q = qid <= FAKE_MAX_QUEUES ? &f->queues[qid] : NULL;
+
+    switch (cmd->opcode) {
+    case NVME_ADM_CMD_IDENTIFY:
+        if (cdw10 == 1) {
+            NvmeIdCtrl *id = prp1;
+
+            memset(id, 0, sizeof(*id));
+            id->nn = cpu_to_le32(1);
+        } else {
+            NvmeIdNs *id = prp1;
+
+            memset(id, 0, sizeof(*id));
+            id->nsze = cpu_to_le64(FAKE_DISK_SIZE / BDRV_SECTOR_SIZE);
+            id->lbaf[0].ds = BDRV_SECTOR_BITS;
+        }
+        return NVME_SUCCESS;
+    case NVME_ADM_CMD_SET_FEATURES:
+        if ((cdw10 & 0xFF) == NVME_NUMBER_OF_QUEUES) {
+            f->set_queues_cdw11 = cdw11;
+        }
+        return f->fail_set_features ? NVME_INVALID_FIELD : NVME_SUCCESS;
+    case NVME_ADM_CMD_CREATE_CQ:
+        if (!qid || qid > f->max_cqs || q->cq_valid) {
+            return NVME_INVALID_QID;
+        }
+        q->cq = prp1;
+        q->cq_size = (cdw10 >> 16) + 1;
+        q->cq_tail = 0;
+        q->phase = 1;
+        q->cq_valid = true;
+        return NVME_SUCCESS;
+    case NVME_ADM_CMD_CREATE_SQ:
+        if (!qid || qid > f->max_sqs || q->sq_valid ||
+            cqid > FAKE_MAX_QUEUES || !f->queues[cqid].cq_valid) {
+            return NVME_INVALID_QID;
+        }
+        q->sq = prp1;
+        q->sq_size = (cdw10 >> 16) + 1;
+        q->sq_head = 0;
+        q->cqid = cqid;
+        q->sq_valid = true;
+        return NVME_SUCCESS;
+    case NVME_ADM_CMD_DELETE_CQ:
+        if (!qid || !q || !q->cq_valid || q->sq_valid) {
+            return NVME_INVALID_QID;
+        }
+        q->cq_valid = false;
+        f->deleted_cq = qid;
+        f->nr_deleted_cqs++;
+        return NVME_SUCCESS;
+    default:
+        return NVME_INVALID_OPCODE;
+    }
+}
+
+static void fake_nvme_dma(FakeNVMe *f, NvmeCmd *cmd, uint64_t offset,
+                          size_t len, bool is_write)
+{
+    uint64_t prp = le64_to_cpu(cmd->prp1);
+    uint64_t *prp_list = NULL;
+    size_t done = 0;
+
+    while (true) {
+        size_t n = MIN(len - done,
+                       FAKE_PAGE_SIZE - (prp & (FAKE_PAGE_SIZE - 1)));
+        uint8_t *host = (uint8_t *)(uintptr_t)prp;
+
+        if (is_write) {
+            memcpy(f->disk + offset + done, host, n);
+        } else {
+            memcpy(host, f->disk + offset + done, n);
+        }
+        done += n;
+        if (done == len) {
+            break;
+        }
+
+        if (prp_list) {
+            prp = le64_to_cpu(*prp_list++);
+        } else if (len - done <= FAKE_PAGE_SIZE) {
+            prp = le64_to_cpu(cmd->prp2);
+        } else {
+            prp_list = (uint64_t *)(uintptr_t)le64_to_cpu(cmd->prp2);
+            prp = le64_to_cpu(*prp_list++);
+        }
+    }
+}
+
+static uint16_t fake_nvme_io_cmd(FakeNVMe *f, int qid, NvmeCmd *cmd)
+{
+    uint64_t slba = le32_to_cpu(cmd->cdw10) |
+                    (uint64_t)le32_to_cpu(cmd->cdw11) << 32;
+    uint64_t offset = slba << BDRV_SECTOR_BITS;
+    size_t len = ((le32_to_cpu(cmd->cdw12) & 0xFFFF) + 1) << BDRV_SECTOR_BITS;
+
+    atomic_inc(&f->io_cmds[qid]);
+    switch (cmd->opcode) {
+    case NVME_CMD_FLUSH:
+        return NVME_SUCCESS;
+    case NVME_CMD_READ:
+    case NVME_CMD_WRITE:
+        if (offset + len > FAKE_DISK_SIZE) {
+            return NVME_LBA_RANGE;
+        }
+        fake_nvme_dma(f, cmd, offset, len, cmd->opcode == NVME_CMD_WRITE);
+        return NVME_SUCCESS;
+    default:
+        return NVME_INVALID_OPCODE;
+    }
+}
+
+static void fake_nvme_process_sq(FakeNVMe *f, int qid)
+{
+    FakeQueue *q = &f->queues[qid];
+    uint32_t tail;
+
+    if (!q->sq_valid) {
+        return;
+    }
+    tail = le32_to_cpu(atomic_read(&f->doorbells[qid * 2]));
+    /* Read the entries only after the doorbell */
+    smp_rmb();
+    while (q->sq_head != tail) {
+        NvmeCmd cmd;
+        uint16_t status;
+
+        memcpy(&cmd, q->sq + q->sq_head * sizeof(NvmeCmd), sizeof(cmd));
+        q->sq_head = (q->sq_head + 1) % q->sq_size;
+        if (qid) {
+            status = fake_nvme_io_cmd(f, qid, &cmd);
+        } else {
+            status = fake_nvme_admin_cmd(f, &cmd);
+        }
+        fake_nvme_complete(f, qid, &cmd, status);
+    }
+}
+
+/* Handle CC.EN changes like a controller reset or enable would */
+static void fake_nvme_check_enable(FakeNVMe *f)
+{
+    uint32_t cc = le32_to_cpu(atomic_read(&f->regs->cc));
+    uint32_t csts = le32_to_cpu(atomic_read(&f->regs->csts));
+    FakeQueue *admin = &f->queues[0];
+    uint32_t aqa;
+
+    if ((cc & 1) && !(csts & 1)) {
+        memset(f->queues, 0, sizeof(f->queues));
+        /* Like the driver, take the sizes as the number of entries */
+        aqa = le32_to_cpu(f->regs->aqa);
+        admin->sq = (uint8_t *)(uintptr_t)le64_to_cpu(f->regs->asq);
+        admin->sq_size = aqa & 0xFFF;
+        admin->cq = (uint8_t *)(uintptr_t)le64_to_cpu(f->regs->acq);
+        admin->cq_size = (aqa >> 16) & 0xFFF;
+        admin->phase = 1;
+        admin->sq_valid = admin->cq_valid = true;
+        atomic_set(&f->regs->csts, cpu_to_le32(csts | 1));
+    } else if (!(cc & 1) && (csts & 1)) {
+        memset(f->queues, 0, sizeof(f->queues));
+        atomic_set(&f->regs->csts, cpu_to_le32(csts & ~1));
+    }
+}
+
+static void *fake_nvme_thread(void *opaque)
+{
+    FakeNVMe *f = opaque;
+    int qid;
+
+    while (!atomic_read(&f->stop)) {
+        fake_nvme_check_enable(f);
+        if (le32_to_cpu(atomic_read(&f->regs->csts)) & 1) {
+            fake_nvme_process_sq(f, 0);
+            for (qid = 1; qid <= FAKE_MAX_QUEUES; qid++) {
+                if (!atomic_read(&f->hold_io)) {
+                    fake_nvme_process_sq(f, qid);
+                }
+            }
+        }
+        g_usleep(10);
+    }
+    return NULL;
+}
+
+static void fake_nvme_setup(int max_cqs, int max_sqs, bool fail_set_features)
+{
+    g_assert(max_cqs <= FAKE_MAX_QUEUES && max_sqs <= FAKE_MAX_QUEUES);
+    memset(&fake, 0, sizeof(fake));
+    fake.max_cqs = max_cqs;
+    fake.max_sqs = max_sqs;
+    fake.fail_set_features = fail_set_features;
+    fake.set_queues_cdw11 = -1;
+}
+
+static int fake_nvme_nr_io_queues(void)
+{
+    int qid, n = 0;
+
+    for (qid = 1; qid <= FAKE_MAX_QUEUES; qid++) {
+        n += fake.queues[qid].sq_valid;
+    }
+    return n;
+}
+
+/* VFIO helpers used by block/nvme.c, DMA addresses are host addresses */
+
+struct QEMUVFIOState {
+    FakeNVMe *nvme;
+};
+
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
+{
+    QEMUVFIOState *s = g_new0(QEMUVFIOState, 1);
+
+    g_assert_cmpstr(device, ==, "fake");
+    s->nvme = &fake;
+    return s;
+}
+
+void qemu_vfio_close(QEMUVFIOState *s)
+{
+    g_free(s);
+}
+
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova)
+{
+    *iova = (uintptr_t)host;
+    return 0;
+}
+
+int qemu_vfio_dma_lookup(QEMUVFIOState *s, void *host, size_t size,
+                         uint64_t *iova)
+{
+    *iova = (uintptr_t)host;
+    return 0;
+}
+
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
+{
+    return 0;
+}
+
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
+{
+}
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp)
+{
+    FakeNVMe *f = s->nvme;
+
+    g_assert(index == 0 && offset == 0 && size <= FAKE_BAR_SIZE);
+    f->regs = qemu_memalign(FAKE_PAGE_SIZE, FAKE_BAR_SIZE);
+    memset(f->regs, 0, FAKE_BAR_SIZE);
+    f->doorbells = (uint32_t *)((uint8_t *)f->regs + 0x1000);
+    /* NVM command set, 500 ms timeout, 4k pages, 128 queue entries */
+    f->regs->cap = cpu_to_le64(1ULL << 37 | 1ULL << 24 | 127);
+    f->disk = g_malloc0(FAKE_DISK_SIZE);
+
+    qemu_thread_create(&f->thread, "fake-nvme", fake_nvme_thread, f,
+                       QEMU_THREAD_JOINABLE);
+    return f->regs;
+}
+
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size)
+{
+    FakeNVMe *f = s->nvme;
+
+    atomic_set(&f->stop, true);
+    qemu_thread_join(&f->thread);
+    qemu_vfree(f->regs);
+    g_free(f->disk);
+}
+
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    s->nvme->irq = e;
+    return 0;
+}
+
+static BlockBackend *open_nvme(int num_queues, Error **errp)
+{
+    QDict *options = qdict_new();
+
+    qdict_put_str(options, "driver", "nvme");
+    qdict_put_str(options, "device", "fake");
+    qdict_put_str(options, "namespace", "1");
+    qdict_put_int(options, "num-queues", num_queues);
+    return blk_new_open(NULL, NULL, options, BDRV_O_RDWR, errp);
+}
+
+static void io_cb(void *opaque, int ret)
+{
+    int *pending = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    (*pending)--;
+}
+
+/*
+ * Write FAKE_IO_REQS pages with all requests in flight at the same time,
+ * check that they were spread over the first @nr_queues io queues and
+ * read the data back.
+ */
+static void test_io(BlockBackend *blk, int nr_queues)
+{
+    size_t len = FAKE_IO_REQS * FAKE_PAGE_SIZE;
+    uint8_t *buf = blk_blockalign(blk, len);
+    QEMUIOVector qiov[FAKE_IO_REQS];
+    int pending = FAKE_IO_REQS;
+    int i;
+
+    for (i = 0; i < FAKE_IO_REQS; i++) {
+        memset(buf + i * FAKE_PAGE_SIZE, i + 1, FAKE_PAGE_SIZE);
+    }
+
+    atomic_set(&fake.hold_io, true);
+    for (i = 0; i < FAKE_IO_REQS; i++) {
+        qemu_iovec_init_buf(&qiov[i], buf + i * FAKE_PAGE_SIZE,
+                            FAKE_PAGE_SIZE);
+        blk_aio_pwritev(blk, i * FAKE_PAGE_SIZE, &qiov[i], 0, io_cb,
+                        &pending);
+    }
+    atomic_set(&fake.hold_io, false);
+    while (pending) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+
+    for (i = 1; i <= FAKE_MAX_QUEUES; i++) {
+        if (i <= nr_queues) {
+            g_assert_cmpuint(atomic_read(&fake.io_cmds[i]), >, 0);
+        } else {
+            g_assert_cmpuint(atomic_read(&fake.io_cmds[i]), ==, 0);
+        }
+    }
+    g_assert(!memcmp(fake.disk, buf, len));
+
+    memset(buf, 0, len);
+    g_assert_cmpint(blk_pread(blk, 0, buf, len), >=, 0);
+    for (i = 0; i < FAKE_IO_REQS; i++) {
+        g_assert_cmpint(buf[i * FAKE_PAGE_SIZE], ==, i + 1);
+        g_assert_cmpint(buf[(i + 1) * FAKE_PAGE_SIZE - 1], ==, i + 1);
+    }
+    qemu_vfree(buf);
+}
+
+static void test_num_queues(void)
+{
+    BlockBackend *blk;
+
+    fake_nvme_setup(4, 4, false);
+    blk = open_nvme(4, &error_abort);
+
+    /* Zero-based counts of submission and completion queues */
+    g_assert_cmpint(fake.set_queues_cdw11, ==, 3 << 16 | 3);
+    g_assert_cmpint(fake_nvme_nr_io_queues(), ==, 4);
+    g_assert_cmpint(fake.nr_deleted_cqs, ==, 0);
+    test_io(blk, 4);
+
+    blk_unref(blk);
+}
+
+/* The queues can still be created if Set Features fails */
+static void test_set_features_error(void)
+{
+    BlockBackend *blk;
+
+    fake_nvme_setup(2, 2, true);
+    blk = open_nvme(2, &error_abort);
+
+    g_assert_cmpint(fake.set_queues_cdw11, ==, 1 << 16 | 1);
+    g_assert_cmpint(fake_nvme_nr_io_queues(), ==, 2);
+    test_io(blk, 2);
+
+    blk_unref(blk);
+}
+
+/* The driver keeps the queues it got before a completion queue failed */
+static void test_create_cq_error(void)
+{
+    BlockBackend *blk;
+
+    fake_nvme_setup(2, 4, false);
+    blk = open_nvme(4, &error_abort);
+
+    g_assert_cmpint(fake_nvme_nr_io_queues(), ==, 2);
+    g_assert_cmpint(fake.nr_deleted_cqs, ==, 0);
+    test_io(blk, 2);
+
+    blk_unref(blk);
+}
+
+/*
+ * If a submission queue cannot be created, the completion queue created
+ * for it must be deleted again
+ */
+static void test_create_sq_error(void)
+{
+    BlockBackend *blk;
+
+    fake_nvme_setup(4, 2, false);
+    blk = open_nvme(4, &error_abort);
+
+    g_assert_cmpint(fake_nvme_nr_io_queues(), ==, 2);
+    g_assert_cmpint(fake.nr_deleted_cqs, ==, 1);
+    g_assert_cmpint(fake.deleted_cq, ==, 3);
+    g_assert(!fake.queues[3].cq_valid);
+    test_io(blk, 2);
+
+    blk_unref(blk);
+}
+
+/* Opening fails if not even one io queue can be created */
+static void test_create_first_sq_error(void)
+{
+    BlockBackend *blk;
+    Error *local_err = NULL;
+
+    fake_nvme_setup(1, 0, false);
+    blk = open_nvme(1, &local_err);
+
+    g_assert(!blk);
+    g_assert_cmpstr(error_get_pretty(local_err), ==,
+                    "Failed to create io queue [1]");
+    error_free(local_err);
+    g_assert_cmpint(fake.nr_deleted_cqs, ==, 1);
+    g_assert_cmpint(fake.deleted_cq, ==, 1);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/nvme/num-queues", test_num_queues);
+    g_test_add_func("/nvme/set-features-error", test_set_features_error);
+    g_test_add_func("/nvme/create-cq-error", test_create_cq_error);
+    g_test_add_func("/nvme/create-sq-error", test_create_sq_error);
+    g_test_add_func("/nvme/create-first-sq-error",
+                    test_create_first_sq_error);
+
+    return g_test_run();
+}
@@ -551,6 +551,73 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst, *srv;
+    uint64_t queued = 0, sent = 0;
+    char *bufsend, *bufrecv;
+    struct iovec iosend[1];
+    size_t buflen = 4096;
+    int i;
+
+    listen_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    listen_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    connect_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &srv, &src, &dst);
+
+    if (qio_channel_socket_set_zero_copy(QIO_CHANNEL_SOCKET(src), NULL) < 0) {
+        g_test_skip("Zero copy writes not supported");
+        goto cleanup;
+    }
+    g_assert(qio_channel_has_feature(src,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY));
+
+    bufsend = g_malloc(buflen);
+    bufrecv = g_malloc0(buflen);
+    memset(bufsend, 0x5a, buflen);
+    iosend[0].iov_base = bufsend;
+    iosend[0].iov_len = buflen;
+
+    g_assert_cmpint(qio_channel_writev_zero_copy_all(src, iosend, 1,
+                                                     &error_abort), ==, 0);
+    g_assert_cmpint(qio_channel_read_all(dst, bufrecv, buflen,
+                                         &error_abort), ==, 0);
+    g_assert(memcmp(bufsend, bufrecv, buflen) == 0);
+
+    /* The completion is queued once the data has been acknowledged */
+    for (i = 0; i < 1000; i++) {
+        g_assert_cmpint(qio_channel_zero_copy_status(src, &queued, &sent,
+                                                     &error_abort), >=, 0);
+        if (sent == queued) {
+            break;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmpint(queued, >=, 1);
+    g_assert_cmpint(sent, ==, queued);
+
+    g_free(bufsend);
+    g_free(bufrecv);
+ cleanup:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    object_unref(OBJECT(srv));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -577,6 +644,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
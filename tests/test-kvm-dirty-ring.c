@@ -0,0 +1,222 @@
+/*
+ * Test harvesting of the KVM dirty ring
+ *
+ * The kernel side of the ring is emulated here: entries are published
+ * and recycled the way KVM does it for KVM_RESET_DIRTY_RINGS.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "sysemu/kvm_dirty_ring.h"
+
+#define RING_SIZE 64
+
+typedef struct FakeRing {
+    struct kvm_dirty_gfn gfns[RING_SIZE];
+    /* Next entry the kernel fills */
+    uint32_t dirty_index;
+    /* Next entry KVM_RESET_DIRTY_RINGS recycles */
+    uint32_t reset_index;
+    /* Userspace side */
+    uint32_t fetch_index;
+} FakeRing;
+
+typedef struct Harvest {
+    uint64_t next;
+    uint64_t count;
+} Harvest;
+
+static bool fake_ring_push(FakeRing *r, uint32_t slot, uint64_t offset)
+{
+    struct kvm_dirty_gfn *gfn;
+
+    if (r->dirty_index - atomic_load_acquire(&r->reset_index) == RING_SIZE) {
+        /* KVM would exit with KVM_EXIT_DIRTY_RING_FULL */
+        return false;
+    }
+    gfn = &r->gfns[r->dirty_index & (RING_SIZE - 1)];
+    g_assert_cmpint(atomic_read(&gfn->flags), ==, 0);
+    gfn->slot = slot;
+    gfn->offset = offset;
+    atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_DIRTY);
+    r->dirty_index++;
+    return true;
+}
+
+/* KVM_RESET_DIRTY_RINGS */
+static uint32_t fake_ring_reset(FakeRing *r)
+{
+    uint32_t count = 0;
+
+    while (true) {
+        struct kvm_dirty_gfn *gfn = &r->gfns[r->reset_index & (RING_SIZE - 1)];
+
+        if (!(atomic_load_acquire(&gfn->flags) & KVM_DIRTY_GFN_F_RESET)) {
+            break;
+        }
+        atomic_set(&gfn->flags, 0);
+        atomic_store_release(&r->reset_index, r->reset_index + 1);
+        count++;
+    }
+    return count;
+}
+
+/* Pages are pushed with slot == offset / 1000 and consecutive offsets */
+static void check_page(void *opaque, uint32_t slot, uint64_t offset)
+{
+    Harvest *h = opaque;
+
+    g_assert_cmpuint(offset, ==, h->next);
+    g_assert_cmpuint(slot, ==, offset / 1000);
+    h->next++;
+    h->count++;
+}
+
+static uint32_t harvest(FakeRing *r, Harvest *h)
+{
+    return kvm_dirty_ring_collect(r->gfns, RING_SIZE, &r->fetch_index,
+                                  check_page, h);
+}
+
+static void push_pages(FakeRing *r, uint64_t *next, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++, (*next)++) {
+        g_assert(fake_ring_push(r, *next / 1000, *next));
+    }
+}
+
+static void test_empty(void)
+{
+    FakeRing r = { };
+    Harvest h = { };
+
+    g_assert_cmpuint(harvest(&r, &h), ==, 0);
+    g_assert_cmpuint(r.fetch_index, ==, 0);
+    g_assert_cmpuint(fake_ring_reset(&r), ==, 0);
+}
+
+static void test_collect(void)
+{
+    FakeRing r = { };
+    Harvest h = { };
+    uint64_t next = 0;
+    int i;
+
+    push_pages(&r, &next, 10);
+    g_assert_cmpuint(harvest(&r, &h), ==, 10);
+    g_assert_cmpuint(r.fetch_index, ==, 10);
+
+    /* Everything harvested is flagged for reset, nothing else */
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert_cmpint(r.gfns[i].flags, ==,
+                        i < 10 ? KVM_DIRTY_GFN_F_RESET : 0);
+    }
+
+    /* Nothing new: harvesting again is a no-op */
+    g_assert_cmpuint(harvest(&r, &h), ==, 0);
+    g_assert_cmpuint(fake_ring_reset(&r), ==, 10);
+    g_assert_cmpuint(r.reset_index, ==, 10);
+}
+
+static void test_full(void)
+{
+    FakeRing r = { };
+    Harvest h = { };
+    uint64_t next = 0;
+
+    push_pages(&r, &next, RING_SIZE);
+    g_assert_false(fake_ring_push(&r, 0, 0));
+
+    /* Harvesting alone does not make room, the reset does */
+    g_assert_cmpuint(harvest(&r, &h), ==, RING_SIZE);
+    g_assert_false(fake_ring_push(&r, 0, 0));
+    g_assert_cmpuint(fake_ring_reset(&r), ==, RING_SIZE);
+
+    push_pages(&r, &next, 1);
+    g_assert_cmpuint(harvest(&r, &h), ==, 1);
+    g_assert_cmpuint(h.count, ==, RING_SIZE + 1);
+}
+
+static void test_wrap(void)
+{
+    FakeRing r = { };
+    Harvest h = { };
+    uint64_t next = 0;
+    int i;
+
+    /* Odd batch sizes so that the indexes wrap at every position */
+    for (i = 0; i < 1000; i++) {
+        int n = (i * 7) % RING_SIZE + 1;
+
+        push_pages(&r, &next, n);
+        g_assert_cmpuint(harvest(&r, &h), ==, n);
+        g_assert_cmpuint(fake_ring_reset(&r), ==, n);
+    }
+    g_assert_cmpuint(h.count, ==, next);
+    g_assert_cmpuint(r.fetch_index, ==, r.dirty_index);
+}
+
+static void test_wrap_index(void)
+{
+    FakeRing r = { };
+    Harvest h = { };
+    uint64_t next = 0;
+
+    /* The 32-bit indexes themselves overflow */
+    r.dirty_index = r.reset_index = r.fetch_index = UINT32_MAX - 5;
+    push_pages(&r, &next, 20);
+    g_assert_cmpuint(harvest(&r, &h), ==, 20);
+    g_assert_cmpuint(r.fetch_index, ==, 14);
+    g_assert_cmpuint(fake_ring_reset(&r), ==, 20);
+}
+
+#define THREADED_PAGES 200000
+
+static void *producer(void *opaque)
+{
+    FakeRing *r = opaque;
+    uint64_t next = 0;
+
+    while (next < THREADED_PAGES) {
+        if (fake_ring_push(r, next / 1000, next)) {
+            next++;
+        }
+    }
+    return NULL;
+}
+
+static void test_threaded(void)
+{
+    FakeRing r = { };
+    Harvest h = { };
+    QemuThread thread;
+
+    qemu_thread_create(&thread, "producer", producer, &r,
+                       QEMU_THREAD_JOINABLE);
+    while (h.count < THREADED_PAGES) {
+        uint32_t n = harvest(&r, &h);
+
+        g_assert_cmpuint(fake_ring_reset(&r), ==, n);
+    }
+    qemu_thread_join(&thread);
+
+    g_assert_cmpuint(harvest(&r, &h), ==, 0);
+    g_assert_cmpuint(h.next, ==, THREADED_PAGES);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/kvm-dirty-ring/empty", test_empty);
+    g_test_add_func("/kvm-dirty-ring/collect", test_collect);
+    g_test_add_func("/kvm-dirty-ring/full", test_full);
+    g_test_add_func("/kvm-dirty-ring/wrap", test_wrap);
+    g_test_add_func("/kvm-dirty-ring/wrap-index", test_wrap_index);
+    g_test_add_func("/kvm-dirty-ring/threaded", test_threaded);
+    return g_test_run();
+}
@@ -756,6 +756,89 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/*
+ * With num-queues=2 and two IOThreads, each virtqueue is processed in its
+ * own IOThread.  Data written through one queue must be visible through
+ * the other.
+ */
+static void iothread_vq_mapping(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq[2];
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+    char *buf;
+    int i;
+
+    vq[0] = qvirtqueue_setup(dev, t_alloc, 0);
+    vq[1] = qvirtqueue_setup(dev, t_alloc, 1);
+
+    /* Negotiates features and exercises the first queue */
+    test_basic(dev, t_alloc, vq[0]);
+
+    /* Write through the second queue */
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 8;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "IOTHREAD1");
+
+    req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq[1], req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq[1], req_addr + 16, 512, false, true);
+    qvirtqueue_add(qts, vq[1], req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq[1], free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq[1], free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    guest_free(t_alloc, req_addr);
+
+    /* Read it back through both queues */
+    for (i = 0; i < 2; i++) {
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = 8;
+        req.data = g_malloc0(512);
+
+        req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(qts, vq[i], req_addr, 16, false, true);
+        qvirtqueue_add(qts, vq[i], req_addr + 16, 512, true, true);
+        qvirtqueue_add(qts, vq[i], req_addr + 528, 1, true, false);
+
+        qvirtqueue_kick(qts, dev, vq[i], free_head);
+
+        qvirtio_wait_used_elem(qts, dev, vq[i], free_head, NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        buf = g_malloc0(512);
+        memread(req_addr + 16, buf, 512);
+        g_assert_cmpstr(buf, ==, "IOTHREAD1");
+        g_free(buf);
+
+        guest_free(t_alloc, req_addr);
+    }
+
+    qvirtqueue_cleanup(dev->bus, vq[0], t_alloc);
+    qvirtqueue_cleanup(dev->bus, vq[1], t_alloc);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -770,6 +853,14 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_iothread_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=iothread0"
+                    " -object iothread,id=iothread1");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -787,6 +878,14 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_iothread_setup;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "num-queues=2,"
+                             "iothread-vq-mapping=iothread0:iothread1",
+    };
+    qos_add_test("iothread-vq-mapping", "virtio-blk-pci",
+                 iothread_vq_mapping, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -10,10 +10,12 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qdict.h"
 #include "hw/virtio/virtio-net.h"
+#include "net/eth.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
 
@@ -166,6 +168,176 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+/* The key of Microsoft's RSS verification suite */
+static const uint8_t rss_key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* Send VIRTIO_NET_CTRL_MQ_RSS_CONFIG and return the device's ack */
+static uint8_t rss_config(QVirtioDevice *dev, QGuestAllocator *alloc,
+                          QVirtQueue *ctrl, uint32_t hash_types,
+                          const uint16_t *table, uint16_t table_len)
+{
+    QTestState *qts = global_qtest;
+    uint8_t hdr[2] = { VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG };
+    uint8_t cfg[8 + 2 * VIRTIO_NET_RSS_MAX_TABLE_LEN + 3 + sizeof(rss_key)];
+    uint64_t req_addr;
+    uint32_t free_head;
+    size_t len = 0;
+    uint8_t ack;
+    int i;
+
+    stl_le_p(cfg, hash_types);
+    stw_le_p(cfg + 4, table_len - 1);       /* indirection_table_mask */
+    stw_le_p(cfg + 6, 0);                   /* unclassified_queue */
+    len = 8;
+    for (i = 0; i < table_len; i++, len += 2) {
+        stw_le_p(cfg + len, table[i]);
+    }
+    stw_le_p(cfg + len, 1);                 /* max_tx_vq */
+    cfg[len + 2] = sizeof(rss_key);
+    memcpy(cfg + len + 3, rss_key, sizeof(rss_key));
+    len += 3 + sizeof(rss_key);
+
+    req_addr = guest_alloc(alloc, sizeof(hdr) + len + 1);
+    memwrite(req_addr, hdr, sizeof(hdr));
+    memwrite(req_addr + sizeof(hdr), cfg, len);
+    writeb(req_addr + sizeof(hdr) + len, 0xff);
+
+    free_head = qvirtqueue_add(qts, ctrl, req_addr, sizeof(hdr), false, true);
+    qvirtqueue_add(qts, ctrl, req_addr + sizeof(hdr), len, false, true);
+    qvirtqueue_add(qts, ctrl, req_addr + sizeof(hdr) + len, 1, true, false);
+    qvirtqueue_kick(qts, dev, ctrl, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, ctrl, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    ack = readb(req_addr + sizeof(hdr) + len);
+    guest_free(alloc, req_addr);
+    return ack;
+}
+
+/*
+ * Receive an IPv4 packet with the given addresses and ports and return
+ * the hash reported in its virtio_net_hdr_v1_hash.
+ */
+static uint32_t rss_rx(QVirtioDevice *dev, QGuestAllocator *alloc,
+                       QVirtQueue *rx, int socket, uint8_t proto,
+                       const uint8_t *src, const uint8_t *dst,
+                       uint16_t sport, uint16_t dport, uint16_t *report)
+{
+    QTestState *qts = global_qtest;
+    uint8_t pkt[14 + 20 + 20] = {
+        /* Ethernet: broadcast, from a locally administered address */
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x02, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x08, 0x00,
+        /* IPv4 */
+        0x45, 0x00, 0x00, 40, 0x00, 0x00, 0x00, 0x00, 64, proto,
+    };
+    uint32_t len = htonl(sizeof(pkt));
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = pkt,
+            .iov_len = sizeof(pkt),
+        },
+    };
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint32_t hash;
+    int ret;
+
+    memcpy(pkt + 26, src, 4);
+    memcpy(pkt + 30, dst, 4);
+    stw_be_p(pkt + 34, sport);
+    stw_be_p(pkt + 36, dport);
+    if (proto == IP_PROTO_TCP) {
+        pkt[46] = 0x50;                     /* data offset */
+        pkt[47] = 0x02;                     /* SYN */
+    } else {
+        stw_be_p(pkt + 38, 20);             /* UDP length */
+    }
+
+    req_addr = guest_alloc(alloc, 128);
+
+    free_head = qvirtqueue_add(qts, rx, req_addr, 128, true, false);
+    qvirtqueue_kick(qts, dev, rx, free_head);
+
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + sizeof(pkt));
+    g_assert_cmpint(ret, ==, sizeof(len) + sizeof(pkt));
+
+    qvirtio_wait_used_elem(qts, dev, rx, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    hash = readl(req_addr + offsetof(struct virtio_net_hdr_v1_hash,
+                                     hash_value));
+    *report = readw(req_addr + offsetof(struct virtio_net_hdr_v1_hash,
+                                        hash_report));
+
+    guest_free(alloc, req_addr);
+    return hash;
+}
+
+/*
+ * The netdev has a single queue pair, so RSS can only select queue 0:
+ * check that other queues are refused, and that the hash which indexes
+ * the indirection table is the one of the verification suite.
+ */
+static void rss_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    static const uint8_t addr1[4] = { 66, 9, 149, 187 };
+    static const uint8_t addr2[4] = { 161, 142, 100, 80 };
+    static const uint8_t addr3[4] = { 199, 92, 111, 2 };
+    static const uint8_t addr4[4] = { 65, 69, 140, 83 };
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QVirtQueue *ctrl = net_if->queues[net_if->n_queues - 1];
+    uint32_t types = VIRTIO_NET_RSS_HASH_TYPE_IPv4 |
+                     VIRTIO_NET_RSS_HASH_TYPE_TCPv4;
+    uint16_t table[4] = { 0, 0, 1, 0 };
+    uint16_t report;
+    uint32_t hash;
+    int *sv = data;
+
+    if (qtest_big_endian(global_qtest)) {
+        g_test_skip("virtio 1.0 vrings are not supported on big-endian "
+                    "targets");
+        return;
+    }
+    g_assert(dev->features & (1ull << VIRTIO_NET_F_RSS));
+    g_assert(dev->features & (1ull << VIRTIO_NET_F_HASH_REPORT));
+
+    g_assert_cmpint(rss_config(dev, t_alloc, ctrl, types, table, 4), ==,
+                    VIRTIO_NET_ERR);
+    table[2] = 0;
+    g_assert_cmpint(rss_config(dev, t_alloc, ctrl, types, table, 3), ==,
+                    VIRTIO_NET_ERR);
+    g_assert_cmpint(rss_config(dev, t_alloc, ctrl, types, table, 4), ==,
+                    VIRTIO_NET_OK);
+
+    hash = rss_rx(dev, t_alloc, rx, sv[0], IP_PROTO_TCP,
+                  addr1, addr2, 2794, 1766, &report);
+    g_assert_cmphex(hash, ==, 0x51ccc178);
+    g_assert_cmpint(report, ==, VIRTIO_NET_HASH_REPORT_TCPv4);
+
+    hash = rss_rx(dev, t_alloc, rx, sv[0], IP_PROTO_TCP,
+                  addr3, addr4, 14230, 4739, &report);
+    g_assert_cmphex(hash, ==, 0xc626b0ea);
+    g_assert_cmpint(report, ==, VIRTIO_NET_HASH_REPORT_TCPv4);
+
+    /* UDPv4 is not enabled, the packet is hashed on its addresses */
+    hash = rss_rx(dev, t_alloc, rx, sv[0], IP_PROTO_UDP,
+                  addr1, addr2, 2794, 1766, &report);
+    g_assert_cmphex(hash, ==, 0x323e8fc2);
+    g_assert_cmpint(report, ==, VIRTIO_NET_HASH_REPORT_IPv4);
+}
+
 #endif
 
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -326,6 +498,15 @@ static void register_virtio_net_test(void)
 #endif
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
 
+#ifndef _WIN32
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "disable-legacy=on,disable-modern=off,"
+                             "mq=on,rss=on,hash=on",
+    };
+    qos_add_test("rss", "virtio-net-pci", rss_test, &opts);
+    opts.edge = (QOSGraphEdgeOptions) { };
+#endif
+
     /* These tests do not need a loopback backend.  */
     opts.before = virtio_net_test_setup_nosocket;
     opts.arg = (gpointer)UINT_MAX;
@@ -35,6 +35,13 @@ struct AioHandler
     void *opaque;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
+
+    /* Adaptive polling state, see aio_poll_adjust() */
+    int64_t poll_ns;        /* how long to busy poll this handler for */
+    bool poll_polled;       /* polled in the current aio_poll() */
+    bool poll_ready;        /* made progress while polled */
+    uint64_t poll_count;    /* aio_poll() calls that polled the handler */
+    uint64_t poll_hits;     /* ... and in which it made progress */
 };
 
 #ifdef CONFIG_EPOLL_CREATE1
@@ -271,6 +278,9 @@ void aio_set_fd_handler(AioContext *ctx,
             new_node->pfd.fd = fd;
         } else {
             new_node->pfd = node->pfd;
+            new_node->poll_ns = node->poll_ns;
+            new_node->poll_count = node->poll_count;
+            new_node->poll_hits = node->poll_hits;
         }
         g_source_add_poll(&ctx->source, &new_node->pfd);
 
@@ -509,19 +519,30 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
-static bool run_poll_handlers_once(AioContext *ctx, int64_t *timeout)
+/*
+ * Poll each handler once, skipping those whose own polling time has already
+ * run out after @elapsed_ns of busy polling.
+ */
+static bool run_poll_handlers_once(AioContext *ctx, int64_t elapsed_ns,
+                                   int64_t *timeout)
 {
     bool progress = false;
     AioHandler *node;
 
     QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->io_poll &&
-            aio_node_check(ctx, node->is_external) &&
-            node->io_poll(node->opaque)) {
+        if (node->deleted || !node->io_poll ||
+            !aio_node_check(ctx, node->is_external) ||
+            elapsed_ns > node->poll_ns) {
+            continue;
+        }
+
+        node->poll_polled = true;
+        if (node->io_poll(node->opaque)) {
             /*
              * Polling was successful, exit try_poll_mode immediately
              * to adjust the next polling time.
              */
+            node->poll_ready = true;
             *timeout = 0;
             if (node->opaque != &ctx->notifier) {
                 progress = true;
@@ -550,7 +571,7 @@ static bool run_poll_handlers_once(AioContext *ctx, int64_t *timeout)
 static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
 {
     bool progress;
-    int64_t start_time, elapsed_time;
+    int64_t start_time, elapsed_time = 0;
 
     assert(ctx->notify_me);
     assert(qemu_lockcnt_count(&ctx->list_lock) > 0);
@@ -559,7 +580,7 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
 
     start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     do {
-        progress = run_poll_handlers_once(ctx, timeout);
+        progress = run_poll_handlers_once(ctx, elapsed_time, timeout);
         elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
         max_ns = qemu_soonest_timeout(*timeout, max_ns);
         assert(!(max_ns && progress));
@@ -604,7 +625,85 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
     /* Even if we don't run busy polling, try polling once in case it can make
      * progress and the caller will be able to avoid ppoll(2)/epoll_wait(2).
      */
-    return run_poll_handlers_once(ctx, timeout);
+    return run_poll_handlers_once(ctx, 0, timeout);
+}
+
+/* Grow or shrink a polling time given that the wait took @block_ns */
+static int64_t aio_poll_adjust_ns(AioContext *ctx, int64_t poll_ns,
+                                  int64_t block_ns)
+{
+    if (block_ns <= poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            poll_ns /= ctx->poll_shrink;
+        } else {
+            poll_ns = 0;
+        }
+    } else if (poll_ns < ctx->poll_max_ns &&
+               block_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow;
+
+        if (grow == 0) {
+            grow = 2;
+        }
+
+        if (poll_ns) {
+            poll_ns *= grow;
+        } else {
+            poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+    }
+
+    return MIN(poll_ns, ctx->poll_max_ns);
+}
+
+/*
+ * Each handler has its own polling time, adjusted only by the aio_poll()
+ * calls in which it became ready (or in which nothing happened for longer
+ * than poll_max_ns).  A handler whose events usually arrive too late for
+ * polling to catch them, such as a slow network socket, thus stops being
+ * polled without cutting the polling time of a busy virtqueue in the same
+ * AioContext.  ctx->poll_ns is how long the longest-polled handler wants.
+ */
+static void aio_poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    AioHandler *node;
+    int64_t old = ctx->poll_ns;
+    int64_t poll_ns = 0;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        bool ready;
+
+        if (node->deleted || !node->io_poll) {
+            continue;
+        }
+
+        if (node->poll_polled) {
+            node->poll_count++;
+            node->poll_hits += node->poll_ready;
+        }
+        ready = node->poll_ready ||
+                (node->pfd.revents & node->pfd.events);
+        node->poll_polled = false;
+        node->poll_ready = false;
+
+        if (ready || block_ns > ctx->poll_max_ns) {
+            node->poll_ns = aio_poll_adjust_ns(ctx, node->poll_ns, block_ns);
+        } else {
+            node->poll_ns = MIN(node->poll_ns, ctx->poll_max_ns);
+        }
+        poll_ns = MAX(poll_ns, node->poll_ns);
+    }
+
+    ctx->poll_ns = poll_ns;
+    if (poll_ns < old) {
+        trace_poll_shrink(ctx, old, poll_ns);
+    } else if (poll_ns > old) {
+        trace_poll_grow(ctx, old, poll_ns);
+    }
 }
 
 bool aio_poll(AioContext *ctx, bool blocking)
@@ -675,47 +774,6 @@ bool aio_poll(AioContext *ctx, bool blocking)
         aio_notify_accept(ctx);
     }
 
-    /* Adjust polling time */
-    if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
-
-        if (block_ns <= ctx->poll_ns) {
-            /* This is the sweet spot, no adjustment needed */
-        } else if (block_ns > ctx->poll_max_ns) {
-            /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
-
-            if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
-            } else {
-                ctx->poll_ns = 0;
-            }
-
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
-            /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
-            int64_t grow = ctx->poll_grow;
-
-            if (grow == 0) {
-                grow = 2;
-            }
-
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
-            } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
-            }
-
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
-            }
-
-            trace_poll_grow(ctx, old, ctx->poll_ns);
-        }
-    }
-
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         for (i = 0; i < npfd; i++) {
@@ -723,6 +781,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    /* Adjust polling time */
+    if (ctx->poll_max_ns) {
+        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+        aio_poll_adjust(ctx, block_ns);
+    }
+
     npfd = 0;
 
     progress |= aio_bh_poll(ctx);
@@ -772,3 +837,20 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
 
     aio_notify(ctx);
 }
+
+void aio_context_foreach_poll_handler(AioContext *ctx,
+                                      AioPollHandlerStatsFn *fn,
+                                      void *opaque)
+{
+    AioHandler *node;
+
+    /* Keeps nodes from being freed; the counters may be slightly stale */
+    qemu_lockcnt_inc(&ctx->list_lock);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll) {
+            fn(opaque, node->pfd.fd, node->poll_ns,
+               node->poll_count, node->poll_hits);
+        }
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+}
@@ -410,3 +410,9 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
         error_setg(errp, "AioContext polling is not implemented on Windows");
     }
 }
+
+void aio_context_foreach_poll_handler(AioContext *ctx,
+                                      AioPollHandlerStatsFn *fn,
+                                      void *opaque)
+{
+}
@@ -487,3 +487,255 @@ void bitmap_copy_with_dst_offset(unsigned long *dst, const unsigned long *src,
         *dst |= (*src & last_mask) << shift;
     }
 }
+
+/*
+ * Scanning of large, mostly empty bitmaps such as the dirty bitmaps used
+ * for migration.  The kernels return the index of the first non-zero word
+ * in [start, end), or end if there is none.  The vectorized versions test
+ * a whole cache line (or two) of words at a time and are selected at
+ * runtime like the buffer_is_zero() accelerators.
+ */
+
+static long next_nonzero_word_int(const unsigned long *map,
+                                  long start, long end)
+{
+    long i = start;
+
+    for (; i + 4 <= end; i += 4) {
+        if (map[i] | map[i + 1] | map[i + 2] | map[i + 3]) {
+            break;
+        }
+    }
+    while (i < end && !map[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* See bufferiszero.c for the push_options dance.  */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+#define SSE2_STEP  (4 * sizeof(__m128i) / sizeof(unsigned long))
+
+static long next_nonzero_word_sse2(const unsigned long *map,
+                                   long start, long end)
+{
+    __m128i zero = _mm_setzero_si128();
+    long i = start;
+
+    for (; i + SSE2_STEP <= end; i += SSE2_STEP) {
+        const __m128i *p = (const __m128i *)(map + i);
+        __m128i t = _mm_loadu_si128(p) | _mm_loadu_si128(p + 1) |
+                    _mm_loadu_si128(p + 2) | _mm_loadu_si128(p + 3);
+
+        if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF)) {
+            break;
+        }
+    }
+    while (i < end && !map[i]) {
+        i++;
+    }
+    return i;
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define AVX2_STEP  (4 * sizeof(__m256i) / sizeof(unsigned long))
+
+static long next_nonzero_word_avx2(const unsigned long *map,
+                                   long start, long end)
+{
+    long i = start;
+
+    for (; i + AVX2_STEP <= end; i += AVX2_STEP) {
+        const __m256i *p = (const __m256i *)(map + i);
+        __m256i t = _mm256_loadu_si256(p) | _mm256_loadu_si256(p + 1) |
+                    _mm256_loadu_si256(p + 2) | _mm256_loadu_si256(p + 3);
+
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            break;
+        }
+    }
+    while (i < end && !map[i]) {
+        i++;
+    }
+    return i;
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* As in bufferiszero.c, the most preferred ISA has the lowest bit.  */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL next_nonzero_word_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL next_nonzero_word_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static long (*next_nonzero_word_accel)(const unsigned long *, long, long) =
+    INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    long (*fn)(const unsigned long *, long, long) = next_nonzero_word_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = next_nonzero_word_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = next_nonzero_word_avx2;
+    }
+#endif
+    next_nonzero_word_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_bitmap_next_accel(void)
+{
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+static long next_nonzero_word(const unsigned long *map, long start, long end)
+{
+    /* Short ranges are not worth an indirect call.  */
+    if (end - start >= 16) {
+        return next_nonzero_word_accel(map, start, end);
+    }
+    return next_nonzero_word_int(map, start, end);
+}
+
+#else
+#define next_nonzero_word  next_nonzero_word_int
+bool test_bitmap_next_accel(void)
+{
+    return false;
+}
+#endif
+
+/**
+ * bitmap_find_next_bit - find the next set bit in a bitmap
+ * @map: The address to base the search on
+ * @size: The bitmap size in bits
+ * @start: The bitnumber to start searching at
+ *
+ * Same as find_next_bit(), but skips runs of clear words with vector
+ * instructions when the host supports them.  Use it for large bitmaps
+ * that are expected to be mostly clear.
+ */
+unsigned long bitmap_find_next_bit(const unsigned long *map,
+                                   unsigned long size,
+                                   unsigned long start)
+{
+    long word, nwords;
+    unsigned long bits;
+
+    if (start >= size) {
+        return size;
+    }
+
+    word = BIT_WORD(start);
+    nwords = BITS_TO_LONGS(size);
+    bits = atomic_read(&map[word]) & BITMAP_FIRST_WORD_MASK(start);
+
+    /*
+     * The bitmap may be cleared concurrently, so re-check the word that
+     * the scan stopped at.
+     */
+    while (!bits) {
+        word = next_nonzero_word(map, word + 1, nwords);
+        if (word >= nwords) {
+            return size;
+        }
+        bits = atomic_read(&map[word]);
+    }
+
+    return MIN(word * BITS_PER_LONG + ctzl(bits), size);
+}
+
+/**
+ * bitmap_merge_and_clear_atomic - move the set bits of a bitmap into another
+ * @dst: The destination bitmap
+ * @src: The source bitmap, which may be set concurrently by other threads
+ * @nr: The number of bits to move, a multiple of BITS_PER_LONG
+ * @src_count: Incremented by the number of bits that were set in @src
+ *
+ * Or @src into @dst and clear @src.  Each word of @src is fetched and
+ * cleared atomically, so that no concurrently set bit is lost; @dst is
+ * updated non-atomically.
+ *
+ * Returns the number of bits that were newly set in @dst.
+ */
+long bitmap_merge_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                   long nr, long *src_count)
+{
+    long nwords = nr / BITS_PER_LONG;
+    long new_dirty = 0;
+    long i;
+
+    assert(nr % BITS_PER_LONG == 0);
+
+    for (i = next_nonzero_word(src, 0, nwords); i < nwords;
+         i = next_nonzero_word(src, i + 1, nwords)) {
+        unsigned long bits = atomic_xchg(&src[i], 0);
+
+        *src_count += ctpopl(bits);
+        new_dirty += ctpopl(bits & ~dst[i]);
+        dst[i] |= bits;
+    }
+
+    return new_dirty;
+}
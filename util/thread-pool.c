@@ -39,12 +39,18 @@ struct ThreadPoolElement {
     void *arg;
 
     /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+     * that, only the worker thread can write to it.  ret is handed to
+     * the completion bottom half through done_list, whose atomic
+     * operations order it.
      */
     enum ThreadState state;
     int ret;
 
+    /* Links the element into submit_list, and later into done_list
+     * and completed.  An element is on at most one of them at a time.
+     */
+    QSLIST_ENTRY(ThreadPoolElement) next;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -63,16 +69,96 @@ struct ThreadPool {
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+
+    /* New requests are pushed here without taking lock; workers move
+     * them to request_list in batches.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) submit_list;
+
+    /* Finished requests, pushed by the workers and popped by
+     * thread_pool_completion_bh.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
+    /* The following variables are accessed with atomic operations.  */
+    int idle_threads;
+    int pending_wakeups; /* sem posts not yet consumed by a worker */
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
 };
 
+static bool thread_pool_submit_list_empty(ThreadPool *pool)
+{
+    return atomic_read(&pool->submit_list.slh_first) == NULL;
+}
+
+/* Move everything thread_pool_submit_aio() pushed since the last call to
+ * request_list.  submit_list is LIFO, so each element is inserted right
+ * after the old tail; this keeps request_list in submission order.
+ *
+ * Runs with lock taken.
+ */
+static void thread_pool_move_submitted(ThreadPool *pool)
+{
+    QSLIST_HEAD(, ThreadPoolElement) batch;
+    ThreadPoolElement *last = QTAILQ_LAST(&pool->request_list);
+    ThreadPoolElement *req;
+
+    QSLIST_MOVE_ATOMIC(&batch, &pool->submit_list);
+    while ((req = QSLIST_FIRST(&batch)) != NULL) {
+        QSLIST_REMOVE_HEAD(&batch, next);
+        if (last) {
+            QTAILQ_INSERT_AFTER(&pool->request_list, last, req, reqs);
+        } else {
+            QTAILQ_INSERT_HEAD(&pool->request_list, req, reqs);
+        }
+    }
+}
+
+/* Runs with lock taken.  */
+static ThreadPoolElement *thread_pool_take_request(ThreadPool *pool)
+{
+    ThreadPoolElement *req;
+
+    if (QTAILQ_EMPTY(&pool->request_list)) {
+        thread_pool_move_submitted(pool);
+    }
+
+    req = QTAILQ_FIRST(&pool->request_list);
+    if (req) {
+        QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        req->state = THREAD_ACTIVE;
+    }
+    return req;
+}
+
+/* Hand a finished request to the completion bottom half.  Only the request
+ * that finds done_list empty schedules it; later ones are picked up by the
+ * same run.
+ */
+static void thread_pool_push_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    /* Same as QSLIST_INSERT_HEAD_ATOMIC, but we need the old head: req may
+     * be freed by the bottom half as soon as it is on the list.
+     */
+    do {
+        old = atomic_read(&pool->done_list.slh_first);
+        req->next.sle_next = old;
+    } while (atomic_cmpxchg(&pool->done_list.slh_first, old, req) != old);
+
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -85,32 +171,46 @@ static void *worker_thread(void *opaque)
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
+        req = thread_pool_take_request(pool);
+        if (!req) {
+            atomic_inc(&pool->idle_threads);
             qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
+
+            /* Pairs with smp_mb() in thread_pool_submit_aio: either we see
+             * the new request here, or the submitter sees us idle and
+             * posts the semaphore.
+             */
+            smp_mb();
+            ret = 0;
+            if (thread_pool_submit_list_empty(pool)) {
+                ret = qemu_sem_timedwait(&pool->sem, 10000);
+                if (ret == 0) {
+                    atomic_dec(&pool->pending_wakeups);
+                }
+            }
+
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
-        }
+            atomic_dec(&pool->idle_threads);
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
+            /* Same pairing: a request submitted after this check sees
+             * idle_threads without us and spawns a new worker if needed.
+             */
+            smp_mb();
+            if (ret == -1 && QTAILQ_EMPTY(&pool->request_list) &&
+                thread_pool_submit_list_empty(pool)) {
+                break;
+            }
+            continue;
+        }
         qemu_mutex_unlock(&pool->lock);
 
         ret = req->func(req->arg);
 
         req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
         req->state = THREAD_DONE;
+        thread_pool_push_done(pool, req);
 
         qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
     }
 
     pool->cur_threads--;
@@ -162,43 +262,47 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    for (;;) {
+        /* completed is shared with nested invocations, which may run from
+         * aio_poll() in a callback; only refill it once it is drained.
+         */
+        if (QSLIST_EMPTY(&pool->completed)) {
+            QSLIST_MOVE_ATOMIC(&pool->completed, &pool->done_list);
+            if (QSLIST_EMPTY(&pool->completed)) {
+                break;
+            }
         }
 
+        elem = QSLIST_FIRST(&pool->completed);
+        QSLIST_REMOVE_HEAD(&pool->completed, next);
+
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
 
         if (elem->common.cb) {
-            /* Read state before ret.  */
-            smp_rmb();
-
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
+             * Requests that complete later schedule us themselves.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QSLIST_EMPTY(&pool->completed)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             aio_context_release(pool->ctx);
             elem->common.cb(elem->common.opaque, elem->ret);
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we loop until
+             * done_list is empty.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -211,18 +315,18 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, and none can while
+         * we hold the lock.  elem may still be on submit_list, where it
+         * cannot be unlinked, so move the pending batch to request_list
+         * first.  A worker woken for elem just finds nothing to do.
          */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
+        thread_pool_move_submitted(pool);
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_push_done(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -246,6 +350,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    int idle;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -257,13 +362,28 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->submit_list, req, next);
+
+    /* Pairs with smp_mb() in worker_thread.  */
+    smp_mb();
+
+    /* Wake at most one idle worker per posted semaphore.  A worker drains
+     * all queued requests before going back to sleep, so requests that
+     * arrive while a wakeup is pending ride along with it.
+     */
+    idle = atomic_read(&pool->idle_threads);
+    if (idle > atomic_read(&pool->pending_wakeups)) {
+        atomic_inc(&pool->pending_wakeups);
+        qemu_sem_post(&pool->sem);
+    } else if (idle == 0 &&
+               atomic_read(&pool->cur_threads) < pool->max_threads) {
+        /* cur_threads is only a hint outside the lock; check it again.  */
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -311,6 +431,9 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->completed);
+    QSLIST_INIT(&pool->submit_list);
+    QSLIST_INIT(&pool->done_list);
     QTAILQ_INIT(&pool->request_list);
 }
 
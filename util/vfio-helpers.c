@@ -21,6 +21,7 @@
 #include "standard-headers/linux/pci_regs.h"
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
+#include "qemu/iova-tree.h"
 #include "trace.h"
 
 #define QEMU_VFIO_DEBUG 0
@@ -32,13 +33,6 @@
  **/
 #define QEMU_VFIO_IOVA_MAX (1ULL << 39)
 
-typedef struct {
-    /* Page aligned addr. */
-    void *host;
-    size_t size;
-    uint64_t iova;
-} IOVAMapping;
-
 struct QEMUVFIOState {
     QemuMutex lock;
 
@@ -84,11 +78,14 @@ struct QEMUVFIOState {
      *   mappings. At each qemu_vfio_dma_reset_temporary() call, the whole area
      *   is recycled. The caller should make sure I/O's depending on these
      *   mappings are completed before calling.
+     *
+     * Fixed mappings are kept in @mappings.  The tree is keyed by host
+     * address: DMAMap.iova is the page aligned host address and
+     * DMAMap.translated_addr the IOVA it is mapped to.
      **/
     uint64_t low_water_mark;
     uint64_t high_water_mark;
-    IOVAMapping *mappings;
-    int nr_mappings;
+    IOVATree *mappings;
 };
 
 /**
@@ -411,6 +408,7 @@ static int qemu_vfio_init_ramblock(RAMBlock *rb, void *opaque)
 static void qemu_vfio_open_common(QEMUVFIOState *s)
 {
     qemu_mutex_init(&s->lock);
+    s->mappings = iova_tree_new();
     s->ram_notifier.ram_block_added = qemu_vfio_ram_block_added;
     s->ram_notifier.ram_block_removed = qemu_vfio_ram_block_removed;
     ram_block_notifier_add(&s->ram_notifier);
@@ -436,99 +434,52 @@ QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
     return s;
 }
 
-static void qemu_vfio_dump_mapping(IOVAMapping *m)
+static gboolean qemu_vfio_dump_mapping(DMAMap *m)
 {
-    if (QEMU_VFIO_DEBUG) {
-        printf("  vfio mapping %p %" PRIx64 " to %" PRIx64 "\n", m->host,
-               (uint64_t)m->size, (uint64_t)m->iova);
-    }
+    printf("  vfio mapping %p %" PRIx64 " to %" PRIx64 "\n",
+           (void *)(uintptr_t)m->iova, (uint64_t)m->size + 1,
+           (uint64_t)m->translated_addr);
+    return false;
 }
 
 static void qemu_vfio_dump_mappings(QEMUVFIOState *s)
 {
-    int i;
-
     if (QEMU_VFIO_DEBUG) {
         printf("vfio mappings\n");
-        for (i = 0; i < s->nr_mappings; ++i) {
-            qemu_vfio_dump_mapping(&s->mappings[i]);
-        }
+        iova_tree_foreach(s->mappings, qemu_vfio_dump_mapping);
     }
 }
 
 /**
- * Find the mapping entry that contains [host, host + size) and set @index to
- * the position. If no entry contains it, @index is the position _after_ which
- * to insert the new mapping. IOW, it is the index of the largest element that
- * is smaller than @host, or -1 if no entry is.
+ * Find the fixed mapping entry that contains @host.
  */
-static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
-                                           int *index)
+static DMAMap *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host)
 {
-    IOVAMapping *p = s->mappings;
-    IOVAMapping *q = p ? p + s->nr_mappings - 1 : NULL;
-    IOVAMapping *mid;
     trace_qemu_vfio_find_mapping(s, host);
-    if (!p) {
-        *index = -1;
-        return NULL;
-    }
-    while (true) {
-        mid = p + (q - p) / 2;
-        if (mid == p) {
-            break;
-        }
-        if (mid->host > host) {
-            q = mid;
-        } else if (mid->host < host) {
-            p = mid;
-        } else {
-            break;
-        }
-    }
-    if (mid->host > host) {
-        mid--;
-    } else if (mid < &s->mappings[s->nr_mappings - 1]
-               && (mid + 1)->host <= host) {
-        mid++;
-    }
-    *index = mid - &s->mappings[0];
-    if (mid >= &s->mappings[0] &&
-        mid->host <= host && mid->host + mid->size > host) {
-        assert(mid < &s->mappings[s->nr_mappings]);
-        return mid;
-    }
-    /* At this point *index + 1 is the right position to insert the new
-     * mapping.*/
-    return NULL;
+    return iova_tree_find_address(s->mappings, (uintptr_t)host);
 }
 
 /**
- * Allocate IOVA and and create a new mapping record and insert it in @s.
+ * Record a new fixed mapping of [host, host + size) at @iova in @s.
  */
-static IOVAMapping *qemu_vfio_add_mapping(QEMUVFIOState *s,
-                                          void *host, size_t size,
-                                          int index, uint64_t iova)
+static void qemu_vfio_add_mapping(QEMUVFIOState *s, void *host, size_t size,
+                                  uint64_t iova)
 {
-    int shift;
-    IOVAMapping m = {.host = host, .size = size, .iova = iova};
-    IOVAMapping *insert;
+    int ret;
+    DMAMap m = {
+        .iova = (uintptr_t)host,
+        .translated_addr = iova,
+        .size = size - 1,
+        .perm = IOMMU_RW,
+    };
 
     assert(QEMU_IS_ALIGNED(size, getpagesize()));
     assert(QEMU_IS_ALIGNED(s->low_water_mark, getpagesize()));
     assert(QEMU_IS_ALIGNED(s->high_water_mark, getpagesize()));
-    trace_qemu_vfio_new_mapping(s, host, size, index, iova);
-
-    assert(index >= 0);
-    s->nr_mappings++;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-    insert = &s->mappings[index];
-    shift = s->nr_mappings - index - 1;
-    if (shift) {
-        memmove(insert + 1, insert, shift * sizeof(s->mappings[0]));
-    }
-    *insert = m;
-    return insert;
+    trace_qemu_vfio_new_mapping(s, host, size, iova);
+
+    ret = iova_tree_insert(s->mappings, &m);
+    assert(ret == IOVA_OK);
 }
 
 /* Do the DMA mapping with VFIO. */
@@ -554,50 +505,23 @@ static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
 /**
  * Undo the DMA mapping from @s with VFIO, and remove from mapping list.
  */
-static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
+static void qemu_vfio_undo_mapping(QEMUVFIOState *s, DMAMap *mapping,
                                    Error **errp)
 {
-    int index;
+    DMAMap m = *mapping;
     struct vfio_iommu_type1_dma_unmap unmap = {
         .argsz = sizeof(unmap),
         .flags = 0,
-        .iova = mapping->iova,
-        .size = mapping->size,
+        .iova = m.translated_addr,
+        .size = m.size + 1,
     };
 
-    index = mapping - s->mappings;
-    assert(mapping->size > 0);
-    assert(QEMU_IS_ALIGNED(mapping->size, getpagesize()));
-    assert(index >= 0 && index < s->nr_mappings);
+    assert(QEMU_IS_ALIGNED(unmap.size, getpagesize()));
     if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
         error_setg(errp, "VFIO_UNMAP_DMA failed: %d", -errno);
     }
-    memmove(mapping, &s->mappings[index + 1],
-            sizeof(s->mappings[0]) * (s->nr_mappings - index - 1));
-    s->nr_mappings--;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-}
-
-/* Check if the mapping list is (ascending) ordered. */
-static bool qemu_vfio_verify_mappings(QEMUVFIOState *s)
-{
-    int i;
-    if (QEMU_VFIO_DEBUG) {
-        for (i = 0; i < s->nr_mappings - 1; ++i) {
-            if (!(s->mappings[i].host < s->mappings[i + 1].host)) {
-                fprintf(stderr, "item %d not sorted!\n", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-            if (!(s->mappings[i].host + s->mappings[i].size <=
-                  s->mappings[i + 1].host)) {
-                fprintf(stderr, "item %d overlap with next!\n", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-        }
-    }
-    return true;
+    /* This frees @mapping */
+    iova_tree_remove(s->mappings, &m);
 }
 
 /* Map [host, host + size) area into a contiguous IOVA address space, and store
@@ -609,35 +533,35 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
                       bool temporary, uint64_t *iova)
 {
     int ret = 0;
-    int index;
-    IOVAMapping *mapping;
+    DMAMap *mapping;
     uint64_t iova0;
 
     assert(QEMU_PTR_IS_ALIGNED(host, getpagesize()));
     assert(QEMU_IS_ALIGNED(size, getpagesize()));
     trace_qemu_vfio_dma_map(s, host, size, temporary, iova);
     qemu_mutex_lock(&s->lock);
-    mapping = qemu_vfio_find_mapping(s, host, &index);
+    mapping = qemu_vfio_find_mapping(s, host);
     if (mapping) {
-        iova0 = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
+        iova0 = mapping->translated_addr + ((uintptr_t)host - mapping->iova);
     } else {
         if (s->high_water_mark - s->low_water_mark + 1 < size) {
             ret = -ENOMEM;
             goto out;
         }
         if (!temporary) {
-            iova0 = s->low_water_mark;
-            mapping = qemu_vfio_add_mapping(s, host, size, index + 1, iova0);
-            if (!mapping) {
-                ret = -ENOMEM;
+            DMAMap range = { .iova = (uintptr_t)host, .size = size - 1 };
+
+            if (iova_tree_find(s->mappings, &range)) {
+                /* Overlaps with another fixed mapping */
+                ret = -EEXIST;
                 goto out;
             }
-            assert(qemu_vfio_verify_mappings(s));
+            iova0 = s->low_water_mark;
             ret = qemu_vfio_do_mapping(s, host, size, iova0);
             if (ret) {
-                qemu_vfio_undo_mapping(s, mapping, NULL);
                 goto out;
             }
+            qemu_vfio_add_mapping(s, host, size, iova0);
             s->low_water_mark += size;
             qemu_vfio_dump_mappings(s);
         } else {
@@ -657,6 +581,28 @@ out:
     return ret;
 }
 
+/* Look up the IOVA of [host, host + size) if it lies within a single fixed
+ * mapping.  Unlike qemu_vfio_dma_map(), this never creates a mapping and
+ * therefore never issues a VFIO ioctl.  Returns -ENOENT if the area is not
+ * covered by a fixed mapping.
+ */
+int qemu_vfio_dma_lookup(QEMUVFIOState *s, void *host, size_t size,
+                         uint64_t *iova)
+{
+    DMAMap *mapping;
+    int ret = -ENOENT;
+
+    qemu_mutex_lock(&s->lock);
+    mapping = qemu_vfio_find_mapping(s, host);
+    if (mapping &&
+        (uintptr_t)host + size - 1 <= mapping->iova + mapping->size) {
+        *iova = mapping->translated_addr + ((uintptr_t)host - mapping->iova);
+        ret = 0;
+    }
+    qemu_mutex_unlock(&s->lock);
+    return ret;
+}
+
 /* Reset the high watermark and free all "temporary" mappings. */
 int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
 {
@@ -682,8 +628,7 @@ int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
  * qemu_vfio_dma_map(). */
 void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 {
-    int index = 0;
-    IOVAMapping *m;
+    DMAMap *m;
 
     if (!host) {
         return;
@@ -691,7 +636,7 @@ void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 
     trace_qemu_vfio_dma_unmap(s, host);
     qemu_mutex_lock(&s->lock);
-    m = qemu_vfio_find_mapping(s, host, &index);
+    m = qemu_vfio_find_mapping(s, host);
     if (!m) {
         goto out;
     }
@@ -708,14 +653,21 @@ static void qemu_vfio_reset(QEMUVFIOState *s)
 /* Close and free the VFIO resources. */
 void qemu_vfio_close(QEMUVFIOState *s)
 {
-    int i;
+    /* All fixed mappings lie below the low water mark */
+    struct vfio_iommu_type1_dma_unmap unmap = {
+        .argsz = sizeof(unmap),
+        .flags = 0,
+        .iova = QEMU_VFIO_IOVA_MIN,
+    };
 
     if (!s) {
         return;
     }
-    for (i = 0; i < s->nr_mappings; ++i) {
-        qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
+    unmap.size = s->low_water_mark - QEMU_VFIO_IOVA_MIN;
+    if (unmap.size && ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
+        error_report("VFIO_UNMAP_DMA: %d", -errno);
     }
+    iova_tree_destroy(s->mappings);
     ram_block_notifier_remove(&s->ram_notifier);
     qemu_vfio_reset(s);
     close(s->device);
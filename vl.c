@@ -130,6 +130,7 @@ int main(int argc, char **argv)
 #include "qapi/qmp/qerror.h"
 #include "sysemu/iothread.h"
 #include "qemu/guest-random.h"
+#include "qemu/plugin.h"
 
 #define MAX_VIRTIO_CONSOLES 1
 
@@ -305,6 +306,16 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "ebb-regalloc",
+            .type = QEMU_OPT_BOOL,
+            .help = "Keep TCG globals in registers across conditional branches",
+        },
+        {
+            .name = "dirty-ring-size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Size of the KVM dirty ring of each vCPU (0 = disabled)",
+        },
         { /* end of list */ }
     },
 };
@@ -2904,6 +2915,7 @@ int main(int argc, char **argv, char **envp)
     bool list_data_dirs = false;
     char *dir, **dirs;
     BlockdevOptionsQueue bdo_queue = QSIMPLEQ_HEAD_INITIALIZER(bdo_queue);
+    QemuPluginList plugin_list = QTAILQ_HEAD_INITIALIZER(plugin_list);
 
     os_set_line_buffering();
 
@@ -2934,6 +2946,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_global_opts);
     qemu_add_opts(&qemu_mon_opts);
     qemu_add_opts(&qemu_trace_opts);
+    qemu_plugin_add_opts();
     qemu_add_opts(&qemu_option_rom_opts);
     qemu_add_opts(&qemu_machine_opts);
     qemu_add_opts(&qemu_accel_opts);
@@ -3712,6 +3725,9 @@ int main(int argc, char **argv, char **envp)
                 g_free(trace_file);
                 trace_file = trace_opt_parse(optarg);
                 break;
+            case QEMU_OPTION_plugin:
+                qemu_plugin_opt_parse(optarg, &plugin_list);
+                break;
             case QEMU_OPTION_readconfig:
                 {
                     int ret = qemu_read_config_file(optarg);
@@ -4016,6 +4032,11 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    /* the plugins are told about the number of vCPUs when installed */
+    if (qemu_plugin_load_list(&plugin_list)) {
+        exit(1);
+    }
+
     /*
      * Get the default machine options from the machine if it is not already
      * specified either by the configuration file or by the command line.